@@ -0,0 +1,85 @@
+#!/usr/bin/env bash
+#
+# Measures the TCP throughput (iperf3 with QUEUES parallel streams) between two containers
+# on a bridge, once with the default link and once with '--mtu 9000 --queues QUEUES
+# --gro on'. Each mode gets a network of its own, since a bridge takes the smallest MTU
+# of its ports, and both networks are removed at the end.
+#
+# Usage: sudo scripts/bench_link_tuning.sh [kapsel] [root-dir] [seconds] [queues]
+# The rootfs (ROOTFS, by default ubuntu) needs sh, cat, sleep and iperf3.
+
+set -u
+
+KAPSEL=${1:-./build/kapsel}
+ROOT_DIR=${2:-../res}
+SECONDS_PER_TEST=${3:-10}
+QUEUES=${4:-$(nproc)}
+ROOTFS=${ROOTFS:-ubuntu}
+
+fail() {
+    echo "FAIL: $*" >&2
+    exit 1
+}
+
+[ "$(id -u)" -eq 0 ] || fail "must be run as root"
+[ -x "$KAPSEL" ] || fail "$KAPSEL is not executable"
+
+workDir=$(mktemp -d)
+# Container IDs are 9 characters long, so that the names of their interfaces are unique
+prefix=$(printf "l%03d" $(( $$ % 1000 )))
+cleanup() {
+    touch "$workDir/done"
+    wait
+    "$KAPSEL" -r "$ROOT_DIR" network rm "${prefix}d" > /dev/null 2>&1
+    "$KAPSEL" -r "$ROOT_DIR" network rm "${prefix}t" > /dev/null 2>&1
+    rm -rf "$workDir"
+}
+trap cleanup EXIT
+
+# Runs the iperf3 server in a container until the file 'done' appears in the shared
+# directory, and sets serverIp to the container's address once it is listening
+start_server() {
+    local id=$1
+    shift
+    local server="iperf3 -s -D; sleep 1; cat /etc/hosts > /bench/$id.hosts; "
+    server+="while [ ! -e /bench/done ]; do sleep 0.1; done"
+    "$KAPSEL" -r "$ROOT_DIR" -t "$ROOTFS" -i "$id" -v "$workDir:/bench" "$@" \
+        run "/bin/sh -c '$server'" > "$workDir/$id.log" 2>&1 &
+    serverIp=
+    for _ in $(seq 1 100); do
+        if [ -s "$workDir/$id.hosts" ]; then
+            serverIp=$(awk -v id="$id" '$2 == id { print $1 }' "$workDir/$id.hosts")
+            return
+        fi
+        [ -n "$(jobs -r)" ] || fail "server $id exited: $(tail -3 "$workDir/$id.log")"
+        sleep 0.1
+    done
+    fail "server $id did not start"
+}
+
+# Runs iperf3 with QUEUES streams from a second container with the same link options as
+# the server, and prints the throughput the receiver saw
+run_mode() {
+    local mode=$1 network=$2
+    shift 2
+    rm -f "$workDir/done"
+    start_server "${network}0001" --bridge "$network" "$@"
+    "$KAPSEL" -r "$ROOT_DIR" -t "$ROOTFS" -i "${network}0002" --bridge "$network" "$@" \
+        run "iperf3 -c $serverIp -t $SECONDS_PER_TEST -P $QUEUES -f m" > "$workDir/$mode.log" 2>&1
+    touch "$workDir/done"
+    wait
+
+    # With several streams, the [SUM] line of the receiver comes last
+    local throughput
+    throughput=$(awk '/receiver/ { rate = $(NF - 2) " " $(NF - 1) } END { print rate }' "$workDir/$mode.log")
+    printf "%-8s %s\n" "$mode" "${throughput:-n/a}"
+}
+
+"$KAPSEL" -r "$ROOT_DIR" network create "${prefix}d" --subnet "${SUBNET_DEFAULT:-10.234.0.0/24}" > /dev/null ||
+    fail "could not create network ${prefix}d"
+"$KAPSEL" -r "$ROOT_DIR" network create "${prefix}t" --subnet "${SUBNET_TUNED:-10.235.0.0/24}" > /dev/null ||
+    fail "could not create network ${prefix}t"
+
+echo "iperf3 with $QUEUES streams for $SECONDS_PER_TEST s"
+run_mode default "${prefix}d"
+run_mode tuned "${prefix}t" --mtu 9000 --queues "$QUEUES" --gro on
@@ -0,0 +1,92 @@
+#!/usr/bin/env bash
+#
+# Measures the throughput (iperf3) and request/response latency (netperf TCP_RR) between
+# two containers for each network driver. The veth and netkit containers share the
+# default bridge, while the macvlan and ipvlan containers sit on PARENT (by default a
+# dummy device kapsel creates) with SUBNET.
+#
+# Usage: sudo scripts/bench_network_drivers.sh [kapsel] [root-dir] [seconds] [driver...]
+# The rootfs (ROOTFS, by default ubuntu) needs sh, cat, sleep, iperf3, netperf and
+# netserver. A driver whose containers cannot be started, e.g. since the kernel does not
+# support it, is reported and skipped.
+
+set -u
+
+KAPSEL=${1:-./build/kapsel}
+ROOT_DIR=${2:-../res}
+SECONDS_PER_TEST=${3:-10}
+shift $(( $# < 3 ? $# : 3 ))
+DRIVERS=${*:-veth netkit macvlan ipvlan-l2 ipvlan-l3}
+ROOTFS=${ROOTFS:-ubuntu}
+PARENT=${PARENT:-kbench0}
+SUBNET=${SUBNET:-10.231.0.0/24}
+
+fail() {
+    echo "FAIL: $*" >&2
+    exit 1
+}
+
+[ "$(id -u)" -eq 0 ] || fail "must be run as root"
+[ -x "$KAPSEL" ] || fail "$KAPSEL is not executable"
+
+workDir=$(mktemp -d)
+trap 'touch "$workDir/done"; wait; rm -rf "$workDir"' EXIT
+# Container IDs are 9 characters long, so that the names of their interfaces are unique
+prefix=$(printf "d%03d" $(( $$ % 1000 )))
+
+# Runs the servers in a container until the file 'done' appears in the shared directory,
+# and sets serverIp to the container's address once they are listening
+start_server() {
+    local id=$1
+    shift
+    local server="iperf3 -s -D; netserver > /dev/null; sleep 1; cat /etc/hosts > /bench/$id.hosts; "
+    server+="while [ ! -e /bench/done ]; do sleep 0.1; done"
+    "$KAPSEL" -r "$ROOT_DIR" -t "$ROOTFS" -i "$id" -v "$workDir:/bench" "$@" \
+        run "/bin/sh -c '$server'" > "$workDir/$id.log" 2>&1 &
+    serverIp=
+    for _ in $(seq 1 100); do
+        if [ -s "$workDir/$id.hosts" ]; then
+            serverIp=$(awk -v id="$id" '$2 == id { print $1 }' "$workDir/$id.hosts")
+            return
+        fi
+        # The server container has exited, e.g. since the driver is not supported
+        [ -n "$(jobs -r)" ] || return
+        sleep 0.1
+    done
+}
+
+printf "%-10s %16s %18s %16s\n" driver "throughput" "latency" "transactions"
+index=0
+for driver in $DRIVERS; do
+    index=$((index + 1))
+    case $driver in
+        veth|netkit) options=(--network-driver "$driver") ;;
+        macvlan|ipvlan-l2|ipvlan-l3) options=(--network-driver "$driver" --bridge "$PARENT" --subnet "$SUBNET") ;;
+        *) fail "unknown driver $driver" ;;
+    esac
+    rm -f "$workDir/done"
+    serverId=$(printf "%ss%04d" "$prefix" "$index")
+    start_server "$serverId" "${options[@]}"
+    if [ -z "$serverIp" ]; then
+        # The error after the first failure names its cause, e.g. Errno 95 for a missing driver
+        reason=$(grep -A1 -m1 'ERR|' "$workDir/$serverId.log" | tail -1 | sed 's/.*ERR| //')
+        printf "%-10s skipped: %s\n" "$driver" "${reason:-no address}"
+        touch "$workDir/done"
+        wait
+        continue
+    fi
+
+    clientId=$(printf "%sc%04d" "$prefix" "$index")
+    client="iperf3 -c $serverIp -t $SECONDS_PER_TEST -f m; "
+    client+="netperf -H $serverIp -t TCP_RR -l $SECONDS_PER_TEST -P 0 -- -o mean_latency,throughput"
+    "$KAPSEL" -r "$ROOT_DIR" -t "$ROOTFS" -i "$clientId" "${options[@]}" \
+        run "/bin/sh -c '$client'" > "$workDir/$clientId.log" 2>&1
+    touch "$workDir/done"
+    wait
+
+    # iperf3 reports the rate seen by the receiver in its summary, and netperf the mean
+    # latency in microseconds followed by the transactions per second
+    throughput=$(awk '/receiver/ { print $(NF - 2), $(NF - 1) }' "$workDir/$clientId.log")
+    IFS=, read -r latency transactions < <(grep -E '^[0-9.]+,[0-9.]+$' "$workDir/$clientId.log")
+    printf "%-10s %16s %15s us %14s/s\n" "$driver" "${throughput:-n/a}" "${latency:-n/a}" "${transactions:-n/a}"
+done
@@ -0,0 +1,71 @@
+#!/usr/bin/env bash
+#
+# Times COUNT sequential container launches on the default bridge for the network setup
+# of a baseline revision (by default the one before the rtnetlink layer, which shells out
+# to 'ip' and 'brctl') and for the given kapsel binary.
+# Each launch is timed from the start of kapsel until the container sees its default
+# route, since the baseline configures the network in the background while the command
+# already runs.
+#
+# Usage: sudo scripts/bench_network_setup.sh [kapsel] [root-dir] [count] [baseline-rev]
+# The baseline is built with cmake in a temporary git worktree.
+# The rootfs (ROOTFS, by default ubuntu) needs sh and a mounted /proc.
+
+set -u
+
+KAPSEL=${1:-./build/kapsel}
+ROOT_DIR=${2:-../res}
+COUNT=${3:-50}
+BASELINE_REV=${4:-$(git log --diff-filter=A --format=%h -- src/netlink.cpp | tail -1)^}
+ROOTFS=${ROOTFS:-ubuntu}
+
+fail() {
+    echo "FAIL: $*" >&2
+    exit 1
+}
+
+[ "$(id -u)" -eq 0 ] || fail "must be run as root"
+[ -x "$KAPSEL" ] || fail "$KAPSEL is not executable"
+
+workDir=$(mktemp -d)
+cleanup() {
+    git worktree remove --force "$workDir/baseline" 2> /dev/null
+    rm -rf "$workDir"
+}
+trap cleanup EXIT
+
+echo "Building baseline $(git rev-parse --short "$BASELINE_REV")"
+git worktree add --detach "$workDir/baseline" "$BASELINE_REV" > /dev/null 2>&1 || fail "checkout of $BASELINE_REV"
+cmake -S "$workDir/baseline" -B "$workDir/baseline/build" > /dev/null &&
+    cmake --build "$workDir/baseline/build" -j"$(nproc)" > /dev/null 2>&1 || fail "build of $BASELINE_REV"
+
+# Waits until the routing table of the container holds a default route
+command="/bin/sh -c 'until while read iface destination rest; do
+    [ \"\$destination\" = 00000000 ] && exit 0; done < /proc/net/route; do :; done'"
+
+# Prints the launch times of a kapsel binary in milliseconds, one per line
+time_launches() {
+    local kapsel=$1 name=$2 id start
+    for i in $(seq 1 "$COUNT"); do
+        # Container IDs are 9 characters long, so that the names of their interfaces are unique
+        id=$(printf "%s%05d" "$name" "$i")
+        start=$(date +%s%N)
+        timeout 30 "$kapsel" -r "$ROOT_DIR" -t "$ROOTFS" -i "$id" run "$command" > /dev/null 2>&1 ||
+            fail "container $id of $name did not get a default route"
+        echo $(( ($(date +%s%N) - start) / 1000000 ))
+    done
+}
+
+# Prints the mean, median, minimum and maximum of a list of numbers
+summarize() {
+    sort -n | awk '{ value[NR] = $1; sum += $1 } END {
+        printf "mean %d ms, median %d ms, min %d ms, max %d ms\n",
+            sum / NR, value[int((NR + 1) / 2)], value[1], value[NR]
+    }'
+}
+
+echo "Launching $COUNT containers with each binary"
+time_launches "$workDir/baseline/build/kapsel" bsln > "$workDir/baseline.times" || exit 1
+time_launches "$KAPSEL" rtnl > "$workDir/new.times" || exit 1
+echo "baseline: $(summarize < "$workDir/baseline.times")"
+echo "new:      $(summarize < "$workDir/new.times")"
@@ -0,0 +1,113 @@
+#!/usr/bin/env bash
+#
+# Measures the rate of new TCP connections (netperf TCP_CRR) between two containers on a
+# network with and without --notrack, and how many conntrack entries are added meanwhile.
+# Bridged packets only pass through conntrack with br_netfilter loaded, which the script
+# loads. Each mode gets a network of its own, since --notrack stays in effect for a bridge
+# once used, and both networks are removed at the end.
+#
+# Usage: sudo scripts/bench_notrack.sh [kapsel] [root-dir] [seconds] [parallel]
+# The rootfs (ROOTFS, by default ubuntu) needs sh, cat, sleep, netperf and netserver.
+# The conntrack entries are counted with 'conntrack -C' if available, and otherwise read
+# from /proc/sys/net/netfilter/nf_conntrack_count.
+# Run it while the conntrack table is close to empty, since expiring entries of earlier
+# connections, e.g. of a previous run, hide the ones added.
+
+set -u
+
+KAPSEL=${1:-./build/kapsel}
+ROOT_DIR=${2:-../res}
+SECONDS_PER_TEST=${3:-10}
+PARALLEL=${4:-4}
+ROOTFS=${ROOTFS:-ubuntu}
+
+fail() {
+    echo "FAIL: $*" >&2
+    exit 1
+}
+
+[ "$(id -u)" -eq 0 ] || fail "must be run as root"
+[ -x "$KAPSEL" ] || fail "$KAPSEL is not executable"
+modprobe br_netfilter 2> /dev/null
+[ "$(cat /proc/sys/net/bridge/bridge-nf-call-iptables 2> /dev/null)" = 1 ] ||
+    fail "br_netfilter is not loaded, so bridged packets bypass conntrack anyway"
+
+workDir=$(mktemp -d)
+# Container IDs are 9 characters long, so that the names of their interfaces are unique
+prefix=$(printf "n%03d" $(( $$ % 1000 )))
+cleanup() {
+    touch "$workDir/done"
+    wait
+    "$KAPSEL" -r "$ROOT_DIR" network rm "${prefix}t" > /dev/null 2>&1
+    "$KAPSEL" -r "$ROOT_DIR" network rm "${prefix}n" > /dev/null 2>&1
+    rm -rf "$workDir"
+}
+trap cleanup EXIT
+
+count_connections() {
+    conntrack -C 2> /dev/null || cat /proc/sys/net/netfilter/nf_conntrack_count
+}
+
+# Runs netserver in a container until the file 'done' appears in the shared directory,
+# and sets serverIp to the container's address once it is listening
+start_server() {
+    local id=$1
+    shift
+    local server="netserver > /dev/null; sleep 1; cat /etc/hosts > /bench/$id.hosts; "
+    server+="while [ ! -e /bench/done ]; do sleep 0.1; done"
+    "$KAPSEL" -r "$ROOT_DIR" -t "$ROOTFS" -i "$id" -v "$workDir:/bench" "$@" \
+        run "/bin/sh -c '$server'" > "$workDir/$id.log" 2>&1 &
+    serverIp=
+    for _ in $(seq 1 100); do
+        if [ -s "$workDir/$id.hosts" ]; then
+            serverIp=$(awk -v id="$id" '$2 == id { print $1 }' "$workDir/$id.hosts")
+            return
+        fi
+        [ -n "$(jobs -r)" ] || fail "server $id exited: $(tail -3 "$workDir/$id.log")"
+        sleep 0.1
+    done
+    fail "server $id did not start"
+}
+
+# Runs PARALLEL netperf TCP_CRR instances from a second container, while sampling the
+# number of conntrack entries, and prints the connections per second and the peak number
+# of entries added since the start
+run_mode() {
+    local mode=$1 network=$2
+    shift 2
+    rm -f "$workDir/done"
+    start_server "${network}0001" --bridge "$network" "$@"
+
+    local client="i=0; while [ \$i -lt $PARALLEL ]; do i=\$((i + 1)); "
+    client+="netperf -H $serverIp -t TCP_CRR -l $SECONDS_PER_TEST -P 0 -- -o throughput & done; wait"
+    "$KAPSEL" -r "$ROOT_DIR" -t "$ROOTFS" -i "${network}0002" --bridge "$network" "$@" \
+        run "/bin/sh -c '$client'" > "$workDir/$mode.log" 2>&1 &
+    local clientPid=$! start peak count
+    start=$(count_connections)
+    peak=$start
+    while kill -0 "$clientPid" 2> /dev/null; do
+        count=$(count_connections)
+        [ "$count" -gt "$peak" ] && peak=$count
+        sleep 0.2
+    done
+    wait "$clientPid"
+    touch "$workDir/done"
+    wait
+
+    # With -P 0 and -o throughput, each netperf instance prints its transactions per second
+    local rate
+    rate=$(awk '/^[0-9]+(\.[0-9]+)?$/ { rate += $1; instances++ }
+        END { if (instances) printf "%.0f", rate }' "$workDir/$mode.log")
+    printf "%-10s %12s conn/s %14s\n" "$mode" "${rate:-n/a}" "$((peak - start))"
+}
+
+"$KAPSEL" -r "$ROOT_DIR" network create "${prefix}t" --subnet "${SUBNET_TRACKED:-10.232.0.0/24}" > /dev/null ||
+    fail "could not create network ${prefix}t"
+"$KAPSEL" -r "$ROOT_DIR" network create "${prefix}n" --subnet "${SUBNET_NOTRACK:-10.233.0.0/24}" > /dev/null ||
+    fail "could not create network ${prefix}n"
+
+printf "%-10s %19s %14s\n" mode "rate" "added entries"
+# The entries of closed connections linger in TIME_WAIT for minutes, so the tracked mode
+# runs last
+run_mode notrack "${prefix}n" --notrack
+run_mode tracked "${prefix}t"
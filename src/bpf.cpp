@@ -0,0 +1,235 @@
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <cstddef>
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/mount.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/pkt_cls.h>
+
+#include "bpf.h"
+
+const std::string BPF_FS_DIR = "/sys/fs/bpf";
+const uint32_t BPF_FS_MAGIC_NUMBER = 0xcafe4a11;
+// Maximum number of containers on a bridge which take part in the fast path
+const uint32_t PEER_MAP_SIZE = 65536;
+
+long callBpf(int command, bpf_attr& attributes)
+{
+    return syscall(__NR_bpf, command, &attributes, sizeof(attributes));
+}
+
+/**
+ * Mounts the BPF file system on /sys/fs/bpf unless it is mounted already. Objects
+ * pinned there outlive the process which created them and can be opened by others.
+ */
+void mountBpfFileSystem()
+{
+    struct statfs fileSystem{};
+    if (statfs(BPF_FS_DIR.c_str(), &fileSystem) == 0 && fileSystem.f_type == BPF_FS_MAGIC_NUMBER)
+        return;
+    mkdir(BPF_FS_DIR.c_str(), 0700);
+    if (mount("bpf", BPF_FS_DIR.c_str(), "bpf", 0, "mode=0700") != 0 && errno != EBUSY)
+        throw std::runtime_error("Mount BPF file system: FAILED [Errno " + std::to_string(errno) + "]");
+}
+
+int getPinnedObject(const std::string& path)
+{
+    bpf_attr attributes{};
+    attributes.pathname = (uint64_t) path.c_str();
+    return (int) callBpf(BPF_OBJ_GET, attributes);
+}
+
+/**
+ * Pins the BPF object 'fd' on 'path'. If another process has pinned an object there
+ * in the meantime, closes 'fd' and returns that object instead.
+ */
+int pinObject(int fd, const std::string& path)
+{
+    bpf_attr attributes{};
+    attributes.pathname = (uint64_t) path.c_str();
+    attributes.bpf_fd = fd;
+    if (callBpf(BPF_OBJ_PIN, attributes) == 0)
+        return fd;
+    int error = errno;
+    close(fd);
+    if (error != EEXIST)
+        throw std::runtime_error("Pin " + path + ": FAILED [Errno " + std::to_string(error) + "]");
+    fd = getPinnedObject(path);
+    if (fd < 0)
+        throw std::runtime_error("Open " + path + ": FAILED [Errno " + std::to_string(errno) + "]");
+    return fd;
+}
+
+/**
+ * Opens the map of the containers on the given bridge which take part in the fast
+ * path, creating and pinning it on /sys/fs/bpf/kapsel-<bridge>-peers if necessary.
+ * The map holds the IPv4 address of each container in network byte order, mapped to
+ * the index of the host side of its veth pair.
+ *
+ * @throw runtime_error if BPF is not available.
+ */
+int openPeerMap(const std::string& bridge)
+{
+    mountBpfFileSystem();
+    std::string path = BPF_FS_DIR + "/kapsel-" + bridge + "-peers";
+    int fd = getPinnedObject(path);
+    if (fd >= 0)
+        return fd;
+
+    bpf_attr attributes{};
+    attributes.map_type = BPF_MAP_TYPE_HASH;
+    attributes.key_size = sizeof(uint32_t);
+    attributes.value_size = sizeof(uint32_t);
+    attributes.max_entries = PEER_MAP_SIZE;
+    attributes.map_flags = BPF_F_NO_PREALLOC;
+    fd = (int) callBpf(BPF_MAP_CREATE, attributes);
+    if (fd < 0)
+        throw std::runtime_error("Create BPF map: FAILED [Errno " + std::to_string(errno) + "]");
+    return pinObject(fd, path);
+}
+
+bpf_insn makeInstruction(uint8_t code, uint8_t destination, uint8_t source, int16_t offset, int32_t immediate)
+{
+    bpf_insn instruction{};
+    instruction.code = code;
+    instruction.dst_reg = destination;
+    instruction.src_reg = source;
+    instruction.off = offset;
+    instruction.imm = immediate;
+    return instruction;
+}
+
+/**
+ * Returns the instructions of the redirect program, which is attached to the ingress
+ * of the host side of a veth pair and thus sees the packets sent by its container:
+ * 1. Packets which are not IPv4 or shorter than the Ethernet and IPv4 headers pass.
+ * 2. The destination address is looked up in the peer map, where packets to unknown
+ * addresses pass and continue to the bridge.
+ * 3. Packets to known containers are redirected with bpf_redirect_peer() into the
+ * destination container's namespace, skipping the bridge and the backlog queue.
+ */
+std::vector<bpf_insn> getRedirectInstructions(int mapFd)
+{
+    auto dataOffset = (int16_t) offsetof(__sk_buff, data);
+    auto dataEndOffset = (int16_t) offsetof(__sk_buff, data_end);
+    auto headersLength = (int32_t) (ETH_HLEN + 20);
+    return {
+            // r6 = skb, r2 = data, r3 = data_end
+            makeInstruction(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+            makeInstruction(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, dataOffset, 0),
+            makeInstruction(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_6, dataEndOffset, 0),
+            // if (data + 34 > data_end) goto pass
+            makeInstruction(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0),
+            makeInstruction(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, headersLength),
+            makeInstruction(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 14, 0),
+            // if (eth->h_proto != htons(ETH_P_IP)) goto pass
+            makeInstruction(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, 12, 0),
+            makeInstruction(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_5, 0, 12, htons(ETH_P_IP)),
+            // key = ip->daddr, stored on the stack
+            makeInstruction(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_5, BPF_REG_2, ETH_HLEN + 16, 0),
+            makeInstruction(BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_5, -4, 0),
+            // r0 = bpf_map_lookup_elem(map, &key)
+            makeInstruction(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, mapFd),
+            makeInstruction(0, 0, 0, 0, 0),
+            makeInstruction(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+            makeInstruction(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -4),
+            makeInstruction(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+            // if (!r0) goto pass
+            makeInstruction(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 4, 0),
+            // return bpf_redirect_peer(*r0, 0)
+            makeInstruction(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_1, BPF_REG_0, 0, 0),
+            makeInstruction(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_2, 0, 0, 0),
+            makeInstruction(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_peer),
+            makeInstruction(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+            // pass: return TC_ACT_OK
+            makeInstruction(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, TC_ACT_OK),
+            makeInstruction(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+    };
+}
+
+/**
+ * Opens the redirect program of the given bridge, see getRedirectInstructions(). The
+ * program is loaded and verified once and pinned on /sys/fs/bpf/kapsel-<bridge>-redirect,
+ * from where the following containers on the bridge open it.
+ *
+ * @throw runtime_error if the program cannot be loaded, together with the verifier log.
+ */
+int openRedirectProgram(const std::string& bridge, int mapFd)
+{
+    std::string path = BPF_FS_DIR + "/kapsel-" + bridge + "-redirect";
+    int fd = getPinnedObject(path);
+    if (fd >= 0)
+        return fd;
+
+    auto instructions = getRedirectInstructions(mapFd);
+    std::vector<char> log(4096, 0);
+    bpf_attr attributes{};
+    attributes.prog_type = BPF_PROG_TYPE_SCHED_CLS;
+    attributes.insns = (uint64_t) instructions.data();
+    attributes.insn_cnt = instructions.size();
+    attributes.license = (uint64_t) "GPL";
+    attributes.log_buf = (uint64_t) log.data();
+    attributes.log_size = log.size();
+    attributes.log_level = 1;
+    snprintf(attributes.prog_name, sizeof(attributes.prog_name), "%s", "kapsel_redirect");
+    fd = (int) callBpf(BPF_PROG_LOAD, attributes);
+    if (fd < 0)
+        throw std::runtime_error("Load BPF program: FAILED [Errno " + std::to_string(errno) + "] " +
+                                 std::string(log.data()));
+    return pinObject(fd, path);
+}
+
+/**
+ * Adds a container to the peer map, so that packets to its address are redirected
+ * to the given link (the host side of its veth pair).
+ */
+void addPeer(int mapFd, const std::string& ip, int linkIndex)
+{
+    in_addr address{};
+    inet_pton(AF_INET, ip.c_str(), &address);
+    auto value = (uint32_t) linkIndex;
+    bpf_attr attributes{};
+    attributes.map_fd = mapFd;
+    attributes.key = (uint64_t) &address.s_addr;
+    attributes.value = (uint64_t) &value;
+    attributes.flags = BPF_ANY;
+    if (callBpf(BPF_MAP_UPDATE_ELEM, attributes) != 0)
+        throw std::runtime_error("Add " + ip + " to BPF map: FAILED [Errno " + std::to_string(errno) + "]");
+}
+
+/**
+ * Removes a container from the peer map, so that packets to its address pass to
+ * the bridge again. A container which is not in the map is not treated as an error.
+ */
+void deletePeer(int mapFd, const std::string& ip)
+{
+    in_addr address{};
+    inet_pton(AF_INET, ip.c_str(), &address);
+    bpf_attr attributes{};
+    attributes.map_fd = mapFd;
+    attributes.key = (uint64_t) &address.s_addr;
+    if (callBpf(BPF_MAP_DELETE_ELEM, attributes) != 0 && errno != ENOENT)
+        throw std::runtime_error("Delete " + ip + " from BPF map: FAILED [Errno " + std::to_string(errno) + "]");
+}
+
+/**
+ * Unpins the peer map and the redirect program of the given bridge, which are freed
+ * once no container's link holds the program anymore.
+ */
+void unpinFastPath(const std::string& bridge)
+{
+    for (const char* suffix : { "-peers", "-redirect" })
+    {
+        std::string path = BPF_FS_DIR + "/kapsel-" + bridge + suffix;
+        if (unlink(path.c_str()) != 0 && errno != ENOENT)
+            throw std::runtime_error("Unpin " + path + ": FAILED [Errno " + std::to_string(errno) + "]");
+    }
+}
@@ -0,0 +1,13 @@
+#ifndef CONTAINER_CPP_BPF_H
+#define CONTAINER_CPP_BPF_H
+
+#include <string>
+#include <cstdint>
+
+int openPeerMap(const std::string& bridge);
+int openRedirectProgram(const std::string& bridge, int mapFd);
+void addPeer(int mapFd, const std::string& ip, int linkIndex);
+void deletePeer(int mapFd, const std::string& ip);
+void unpinFastPath(const std::string& bridge);
+
+#endif //CONTAINER_CPP_BPF_H
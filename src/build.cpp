@@ -0,0 +1,203 @@
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <algorithm>
+#include <sys/stat.h>
+#include <loguru/loguru.hpp>
+
+#include "build.h"
+#include "constants.h"
+#include "container.h"
+#include "image.h"
+#include "utils.h"
+
+/**
+ * A struct representing an instruction in a Kapselfile.
+ */
+struct BuildStep
+{
+    std::string instruction;
+    std::string argument;
+    int line;
+};
+
+/**
+ * Parses a Kapselfile into a list of build steps. A Kapselfile contains one
+ * instruction per line, where a line ending with '\' continues on the next line
+ * and lines starting with '#' are comments. The supported instructions are:
+ * - FROM <distro|image-id>: the base of the image, which has to come first.
+ * - RUN <command>: executes the command in a container and saves the changes as a layer.
+ *
+ * @throw invalid_argument if the Kapselfile is malformed.
+ */
+std::vector<BuildStep> parseKapselfile(const std::string& kapselfile)
+{
+    std::ifstream file(kapselfile);
+    if (file.fail())
+        throw std::invalid_argument("[ERROR] Kapselfile " + kapselfile + " does not exist");
+
+    std::vector<BuildStep> steps;
+    std::string line, text;
+    int lineNumber = 0, startLine = 0;
+    while (std::getline(file, line))
+    {
+        lineNumber++;
+        line = trimEnd(line);
+        if (text.empty())
+        {
+            size_t start = line.find_first_not_of(" \t");
+            if (start == std::string::npos || line[start] == '#')
+                continue;
+            line = line.substr(start);
+            startLine = lineNumber;
+        }
+        if (!line.empty() && line.back() == '\\')
+        {
+            text += line.substr(0, line.size() - 1) + " ";
+            continue;
+        }
+        text += line;
+
+        size_t pos = text.find_first_of(" \t");
+        std::string instruction = text.substr(0, pos);
+        std::transform(instruction.begin(), instruction.end(), instruction.begin(), ::toupper);
+        size_t argumentStart = text.find_first_not_of(" \t", pos);
+        std::string argument = argumentStart == std::string::npos ? "" : trimEnd(text.substr(argumentStart));
+        text.clear();
+
+        if (instruction != "FROM" && instruction != "RUN")
+            throw std::invalid_argument("[ERROR] Unknown instruction " + instruction + " on line " +
+                                        std::to_string(startLine) + " of " + kapselfile);
+        if (argument.empty())
+            throw std::invalid_argument("[ERROR] " + instruction + " on line " + std::to_string(startLine) +
+                                        " of " + kapselfile + " requires an argument");
+        if ((instruction == "FROM") != steps.empty())
+            throw std::invalid_argument("[ERROR] " + kapselfile + " has to start with exactly one FROM instruction");
+        steps.push_back(BuildStep { instruction, argument, startLine });
+    }
+
+    if (steps.empty())
+        throw std::invalid_argument("[ERROR] " + kapselfile + " has to start with exactly one FROM instruction");
+    return steps;
+}
+
+/**
+ * Determines the layers of the base given to FROM, which is either a distro or
+ * an image, and computes a digest which identifies the content of the base.
+ */
+std::vector<Layer> getBaseLayers(const std::string& rootDir, const std::string& base, std::string& digest)
+{
+    if (availableDistros.count(base))
+    {
+        digest = "distro " + base;
+        return { Layer { DistroLayer, base } };
+    }
+
+    std::string manifestPath = getImageManifestPath(rootDir, base);
+    if (std::filesystem::exists(manifestPath))
+    {
+        auto layers = readManifest(manifestPath);
+        for (const auto& layer : layers)
+            digest += std::to_string(layer.type) + " " + layer.id + "\n";
+        return layers;
+    }
+
+    // A tarball image can be rebuilt under the same ID, hence its modification time is part of the digest
+    std::string archive = rootDir + "/images/" + base + ".tar.gz";
+    if (std::filesystem::exists(archive))
+    {
+        struct stat attr{};
+        stat(archive.c_str(), &attr);
+        digest = "archive " + base + " " + std::to_string(attr.st_mtime);
+        return { Layer { ArchiveLayer, base } };
+    }
+    throw std::invalid_argument("[ERROR] Base " + base + " is neither a distro nor an image");
+}
+
+/**
+ * Builds a layered image from the instructions in a Kapselfile. Each RUN instruction is
+ * executed in a new container on top of the layers produced so far, and the container's
+ * upper-dir is saved as a new layer once the command succeeds.
+ * The ID of each layer is the hash of the digest of its parent and its command, so a
+ * step whose layer already exists in <root-dir>/layers is skipped. Changing a step
+ * therefore only re-runs that step and the steps after it.
+ * While the image is built, its layers are listed in <image-id>.layers.partial, which
+ * is renamed to the manifest of the image once all the steps have succeeded.
+ */
+void buildImageFromFile(const std::string& rootDir,
+                        const std::string& imageId,
+                        const std::string& kapselfile,
+                        const ResourceLimits& resourceLimits)
+{
+    if (std::filesystem::exists(rootDir + "/images/" + imageId + ".tar.gz") ||
+        std::filesystem::exists(getImageManifestPath(rootDir, imageId)))
+        throw std::runtime_error("[ERROR] Image with ID " + imageId + " already exists");
+
+    auto steps = parseKapselfile(kapselfile);
+    std::string baseDigest;
+    std::string base = steps.front().argument;
+    auto layers = getBaseLayers(rootDir, base, baseDigest);
+    std::string parentDigest = hashString(baseDigest);
+    // Refers to the layers of the build while it runs, so that removeUnusedLayers() keeps them.
+    // It is kept if the build fails, so that the layers of the steps which succeeded are reused.
+    std::string manifestPath = getImageManifestPath(rootDir, imageId);
+    std::string partialManifestPath = manifestPath + ".partial";
+    std::filesystem::create_directories(rootDir + "/images");
+    writeManifest(partialManifestPath, layers);
+
+    LOG_F(INFO, "Building image %s from %s", imageId.c_str(), kapselfile.c_str());
+    for (size_t i = 0; i < steps.size(); i++)
+    {
+        std::cout << "Step " << i + 1 << "/" << steps.size() << " : "
+                  << steps[i].instruction << " " << steps[i].argument << std::endl;
+        if (steps[i].instruction != "RUN")
+            continue;
+
+        std::string command = steps[i].argument;
+        Layer layer { DiffLayer, hashString(parentDigest + "\n" + command) };
+        std::string layerDir = getLayerDir(rootDir, layer);
+        if (std::filesystem::exists(layerDir))
+        {
+            std::cout << " ---> Using cache " << layer.id << std::endl;
+        }
+        else
+        {
+            // The layer is referenced before it is saved, since it is saved while cleaning up the container
+            auto stepLayers = layers;
+            stepLayers.push_back(layer);
+            writeManifest(partialManifestPath, stepLayers);
+
+            std::string containerId = generateContainerId();
+            std::string distroName = availableDistros.count(base) ? base : "ubuntu";
+            std::string buildRootDir = rootDir;
+            std::vector<Volume> volumes;
+            Container* container = createContainer(distroName, containerId, buildRootDir, command,
+                                                   new ResourceLimits(resourceLimits), volumes, false, false);
+            container->layers = layers;
+
+            int exitStatus = -1;
+            if (setUpContainer(container))
+                exitStatus = startContainer(container);
+            if (exitStatus == 0)
+                container->outputLayerDir = layerDir;
+            cleanUpContainer(container);
+
+            if (exitStatus != 0)
+                throw std::runtime_error("[ERROR] Step " + std::to_string(i + 1) + " on line " +
+                                         std::to_string(steps[i].line) + " failed with exit status " +
+                                         std::to_string(exitStatus));
+            if (!std::filesystem::exists(layerDir))
+                throw std::runtime_error("Save layer for step " + std::to_string(i + 1) + ": FAILED");
+            std::cout << " ---> " << layer.id << std::endl;
+        }
+
+        layers.push_back(layer);
+        parentDigest = layer.id;
+    }
+
+    writeManifest(partialManifestPath, layers);
+    std::filesystem::rename(partialManifestPath, manifestPath);
+    std::cout << "Built image " << imageId << std::endl;
+    LOG_F(INFO, "Build image %s: SUCCESS", imageId.c_str());
+}
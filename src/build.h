@@ -0,0 +1,13 @@
+#ifndef CONTAINER_CPP_BUILD_H
+#define CONTAINER_CPP_BUILD_H
+
+#include <string>
+
+#include "container.h"
+
+void buildImageFromFile(const std::string& rootDir,
+                        const std::string& imageId,
+                        const std::string& kapselfile,
+                        const ResourceLimits& resourceLimits);
+
+#endif //CONTAINER_CPP_BUILD_H
@@ -6,12 +6,10 @@
 #define CONTAINER_CPP_CONSTANTS_H
 #include <map>
 #include <set>
-
-#define NETWORK_NS_SEM_NAME "/networkNsSemaphore"
-#define NETWORK_INIT_SEM_NAME "/networkInitSemaphore"
+#include <cstdint>
 
 enum CommandType {
-    Run, List, Delete
+    Run, List, Delete, Diff, Commit, Copy, Export, Import, Build, NetStats, NetworkCommand
 };
 
 extern std::map<std::string, CommandType> stringToCommandType;
@@ -27,10 +25,21 @@ const std::set<std::string> availableDistros = { "ubuntu", "alpine", "centos", "
 extern std::map<std::string, std::string> stringToDownloadUrl;
 
 const std::string CGROUP_FOLDER = "/sys/fs/cgroup";
+// Seconds to wait for the processes of a container to be frozen, e.g. for 'commit'
+const int FREEZE_TIMEOUT = 5;
 
 // Networking related constants
 const std::string BRIDGE_NAME = "kapsel";
-const std::string BRIDGE_IP = "107.17.0.1";
+// Subnet of the default bridge, whose first host address is assigned to the bridge
+const std::string DEFAULT_SUBNET = "107.17.0.0/16";
+// Values written by the network worker to the eventfd on which the container waits
+const uint64_t NETWORK_READY = 1;
+const uint64_t NETWORK_FAILED = 2;
+// Directory in a container started with --network-async in which its network status is published
+const std::string NETWORK_STATUS_DIR = "/run/kapsel";
 const std::string DEFAULT_NAMESERVER = "8.8.8.8";
+const uint16_t DNS_PORT = 53;
+// First file descriptor of the sockets passed to a container, see sd_listen_fds(3)
+const int LISTEN_FDS_START = 3;
 
 #endif //CONTAINER_CPP_CONSTANTS_H
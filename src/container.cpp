@@ -9,16 +9,26 @@
 #include <filesystem>
 #include <unistd.h>
 #include <cstring>
+#include <climits>
 #include <sched.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <algorithm>
+#include <set>
 #include <thread>
 #include <fcntl.h>
+#include <sys/eventfd.h>
+#include <fstream>
+#include <csignal>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/openat2.h>
 #include <loguru/loguru.hpp>
 
 #include "constants.h"
 #include "container.h"
+#include "network.h"
+#include "netstats.h"
 #include "utils.h"
 
 std::map<std::string, std::string> stringToDownloadUrl = {
@@ -56,6 +66,7 @@ long pivot_root(const char* newRoot, const char* putOld)
  * @param containerId: a string that uniquely identifies a container.
  * @param rootDir: the root directory of the container
  * @param command: the command to be executed in the container.
+ * @param volumes: the volumes that will be mounted into the container.
  * @return the created Container struct.
  */
 Container* createContainer(
@@ -64,6 +75,7 @@ Container* createContainer(
         std::string& rootDir,
         std::string& command,
         ResourceLimits* resourceLimits,
+        std::vector<Volume>& volumes,
         bool buildImage,
         bool isImage)
 {
@@ -81,32 +93,223 @@ Container* createContainer(
     getlogin_r(buffer, 128);
     container->currentUser = std::string(buffer);
     container->resourceLimits = resourceLimits;
-
-    // Initializes network semaphores
-    // Uses sem_open to create the semaphores since they will be shared among processes
-    container->networkNsSemaphore = sem_open(NETWORK_NS_SEM_NAME, O_CREAT | O_EXCL, 0600, 0);
-    container->networkInitSemaphore = sem_open(NETWORK_INIT_SEM_NAME, O_CREAT | O_EXCL, 0600, 0);
+    container->volumes = volumes;
+    container->networkMode = NetworkBridge;
+    container->network = parseNetwork(BRIDGE_NAME, DEFAULT_SUBNET);
+    container->networkPoolSize = 0;
+    container->networkNamespaceFd = -1;
+    container->networkAsync = false;
+    container->networkReadyFd = -1;
+    container->dnsStopFd = -1;
 
     return container;
 }
 
 /**
- * Sets up the root file system of the container as per the specified linux distro and the
- * root directory (the lower-dir in an overlay fs). This function performs the following actions:
+ * Parses a volume specification given to -v, --volume. The accepted formats are:
+ * - <host-path>:<container-path>[:<options>] for bind mounts
+ * - tmpfs:<container-path>[:<options>] for tmpfs volumes
+ * - shm:<container-path>[:<options>] for shared memory volumes
+ * where <options> is a comma separated list that may contain 'ro', 'rw', one of the
+ * propagation modes {'private', 'rprivate', 'shared', 'rshared', 'slave', 'rslave'}
+ * and, for tmpfs and shm volumes, mount data such as 'size=64m' or 'mode=1777'.
  *
- * 1. Checks if the cache directory exists in the root directory. Creates it if it does not.
- * 2. Checks if the rootfs archive for the specified distro exists. Fetches it from the pre-defined
- * download URL if it is not present in the cache directory.
- * 3. Extracts the rootfs archive to a specific location depending on 'buildImage' and 'isImage'.
+ * @throw invalid_argument if the specification is malformed.
+ * @return the parsed Volume struct.
+ */
+Volume parseVolume(const std::string& spec)
+{
+    static const std::map<std::string, unsigned long> propagationFlags = {
+            { "private", MS_PRIVATE },
+            { "rprivate", MS_PRIVATE | MS_REC },
+            { "shared", MS_SHARED },
+            { "rshared", MS_SHARED | MS_REC },
+            { "slave", MS_SLAVE },
+            { "rslave", MS_SLAVE | MS_REC }
+    };
+
+    auto fields = split(spec, ":");
+    if (fields.size() < 2 || fields.size() > 3 || fields[0].empty() || fields[1].empty())
+        throw std::invalid_argument("[ERROR] Invalid volume " + spec + "! Expected <source>:<target>[:<options>]");
+
+    Volume volume { Bind, fields[0], fields[1], false, 0, "" };
+    if (fields[0] == "tmpfs")
+        volume.type = Tmpfs;
+    else if (fields[0] == "shm")
+        volume.type = Shm;
+
+    if (volume.type != Bind)
+        volume.source.clear();
+    else if (volume.source.front() != '/' || !std::filesystem::exists(volume.source))
+        throw std::invalid_argument("[ERROR] Volume source " + volume.source + " must be an existing absolute path!");
+
+    if (volume.target.front() != '/')
+        throw std::invalid_argument("[ERROR] Volume target " + volume.target + " must be an absolute path!");
+
+    if (fields.size() == 3)
+    {
+        for (const auto& option : split(fields[2], ","))
+        {
+            if (option == "ro" || option == "rw")
+                volume.readOnly = option == "ro";
+            else if (propagationFlags.count(option))
+                volume.propagation = propagationFlags.at(option);
+            else if (volume.type != Bind && option.find('=') != std::string::npos)
+                volume.data += (volume.data.empty() ? "" : ",") + option;
+            else
+                throw std::invalid_argument("[ERROR] Invalid option " + option + " for volume " + spec + "!");
+        }
+    }
+    return volume;
+}
+
+/**
+ * Parses a port specification given to -P, --publish in the format
+ * <host-port>:<container-port>[/<protocol>], where <protocol> is 'tcp' (default)
+ * or 'udp'.
  *
- * Implementation based on https://github.com/Fewbytes/rubber-docker/blob/master/levels/10_setuid/rd.py
+ * @throw invalid_argument if the specification is malformed.
+ * @return the parsed PortMapping struct.
  */
-void setUpContainerImage(Container* container)
+PortMapping parsePortMapping(const std::string& spec)
+{
+    std::string ports = spec;
+    int protocol = IPPROTO_TCP;
+    size_t slash = spec.find('/');
+    if (slash != std::string::npos)
+    {
+        ports = spec.substr(0, slash);
+        std::string protocolString = spec.substr(slash + 1);
+        if (protocolString == "udp")
+            protocol = IPPROTO_UDP;
+        else if (protocolString != "tcp")
+            throw std::invalid_argument("[ERROR] Invalid protocol " + protocolString + " for port " + spec + "!");
+    }
+
+    auto fields = split(ports, ":");
+    if (fields.size() != 2)
+        throw std::invalid_argument("[ERROR] Invalid port " + spec + "! Expected <host-port>:<container-port>[/<protocol>]");
+    uint16_t numbers[2];
+    for (int i = 0; i < 2; i++)
+    {
+        if (fields[i].empty() || fields[i].size() > 5 || fields[i].find_first_not_of("0123456789") != std::string::npos ||
+            std::stoi(fields[i]) < 1 || std::stoi(fields[i]) > 65535)
+            throw std::invalid_argument("[ERROR] Invalid port number " + fields[i] + " in " + spec + "!");
+        numbers[i] = (uint16_t) std::stoi(fields[i]);
+    }
+    return PortMapping { numbers[0], numbers[1], protocol };
+}
+
+/**
+ * Parses a socket given to --listen in the format [<ip>:]<port>[/<protocol>], where
+ * <ip> is an IPv4 address of the host (all addresses by default) and <protocol> is
+ * 'tcp' (default) or 'udp'.
+ *
+ * @throw invalid_argument if the specification is malformed.
+ * @return the parsed ListenSocket struct, which is not opened yet.
+ */
+ListenSocket parseListenSocket(const std::string& spec)
+{
+    std::string endpoint = spec;
+    int protocol = IPPROTO_TCP;
+    size_t slash = spec.find('/');
+    if (slash != std::string::npos)
+    {
+        endpoint = spec.substr(0, slash);
+        std::string protocolString = spec.substr(slash + 1);
+        if (protocolString == "udp")
+            protocol = IPPROTO_UDP;
+        else if (protocolString != "tcp")
+            throw std::invalid_argument("[ERROR] Invalid protocol " + protocolString + " for socket " + spec + "!");
+    }
+
+    std::string address = "0.0.0.0";
+    std::string port = endpoint;
+    size_t colon = endpoint.rfind(':');
+    if (colon != std::string::npos)
+    {
+        address = endpoint.substr(0, colon);
+        port = endpoint.substr(colon + 1);
+        in_addr parsedAddress{};
+        if (inet_pton(AF_INET, address.c_str(), &parsedAddress) != 1)
+            throw std::invalid_argument("[ERROR] Invalid address " + address + " in " + spec + "!");
+    }
+    if (port.empty() || port.size() > 5 || port.find_first_not_of("0123456789") != std::string::npos ||
+        std::stoi(port) < 1 || std::stoi(port) > 65535)
+        throw std::invalid_argument("[ERROR] Invalid port number " + port + " in " + spec + "!");
+    return ListenSocket { address, (uint16_t) std::stoi(port), protocol, -1 };
+}
+
+/**
+ * Parses a sysctl given to --sysctl in the format <key>=<value>, e.g.
+ * net.core.somaxconn=4096. Only sysctls which are isolated per network namespace
+ * are accepted, since the others would change the host.
+ *
+ * @throw invalid_argument if the sysctl is malformed or not namespaced.
+ * @return the key and the value of the sysctl.
+ */
+std::pair<std::string, std::string> parseSysctl(const std::string& spec)
+{
+    static const std::set<std::string> namespacedSysctls = {
+            "net.core.somaxconn",
+            "net.unix.max_dgram_qlen",
+            "net.ipv4.ip_forward",
+            "net.ipv4.ip_default_ttl",
+            "net.ipv4.ip_local_port_range",
+            "net.ipv4.ip_local_reserved_ports",
+            "net.ipv4.ip_unprivileged_port_start",
+            "net.ipv4.ping_group_range",
+            "net.ipv4.tcp_congestion_control",
+            "net.ipv4.tcp_ecn",
+            "net.ipv4.tcp_fastopen",
+            "net.ipv4.tcp_fin_timeout",
+            "net.ipv4.tcp_keepalive_intvl",
+            "net.ipv4.tcp_keepalive_probes",
+            "net.ipv4.tcp_keepalive_time",
+            "net.ipv4.tcp_max_syn_backlog",
+            "net.ipv4.tcp_max_tw_buckets",
+            "net.ipv4.tcp_mtu_probing",
+            "net.ipv4.tcp_no_metrics_save",
+            "net.ipv4.tcp_notsent_lowat",
+            "net.ipv4.tcp_rmem",
+            "net.ipv4.tcp_sack",
+            "net.ipv4.tcp_slow_start_after_idle",
+            "net.ipv4.tcp_syn_retries",
+            "net.ipv4.tcp_synack_retries",
+            "net.ipv4.tcp_syncookies",
+            "net.ipv4.tcp_timestamps",
+            "net.ipv4.tcp_tw_reuse",
+            "net.ipv4.tcp_window_scaling",
+            "net.ipv4.tcp_wmem"
+    };
+    // The settings of the interfaces are namespaced as well
+    static const std::vector<std::string> namespacedPrefixes = { "net.ipv4.conf.", "net.ipv6.conf." };
+
+    size_t equals = spec.find('=');
+    if (equals == std::string::npos || equals == 0 || equals == spec.size() - 1 ||
+        spec.find_first_of("/\n") != std::string::npos)
+        throw std::invalid_argument("[ERROR] Invalid sysctl " + spec + "! Expected <key>=<value>");
+    std::string key = spec.substr(0, equals);
+    bool namespaced = namespacedSysctls.count(key) ||
+                      std::any_of(namespacedPrefixes.cbegin(), namespacedPrefixes.cend(),
+                                  [&key](const std::string& prefix) { return key.rfind(prefix, 0) == 0; });
+    if (!namespaced || key.find("..") != std::string::npos)
+        throw std::invalid_argument("[ERROR] Sysctl " + key + " is not isolated per network namespace!");
+    return std::make_pair(key, spec.substr(equals + 1));
+}
+
+/**
+ * Returns the path to the rootfs archive of the given distro or archive layer. If the
+ * layer is a distro whose archive is not present in the cache directory, downloads it
+ * from the pre-defined download URL.
+ */
+std::string fetchRootfsArchive(Container* container, const Layer& layer)
 {
-    const std::string rootDir = container->rootDir;
-    const std::string distroName = container->distroName;
-    const std::string cacheDir = rootDir + "/cache/";
-    const std::string cacheDistroDir = cacheDir + distroName;
+    if (layer.type == ArchiveLayer)
+        return container->rootDir + "/images/" + layer.id + ".tar.gz";
+
+    const std::string distroName = layer.id;
+    const std::string cacheDistroDir = container->rootDir + "/cache/" + distroName;
 
     // Creates a cache directory to store the downloaded file systems if it does not exist
     if (!std::filesystem::exists(cacheDistroDir))
@@ -117,58 +320,92 @@ void setUpContainerImage(Container* container)
             throw std::runtime_error("Create cache directory " + cacheDistroDir + ": FAILED");
     }
 
-
-    const std::string downloadUrl = stringToDownloadUrl[container->distroName];
-
+    const std::string downloadUrl = stringToDownloadUrl[distroName];
     const std::string baseArchiveName(basename(downloadUrl.c_str()));
-    std::string rootfsArchive;
-
-    if (container->isImage)
-        rootfsArchive = container->rootDir + "/images/" + container->id + ".tar.gz";
-    else
-        rootfsArchive = cacheDistroDir + "/" + baseArchiveName;
-
-    char buffer[256];
+    std::string rootfsArchive = cacheDistroDir + "/" + baseArchiveName;
 
     // Downloads the file system archive if it is not present in the cache directory
-    // If 'isImage' is set to true, 'rootfsArchive' always exists.p
     if (!std::filesystem::exists(rootfsArchive))
     {
-        LOG_F(INFO, "Rootfs for %s does not exist", container->distroName.c_str());
+        char buffer[256];
+        LOG_F(INFO, "Rootfs for %s does not exist", distroName.c_str());
         LOG_F(INFO, "Downloading %s from %s", baseArchiveName.c_str(), downloadUrl.c_str());
         sprintf(buffer, "wget -O %s %s -q --show-progress", rootfsArchive.c_str(), downloadUrl.c_str());
         if (system(buffer) == -1)
             throw std::runtime_error("Download rootfs archive for " + distroName + ": FAILED");
     }
+    return rootfsArchive;
+}
 
-    // Extracts the archive to the location depending on the values of 'buildImage' and 'isImage'.
-    std::string rootfsDestDir;
-    if (container->buildImage)
-    {
-        container->dir = container->rootDir + "/containers/" + container->id;
-        container->rootfs = container->dir + "/rootfs";
-        rootfsDestDir = container->rootfs;
-    }
+/**
+ * Creates the destination folder and extracts the given rootfs archive into it,
+ * unless the destination folder already exists.
+ */
+void extractRootfsArchive(const std::string& rootfsArchive, const std::string& rootfsDestDir)
+{
+    if (std::filesystem::exists(rootfsDestDir))
+        return;
+
+    if (std::filesystem::create_directories(rootfsDestDir))
+        LOG_F(INFO, "Create directory %s: SUCCESS", rootfsDestDir.c_str());
     else
+        throw std::runtime_error("Create directory " + rootfsDestDir + ": FAILED");
+
+    char buffer[256];
+    LOG_F(INFO, "Extracting rootfs from %s to %s", rootfsArchive.c_str(), rootfsDestDir.c_str());
+    sprintf(buffer, "tar xvf %s -C %s > /dev/null", rootfsArchive.c_str(), rootfsDestDir.c_str());
+    if (system(buffer) == -1)
+        throw std::runtime_error("Extract " + rootfsArchive + " to " + rootfsDestDir + ": FAILED");
+}
+
+/**
+ * Sets up the root file system of the container as per the specified linux distro and the
+ * root directory (the lower-dirs in an overlay fs). This function performs the following actions:
+ *
+ * 1. Determines the layers of the container's rootfs. A layered image is made up of the layers
+ * in its manifest, a tarball image is a single archive layer, and otherwise the rootfs
+ * is the specified distro.
+ * 2. Checks if the rootfs archive for the distro exists. Fetches it from the pre-defined
+ * download URL if it is not present in the cache directory.
+ * 3. Extracts the rootfs archives to a specific location depending on 'buildImage'.
+ *
+ * Implementation based on https://github.com/Fewbytes/rubber-docker/blob/master/levels/10_setuid/rd.py
+ */
+void setUpContainerImage(Container* container)
+{
+    if (container->layers.empty())
     {
-        if (container->isImage)
-            rootfsDestDir = cacheDir + container->id;
+        std::string manifestPath = getImageManifestPath(container->rootDir, container->id);
+        if (container->isImage && std::filesystem::exists(manifestPath))
+            container->layers = readManifest(manifestPath);
+        else if (container->isImage)
+            container->layers = { Layer { ArchiveLayer, container->id } };
         else
-            rootfsDestDir = cacheDistroDir + "/rootfs";
+            container->layers = { Layer { DistroLayer, container->distroName } };
     }
 
-    // Creates the destination folder, and extracts the files
-    if (!std::filesystem::exists(rootfsDestDir))
+    // Extracts the archive into the container's directory, since it will be modified in place
+    if (container->buildImage)
     {
-        if (std::filesystem::create_directories(rootfsDestDir))
-            LOG_F(INFO, "Create directory %s: SUCCESS", rootfsDestDir.c_str());
-        else
-            throw std::runtime_error("Create directory " + rootfsDestDir + ": FAILED");
+        if (container->layers.size() != 1 || container->layers.front().type == DiffLayer)
+            throw std::runtime_error("Image " + container->id + " is layered, use 'commit' to save its changes");
 
-        LOG_F(INFO, "Extracting rootfs from %s to %s", rootfsArchive.c_str(), rootfsDestDir.c_str());
-        sprintf(buffer, "tar xvf %s -C %s > /dev/null", rootfsArchive.c_str(), rootfsDestDir.c_str());
-        if (system(buffer) == -1)
-            throw std::runtime_error("Extract " + rootfsArchive + " to " + rootfsDestDir + ": FAILED");
+        container->dir = container->rootDir + "/containers/" + container->id;
+        container->rootfs = container->dir + "/rootfs";
+        extractRootfsArchive(fetchRootfsArchive(container, container->layers.front()), container->rootfs);
+        return;
+    }
+
+    for (const auto& layer : container->layers)
+    {
+        std::string layerDir = getLayerDir(container->rootDir, layer);
+        if (layer.type == DiffLayer)
+        {
+            if (!std::filesystem::exists(layerDir))
+                throw std::runtime_error("Layer " + layer.id + " does not exist");
+            continue;
+        }
+        extractRootfsArchive(fetchRootfsArchive(container, layer), layerDir);
     }
 }
 
@@ -208,142 +445,90 @@ void setUpContainerOverlayFs(Container* container)
         }
         LOG_F(INFO, "Set up overlay fs directories in %s: SUCCESS", containerDir.c_str());
     }
+    // Records the layers of the container so that its changes can be listed and committed
+    writeManifest(containerDir + "/layers", container->layers);
 }
 
 
 /**
- * A helper function which retrieves the next available IP address
- * for the container. Returns an empty string if the operation fails.
+ * Returns the IDs of the running containers on the given network mapped to their
+ * IPv4 addresses, as recorded in their state. The state of a container started before
+ * networks had names only records its bridge, which is then the network's name.
  */
-std::string getContainerVEthIp()
+std::map<std::string, std::string> getNetworkContainers(const std::string& rootDir, const std::string& network)
 {
-    try
+    std::map<std::string, std::string> containers;
+    std::error_code error;
+    for (const auto& entry : std::filesystem::directory_iterator(rootDir + "/containers", error))
     {
-        // Counts the number of containers that already exist by
-        // checking the number of connections to the bridge
-        int connectionCount =
-                std::stoi(systemWithOutput("brctl show " + BRIDGE_NAME + " | grep veth1 | wc -l")) + 1;
-        return getNextIp(BRIDGE_IP, connectionCount);
-    }
-    catch (std::exception& ex)
-    {
-        return std::string();
+        std::string containerId = entry.path().filename();
+        auto state = readProperties(entry.path() / "state");
+        std::string name = state.count("network") ? state["network"] : state["bridge"];
+        if (name == network && state.count("ip") && getContainerPid(rootDir, containerId) >= 0)
+            containers[containerId] = state["ip"];
     }
+    return containers;
 }
 
-
 /**
- * Initializes the networking environment for the given container by
- * performing the following actions:
- * 1. If not already present, creates a new network bridge interface named 'kapsel',
- * sets its status to 'up', and assigns it an IPv4 address.
- * 2. Adds the container's id as a new network namespace by calling 'ip netns add'.
- * 3. Creates a new pair of veths.
- * 4. Places one end of the veth pair to the new network space.
- * 5. Moves the other end of the veth pair to the bridge.
- * 6. Assigns an IPv4 address to veth0.
- * 7. Ups veth0.
- * 8. Ups container localhost.
- * 9. Ups veth1.
- * 10. Adds the bridge's IP as the default gateway for the container network.
- * References:
- * - https://dev.to/polarbit/how-docker-container-networking-works-mimic-it-using-linux-network-namespaces-9mj
+ * Generates the host files of a container in its directory, which are mounted over
+ * the files of the same names in /etc of the container, see mountHostFiles():
+ * - hostname: the ID of the container.
+ * - hosts: localhost, the container's own address (127.0.1.1 without a bridge) and
+ * the addresses of the other containers running on its network (on any of its
+ * shards) at the time.
+ * - resolv.conf: the DNS forwarder on the gateway if it is enabled, otherwise
+ * DEFAULT_NAMESERVER.
+ * A container in container mode shares the address and the network of the owner of
+ * the network namespace it has joined.
  */
-void initializeContainerNetwork(Container* container)
+void writeHostFiles(Container* container)
 {
-    LOG_F(INFO, "Initializing container network environment");
-    try
+    std::string ip = "127.0.1.1";
+    std::string network;
+    if (container->networkMode == NetworkBridge)
     {
-        auto* networkNsSemaphore = sem_open(NETWORK_NS_SEM_NAME, 0);
-        if (networkNsSemaphore == SEM_FAILED)
-            throw std::runtime_error("sem_open failed for " + std::string(NETWORK_NS_SEM_NAME));
-        auto* networkInitSemaphore = sem_open(NETWORK_INIT_SEM_NAME, 0);
-        if (networkInitSemaphore == SEM_FAILED)
-            throw std::runtime_error("sem_open failed for " + std::string(NETWORK_INIT_SEM_NAME));
-
-        std::string newNetworkNs = container->id;
-        // Takes the first 9 characters of the container's ID as the suffix
-        // for the names of the veth pair since a valid interface name contains
-        // less than 16 characters
-        std::string suffix = container->id.substr(0, 9);
-        container->vEthPair = std::make_pair("veth0@" + suffix, "veth1@" + suffix);
-        auto vEthPair = container->vEthPair;
-
-        std::string containerIp = getContainerVEthIp();
-        if (containerIp.empty())
-            throw std::runtime_error("Obtain IPv4 address for container: FAILED");
-        LOG_F(INFO, "Container IP: %s", containerIp.c_str());
-
-        // Adds the container's ID as a new network namespace
-        if (system(("ip netns add " + newNetworkNs).c_str()) == -1)
-            throw std::runtime_error("Create namespace " + newNetworkNs + ": FAILED");
-        // Unblocks the thread that is attempting to mount /var/run/netns/<new-network-ns>
-        sem_post(networkNsSemaphore);
-//        sem_post(sem_open(NETWORK_NS_SEM_NAME, 0));
-        // Blocks itself until the container's registers its namespace in setUpNetworkNamespace()
-        sem_wait(networkInitSemaphore);
-//        sem_wait(sem_open(NETWORK_INIT_SEM_NAME, 0));
-        std::vector<std::string> commands = {
-                // Creates a veth pair
-                "ip link add " +  vEthPair.first + " type veth peer name " + vEthPair.second,
-                // Moves one end of the veth pair to the new namespace
-                "ip link set " + vEthPair.first + " netns " + newNetworkNs,
-                // Moves the other end of the veth pair to the bridge
-                "ip link set " + vEthPair.second + " master " + BRIDGE_NAME,
-                // Assigns an IPv4 address to the first interface in the veth pair
-                "ip netns exec " + newNetworkNs + " ip addr add " + containerIp + "/24 dev " + vEthPair.first,
-                // Ups veth0
-                "ip netns exec " + newNetworkNs + " ip link set " + vEthPair.first + " up",
-                // Ups the container's localhost
-                "ip netns exec " + newNetworkNs + " ip link set lo up",
-                // Ups veth1
-                "ip link set " + vEthPair.second + " up",
-                // Adds the bridge as the default gateway
-                "ip netns exec " + newNetworkNs + " ip route add default via " + BRIDGE_IP
-        };
-
-        // Checks if the bridge 'kapsel' already exists
-        std::string bridgeFilePath = "/sys/class/net/" + BRIDGE_NAME + "/bridge";
-        if (!std::filesystem::exists(bridgeFilePath))
+        ip = container->ip;
+        network = container->network.name;
+    }
+    else if (container->networkMode == NetworkContainer)
+    {
+        auto state = readProperties(container->rootDir + "/containers/" + container->networkOwner + "/state");
+        if (state.count("ip"))
         {
-            // Changes the policy on IP table
-            // FIXME There might exist another solution
-            // From: https://serverfault.com/questions/694889/cannot-ping-linux-network-namespace-within-the-same-subnet
-            commands.insert(commands.begin(), "iptables --policy FORWARD ACCEPT");
-            // Enable sending requests and getting responses to/from internet
-            // From: https://dev.to/polarbit/how-docker-container-networking-works-mimic-it-using-linux-network-namespaces-9mj
-            std::string broadcast = BRIDGE_IP;
-            broadcast.pop_back();
-            broadcast.push_back('1');
-            std::string command = "iptables -t nat -A POSTROUTING -s " + broadcast + "/24 ! -o " + BRIDGE_NAME + " -j MASQUERADE";
-            commands.insert(commands.begin(), command);
-            // Assigns an IP address to the bridge
-            commands.insert(commands.begin(), "ip addr add " + BRIDGE_IP + "/24 brd + dev " + BRIDGE_NAME);
-            // Ups the bridge interface
-            commands.insert(commands.begin(), "ip link set " + BRIDGE_NAME + " up");
-            // Creates a network bridge
-            commands.insert(commands.begin(), "ip link add name " + BRIDGE_NAME + " type bridge");
+            ip = state["ip"];
+            network = state.count("network") ? state["network"] : state["bridge"];
         }
+    }
 
-        for (const auto& command : commands)
+    std::string hosts = "127.0.0.1\tlocalhost\n::1\tlocalhost ip6-localhost ip6-loopback\n" + ip + "\t" + container->id + "\n";
+    if (!network.empty())
+    {
+        for (const auto& [peerId, peerIp] : getNetworkContainers(container->rootDir, network))
         {
-            if (system(command.c_str()) == -1)
-                throw std::runtime_error("Execute command " + command + ": FAILED");
+            if (peerId != container->id)
+                hosts += peerIp + "\t" + peerId + "\n";
         }
-
-        sem_post(networkInitSemaphore);
-//        sem_post(sem_open(NETWORK_NS_SEM_NAME, 0));
-        LOG_F(INFO, "Initialize container network environment: SUCCESS");
     }
-    catch (std::exception& ex)
+    bool usesDnsForwarder = container->networkMode == NetworkBridge && !container->network.dnsUpstream.empty();
+    std::string nameserver = usesDnsForwarder ? container->network.gateway : DEFAULT_NAMESERVER;
+
+    std::map<std::string, std::string> files = {
+            { "hostname", container->id + "\n" },
+            { "hosts", hosts },
+            { "resolv.conf", "nameserver " + nameserver + "\n" }
+    };
+    for (const auto& [name, content] : files)
     {
-        LOG_F(ERROR, "Initialize container network environment: FAILED");
-        LOG_F(ERROR, "%s", ex.what());
+        std::string path = container->dir + "/" + name;
+        std::ofstream file(path, std::ios::trunc);
+        file << content;
+        if (!file)
+            throw std::runtime_error("Write " + path + ": FAILED");
     }
+    LOG_F(INFO, "Generate host files: SUCCESS");
 }
 
-
-
 /**
  * Prepares and sets up the environment required for the container to
  * run correctly. Performs the following actions:
@@ -351,6 +536,8 @@ void initializeContainerNetwork(Container* container)
  * 2. Initializes the overlay fs folders in the container's directory
  * if 'buildImage' is false.
  * 3. Initializes the networking environment for the given container.
+ * 4. Generates the container's /etc/hosts, /etc/hostname and /etc/resolv.conf.
+ * 5. With --network-async, creates the directory in which the network status is published.
  *
  * @param container a struct representing the container whose file system will initialized.
  * @return true if set up succeeds, false otherwise.
@@ -363,6 +550,18 @@ bool setUpContainer(Container* container)
         setUpContainerImage(container);
         if (!container->buildImage)
             setUpContainerOverlayFs(container);
+        if (container->networkMode == NetworkBridge)
+        {
+            reserveContainerNetwork(container);
+            container->networkReadyFd = eventfd(0, EFD_CLOEXEC);
+            if (container->networkReadyFd < 0)
+                throw std::runtime_error("Create network eventfd: FAILED [Errno " + std::to_string(errno) + "]");
+        }
+        else if (container->networkMode == NetworkContainer)
+            joinContainerNetwork(container);
+        writeHostFiles(container);
+        if (container->networkAsync)
+            std::filesystem::create_directories(container->dir + "/run");
 
         // Makes the current user the owner of the container directory
         char buffer[256];
@@ -381,9 +580,6 @@ bool setUpContainer(Container* container)
         LOG_F(ERROR, "%s", ex.what());
         return false;
     }
-    // Spawns a worker thread to initialize the network environment for the container
-    std::thread networkWorker(initializeContainerNetwork, container);
-    networkWorker.detach();
     return true;
 }
 
@@ -499,6 +695,59 @@ void setUpCpuLimit(Container* container)
 }
 
 
+/**
+ * Adds the container's process to the freezer cgroup so that all the processes
+ * in the container can be suspended and resumed, e.g. while being committed.
+ */
+void setUpFreezer(Container* container)
+{
+    LOG_F(INFO, "Setting up freezer");
+    std::string freezerDir = CGROUP_FOLDER + "/freezer/" + container->id;
+    if (!std::filesystem::create_directories(freezerDir))
+        throw std::runtime_error("Create directory " + freezerDir + ": FAILED");
+
+    if (!appendToFile(freezerDir + "/tasks", std::to_string(container->pid)))
+        throw std::runtime_error("Write to file 'tasks': FAILED");
+
+    LOG_F(INFO, "Set up freezer: SUCCESS");
+}
+
+/**
+ * Freezes or thaws all the processes in the container with the given ID by writing
+ * to 'freezer.state'. When freezing, blocks until the kernel reports that the
+ * transition from FREEZING to FROZEN has completed.
+ *
+ * @throw runtime_error if the state cannot be read, e.g. since the container has exited,
+ * or the container is not frozen within FREEZE_TIMEOUT seconds, in which case it is thawed.
+ */
+void freezeContainer(const std::string& containerId, bool freeze)
+{
+    std::string stateFile = CGROUP_FOLDER + "/freezer/" + containerId + "/freezer.state";
+    std::string state = freeze ? "FROZEN" : "THAWED";
+    LOG_F(INFO, "Setting freezer state of container %s to %s", containerId.c_str(), state.c_str());
+    if (!appendToFile(stateFile, state))
+        throw std::runtime_error("Write to file 'freezer.state': FAILED");
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(FREEZE_TIMEOUT);
+    while (freeze)
+    {
+        std::ifstream file(stateFile);
+        std::string currentState;
+        // The cgroup is removed once the container has exited
+        if (!(file >> currentState))
+            throw std::runtime_error("Read file 'freezer.state' of container " + containerId + ": FAILED");
+        if (currentState == state)
+            break;
+        if (std::chrono::steady_clock::now() >= deadline)
+        {
+            appendToFile(stateFile, "THAWED");
+            throw std::runtime_error("Freeze container " + containerId + ": FAILED [still " + currentState + " after " +
+                                     std::to_string(FREEZE_TIMEOUT) + "s]");
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
 /**
  * Initializes the amount of computing resources to which the container has access
  * (e.g. memory, cpu, number of processes, etc).
@@ -509,38 +758,58 @@ void setUpResourceLimits(Container* container)
     setUpProcessLimit(container);
     setUpCpuLimit(container);
     setUpMemoryLimit(container);
+    setUpFreezer(container);
     LOG_F(INFO, "Set up container resource limits: SUCCESS");
 }
 
 
 /**
- * Registers the network namespace of the container by bind-mounting /proc/<pid>/ns/net
- * to /var/run/netns/<container_id>.
- * Note that two semaphores are used in this place to guarantee that a new network
- * namespace has been added with 'ip netns add' before mounting /proc/self/ns/net
- * to the new namespace.
+ * Blocks until the network worker of the parent has configured the container's
+ * network namespace. The worker signals the result through the container's own
+ * eventfd, which is inherited across clone(), so that concurrent containers do
+ * not share any synchronization primitive.
  *
- * References:
- * - https://gist.github.com/cfra/39f4110366fa1ae9b1bddd1b47f586a3
- * - https://www.schutzwerk.com/en/43/posts/namespaces_03_pid_net/
+ * @throw runtime_error if the network could not be configured.
+ */
+void waitForNetwork(Container* container)
+{
+    uint64_t status = 0;
+    while (read(container->networkReadyFd, &status, sizeof(status)) < 0 && errno == EINTR);
+    close(container->networkReadyFd);
+    if (status != NETWORK_READY)
+        throw std::runtime_error("Initialize container network: FAILED");
+}
+
+/**
+ * Joins the configured network namespace which has been taken from the network pool
+ * or opened from another container in container mode, so that the network does not
+ * have to be set up while the container starts.
  */
-void setUpNetworkNamespace(Container* container)
+void joinNetworkNamespace(Container* container)
 {
-    LOG_F(INFO, "Setting up network namespace");
+    if (setns(container->networkNamespaceFd, CLONE_NEWNET) != 0)
+        throw std::runtime_error("Join network namespace: FAILED [Errno " + std::to_string(errno) + "]");
+    close(container->networkNamespaceFd);
+    LOG_F(INFO, "Join network namespace: SUCCESS");
+}
 
-    std::string procNetPath = "/proc/self/ns/net";
-    std::string networkNamespacePath = "/var/run/netns/" + container->id;
-    sem_wait(container->networkNsSemaphore);
-//    sem_wait(sem_open(NETWORK_NS_SEM_NAME, 0));
-    if (mount(procNetPath.c_str(), networkNamespacePath.c_str(), nullptr, MS_BIND, nullptr) != 0)
+/**
+ * Applies the sysctls given to --sysctl to the network namespace of the calling
+ * process. Has to be called once the container is in its final network namespace,
+ * since the files in /proc/sys/net refer to the namespace of the process opening them.
+ */
+void applySysctls(Container* container)
+{
+    for (const auto& [key, value] : container->sysctls)
     {
-        sem_post(container->networkInitSemaphore);
-        throw std::runtime_error("Register network namespace with mount: FAILED [Errno " + std::to_string(errno) + "]");
+        std::string path = "/proc/sys/" + key;
+        std::replace(path.begin(), path.end(), '.', '/');
+        std::ofstream file(path);
+        file << value << std::endl;
+        if (!file)
+            throw std::runtime_error("Set sysctl " + key + " to " + value + ": FAILED");
+        LOG_F(INFO, "Set sysctl %s to %s: SUCCESS", key.c_str(), value.c_str());
     }
-
-    sem_post(container->networkInitSemaphore);
-//    sem_post(sem_open(NETWORK_INIT_SEM_NAME, 0));
-    LOG_F(INFO, "Set up network namespace: SUCCESS");
 }
 
 /**
@@ -553,20 +822,279 @@ void setUpNetworkNamespace(Container* container)
 void mountOverlayFileSystem(Container* container)
 {
     LOG_F(INFO, "Mounting overlay fs %s", container->rootfs.c_str());
-    std::string imageRootDir;
-    if (container->isImage)
-        imageRootDir = container->rootDir + "/cache/" + container->id;
-    else
-        imageRootDir = container->rootDir + "/cache/" + container->distroName + "/rootfs";
+    // Stacks the layers as multiple lower-dirs so that they never have to be flattened
+    std::string lowerDirs;
+    for (const auto& lowerDir : getLowerDirs(container->rootDir, container->layers))
+        lowerDirs += (lowerDirs.empty() ? "" : ":") + lowerDir;
 
     std::string upperDir = container->dir + "/copy-on-write";
     std::string workDir = container->dir + "/work";
-    std::string mountData = "lowerdir=" + imageRootDir + ",upperdir=" + upperDir + ",workdir=" + workDir;
+    std::string mountData = "lowerdir=" + lowerDirs + ",upperdir=" + upperDir + ",workdir=" + workDir;
     if (mount("overlay", container->rootfs.c_str(), "overlay", MS_NODEV, mountData.c_str()) != 0)
         throw std::runtime_error("Mount overlay fs: FAILED");
     LOG_F(INFO, "Mounting overlay fs %s: SUCCESS", container->rootfs.c_str());
 }
 
+/**
+ * Creates the mount point for a volume at 'target'. The mount point will be a
+ * directory unless the source of a bind mount is a regular file.
+ */
+void createMountPoint(const std::string& source, const std::string& target)
+{
+    if (std::filesystem::exists(target))
+        return;
+
+    if (!source.empty() && !std::filesystem::is_directory(source))
+    {
+        std::filesystem::create_directories(std::filesystem::path(target).parent_path());
+        if (!appendToFile(target, ""))
+            throw std::runtime_error("Create mount point " + target + ": FAILED");
+    }
+    else if (!std::filesystem::create_directories(target))
+        throw std::runtime_error("Create mount point " + target + ": FAILED");
+}
+
+/**
+ * Applies the read-only and propagation settings of the given volume to the
+ * mount at 'target'. A bind mount ignores MS_RDONLY on creation, therefore
+ * it has to be remounted to become read-only.
+ */
+void applyVolumeFlags(const Volume& volume, const std::string& target)
+{
+    if (volume.readOnly && volume.type == Bind)
+    {
+        if (mount(nullptr, target.c_str(), nullptr, MS_BIND | MS_REMOUNT | MS_RDONLY, nullptr) != 0)
+            throw std::runtime_error("Remount " + target + " read-only: FAILED [Errno " + std::to_string(errno) + "]");
+    }
+
+    if (volume.propagation != 0)
+    {
+        if (mount(nullptr, target.c_str(), nullptr, volume.propagation, nullptr) != 0)
+            throw std::runtime_error("Set propagation of " + target + ": FAILED [Errno " + std::to_string(errno) + "]");
+    }
+}
+
+/**
+ * Bind-mounts the host files and directories specified as volumes into the
+ * container's rootfs. Has to be called before changeRoot() since the host paths
+ * are no longer reachable afterwards. Since the data is mounted rather than copied
+ * into the rootfs, it is neither copied up into the overlay fs nor included in
+ * the image built with 'buildImage'.
+ */
+void mountBindVolumes(Container* container)
+{
+    for (const auto& volume : container->volumes)
+    {
+        if (volume.type != Bind)
+            continue;
+
+        std::string target = container->rootfs + volume.target;
+        LOG_F(INFO, "Mounting volume %s to %s", volume.source.c_str(), volume.target.c_str());
+        createMountPoint(volume.source, target);
+        if (mount(volume.source.c_str(), target.c_str(), nullptr, MS_BIND | MS_REC, nullptr) != 0)
+            throw std::runtime_error("Mount volume " + volume.source + ": FAILED [Errno " + std::to_string(errno) + "]");
+        applyVolumeFlags(volume, target);
+        LOG_F(INFO, "Mount volume %s: SUCCESS", volume.source.c_str());
+    }
+}
+
+/**
+ * Mounts the tmpfs and shm volumes inside the container. Has to be called after
+ * setUpDev() so that volumes located in /dev (e.g. /dev/shm) are not hidden
+ * by the tmpfs mounted on /dev.
+ */
+void mountTmpfsVolumes(Container* container)
+{
+    for (const auto& volume : container->volumes)
+    {
+        if (volume.type == Bind)
+            continue;
+
+        LOG_F(INFO, "Mounting tmpfs volume %s", volume.target.c_str());
+        unsigned long flags = volume.readOnly ? MS_RDONLY : 0;
+        std::string data = volume.data;
+        if (volume.type == Shm)
+        {
+            flags |= MS_NOSUID | MS_NODEV | MS_NOEXEC;
+            if (data.find("mode=") == std::string::npos)
+                data += std::string(data.empty() ? "" : ",") + "mode=1777";
+        }
+
+        createMountPoint("", volume.target);
+        if (mount("tmpfs", volume.target.c_str(), "tmpfs", flags, data.c_str()) != 0)
+            throw std::runtime_error("Mount tmpfs volume " + volume.target + ": FAILED [Errno " + std::to_string(errno) + "]");
+        applyVolumeFlags(volume, volume.target);
+        LOG_F(INFO, "Mount tmpfs volume %s: SUCCESS", volume.target.c_str());
+    }
+}
+
+/**
+ * Bind-mounts the given file or directory of the host on the given target, which is
+ * created if it does not exist. The bind mount is then remounted read-only, since
+ * MS_RDONLY is ignored when a bind mount is created.
+ */
+void bindMountReadOnly(const std::string& source, const std::string& target)
+{
+    createMountPoint(source, target);
+    if (mount(source.c_str(), target.c_str(), nullptr, MS_BIND, nullptr) != 0)
+        throw std::runtime_error("Mount " + source + ": FAILED [Errno " + std::to_string(errno) + "]");
+    if (mount(nullptr, target.c_str(), nullptr, MS_BIND | MS_REMOUNT | MS_RDONLY, nullptr) != 0)
+        throw std::runtime_error("Remount " + target + " read-only: FAILED [Errno " + std::to_string(errno) + "]");
+}
+
+/**
+ * Opens the given path in the container's rootfs with openat2() and RESOLVE_IN_ROOT,
+ * so that symlinks are resolved as they are inside the container.
+ *
+ * @return an O_PATH file descriptor, or -1 with errno set on failure.
+ */
+int openInRootfs(int rootFd, const std::string& path, int flags)
+{
+    struct open_how how{};
+    how.flags = O_PATH | O_CLOEXEC | flags;
+    how.resolve = RESOLVE_IN_ROOT;
+    return (int) syscall(SYS_openat2, rootFd, path.c_str(), &how, sizeof(how));
+}
+
+/**
+ * Returns the path in the container's rootfs, relative to it, of the file the given
+ * file descriptor refers to.
+ */
+std::string getRootfsPath(Container* container, int fd)
+{
+    std::string path = std::filesystem::read_symlink("/proc/self/fd/" + std::to_string(fd));
+    return path.size() > container->rootfs.size() ? path.substr(container->rootfs.size() + 1) : "";
+}
+
+/**
+ * Resolves the given absolute path inside the container's rootfs, following symbolic
+ * links as the container would (e.g. /etc/resolv.conf -> ../run/resolvconf/resolv.conf),
+ * and creates the file, or with 'isDirectory' the directory, it resolves to if it does
+ * not exist. The files and directories
+ * created are listed in <container-dir>/mount-points, so that they can be removed from
+ * the rootfs again by removeMountPoints().
+ *
+ * @throw runtime_error if the path cannot be resolved or created.
+ * @return the resolved path on the host, which contains no symbolic links.
+ */
+std::string createRootfsMountPoint(Container* container, std::string path, bool isDirectory)
+{
+    int rootFd = open(container->rootfs.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (rootFd < 0)
+        throw std::runtime_error("Open " + container->rootfs + ": FAILED [Errno " + std::to_string(errno) + "]");
+    std::vector<std::string> created;
+    try
+    {
+        // Follows the links of the last component one by one, up to the limit of the kernel
+        for (int links = 0; links <= 40; links++)
+        {
+            int fd = openInRootfs(rootFd, path, O_NOFOLLOW);
+            if (fd < 0 && errno != ENOENT)
+                throw std::runtime_error("Resolve " + path + ": FAILED [Errno " + std::to_string(errno) + "]");
+            if (fd < 0)
+                break;
+            char target[PATH_MAX];
+            ssize_t length = readlinkat(fd, "", target, sizeof(target) - 1);
+            if (length < 0)
+            {
+                // Not a symbolic link, i.e. the file exists
+                std::string resolved = container->rootfs + "/" + getRootfsPath(container, fd);
+                close(fd);
+                close(rootFd);
+                return resolved;
+            }
+            close(fd);
+            target[length] = '\0';
+            path = target[0] == '/' ? target : std::filesystem::path(path).parent_path() / target;
+        }
+
+        // Creates the missing directories and the file, which are hence no symbolic links
+        std::filesystem::path relativePath = std::filesystem::path(path).relative_path();
+        std::filesystem::path parent;
+        int parentFd = dup(rootFd);
+        for (const auto& component : relativePath)
+        {
+            bool isFile = parent / component == relativePath && !isDirectory;
+            int fd = openInRootfs(rootFd, parent / component, isFile ? 0 : O_DIRECTORY);
+            if (fd < 0 && errno == ENOENT)
+            {
+                int status = isFile ? openat(parentFd, component.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW |
+                                                                          O_CLOEXEC, 0644)
+                                    : mkdirat(parentFd, component.c_str(), 0755);
+                if (status >= 0)
+                {
+                    created.push_back(getRootfsPath(container, parentFd) + "/" + component.string());
+                    if (isFile)
+                        close(status);
+                    fd = openInRootfs(rootFd, parent / component, isFile ? 0 : O_DIRECTORY);
+                }
+            }
+            if (fd < 0)
+            {
+                int error = errno;
+                close(parentFd);
+                throw std::runtime_error("Create mount point " + path + ": FAILED [Errno " + std::to_string(error) + "]");
+            }
+            close(parentFd);
+            parentFd = fd;
+            parent /= component;
+        }
+        std::string resolved = container->rootfs + "/" + getRootfsPath(container, parentFd);
+        close(parentFd);
+        close(rootFd);
+        for (const auto& createdPath : created)
+            appendToFile(container->dir + "/mount-points", createdPath + "\n");
+        return resolved;
+    }
+    catch (std::exception& ex)
+    {
+        close(rootFd);
+        for (auto it = created.crbegin(); it != created.crend(); it++)
+            std::filesystem::remove(container->rootfs + "/" + *it);
+        throw;
+    }
+}
+
+/**
+ * Removes the files and directories which createRootfsMountPoint() has created in the
+ * rootfs of the container in the given directory, e.g. to keep them out of an image
+ * built from the rootfs or of a layer saved from its upper-dir. Directories which are
+ * no longer empty are kept.
+ */
+void removeMountPoints(const std::string& containerDir, const std::string& dir)
+{
+    std::ifstream file(containerDir + "/mount-points");
+    std::vector<std::string> paths;
+    std::string path;
+    while (std::getline(file, path))
+    {
+        if (!path.empty())
+            paths.push_back(path);
+    }
+    for (auto it = paths.crbegin(); it != paths.crend(); it++)
+    {
+        std::error_code error;
+        std::filesystem::remove(dir + "/" + *it, error);
+    }
+}
+
+/**
+ * Bind-mounts the host files generated by writeHostFiles() read-only over /etc of the
+ * container's rootfs. Since the files are not written into the rootfs, they are
+ * neither copied up into the overlay fs nor kept in images. A file which is a symbolic
+ * link in the rootfs is resolved inside the rootfs, and the file it points to is
+ * mounted over, see createRootfsMountPoint().
+ * With --network-async, <container-dir>/run is mounted read-only on /run/kapsel as well.
+ */
+void mountHostFiles(Container* container)
+{
+    for (const std::string name : { "hostname", "hosts", "resolv.conf" })
+        bindMountReadOnly(container->dir + "/" + name, createRootfsMountPoint(container, "/etc/" + name, false));
+    if (container->networkAsync)
+        bindMountReadOnly(container->dir + "/run", createRootfsMountPoint(container, NETWORK_STATUS_DIR, true));
+    LOG_F(INFO, "Mount host files: SUCCESS");
+}
+
 /**
  * Changes the root file system so that the container's fs can be isolated.
  * If 'buildImage' is false, uses pivot_root() to make the container's rootfs
@@ -694,6 +1222,8 @@ void setUpVariables(Container* container)
     setenv("DISPLAY", ":0.0", 0);
     setenv("TERM", "xterm-256color", 0);
     setenv("PATH", "/bin:/sbin:/usr/bin:/usr/sbin:/src:/usr/local/bin:/usr/local/sbin", 0);
+    if (container->networkAsync)
+        setenv("KAPSEL_NETWORK_READY", (NETWORK_STATUS_DIR + "/network-ready").c_str(), 0);
 
     LOG_F(INFO, "Set up environment variables: SUCCESS");
 }
@@ -703,17 +1233,21 @@ void setUpVariables(Container* container)
  * Initializes a containerized environment in which the given Container will be run.
  * Performs the following actions in order upon entering the execute() function:
  * 1. Initializes all the resource limits of the container (e.g. memory, process, etc).
- * 2. Sets up network namespace.
+ * 2. Joins the network namespace taken from the network pool or another container, if any,
+ * or brings up the loopback interface with --network-async, and applies the sysctls of the container to its network namespace.
  * 3. Mounts the root mount as private and recursively so that the sub-mounts will
  * not be visible to the parent mount.
  * 4. Mounts the overlay file system if 'buildImage' is set to false.
- * 5. Changes the root file system uses pivot_root(). This step has the effect as
+ * 5. Bind-mounts the volumes from the host and the generated host files into the rootfs.
+ * 6. Changes the root file system uses pivot_root(). This step has the effect as
  * performing chroot, except for the fact that it is more secure.
- * 6. Mounts the a list of required directories to the root file system in the container.
- * 7. Creates and sets up basic devices in the container.
- * 8. Sets up the environment variables in the container.
- * 9. Adds name server to resolv.conf.
- * 10. Changes the host name of the container
+ * 7. Mounts the a list of required directories to the root file system in the container.
+ * 8. Creates and sets up basic devices in the container.
+ * 9. Mounts the tmpfs and shm volumes.
+ * 10. Sets up the environment variables in the container.
+ * 11. Changes the host name of the container
+ * 12. Waits until the network worker of the parent has configured the network namespace,
+ * unless the container was started with --network-async.
  * @return true if the all containment actions have been performed successfully, false otherwise.
  */
 bool enterContainment(Container* container)
@@ -721,14 +1255,11 @@ bool enterContainment(Container* container)
     LOG_F(INFO, "Initializing container %s", container->id.c_str());
     try
     {
-        container->networkNsSemaphore = sem_open(NETWORK_NS_SEM_NAME, 0);
-        if (container->networkNsSemaphore == SEM_FAILED)
-            throw std::runtime_error("sem_open failed for " + std::string(NETWORK_NS_SEM_NAME));
-        container->networkInitSemaphore = sem_open(NETWORK_INIT_SEM_NAME, 0);
-        if (container->networkInitSemaphore == SEM_FAILED)
-            throw std::runtime_error("sem_open failed for " + std::string(NETWORK_INIT_SEM_NAME));
-
-        setUpNetworkNamespace(container);
+        if (container->networkNamespaceFd >= 0)
+            joinNetworkNamespace(container);
+        else if (container->networkMode == NetworkLoopback || container->networkAsync)
+            setUpLoopback();
+        applySysctls(container);
         setUpResourceLimits(container);
         // From:
         // https://github.com/swetland/mkbox/blob/master/mkbox.c
@@ -741,20 +1272,19 @@ bool enterContainment(Container* container)
         if (!container->buildImage)
             mountOverlayFileSystem(container);
 
+        mountBindVolumes(container);
+        mountHostFiles(container);
         changeRoot(container);
         mountDirectories(container);
         setUpDev(container);
+        mountTmpfsVolumes(container);
         setUpVariables(container);
-        // Adds DNS resolver to resolv.conf
-        if (!container->isImage)
-            appendToFile("/etc/resolv.conf", "nameserver " + DEFAULT_NAMESERVER);
         // Sets the new hostname to be the ID of the container
         sethostname(container->id.c_str(), container->id.length());
         // Blocks the current thread until network environment lization is finished
-        sem_wait(container->networkInitSemaphore);
-//        sem_wait(sem_open(NETWORK_INIT_SEM_NAME, 0));
-        sem_close(container->networkNsSemaphore);
-        sem_close(container->networkInitSemaphore);
+        if (container->networkMode == NetworkBridge && container->networkNamespaceFd < 0 &&
+            !container->networkAsync)
+            waitForNetwork(container);
     }
     catch (std::exception& ex)
     {
@@ -795,12 +1325,103 @@ void exitContainment(Container* container)
 }
 
 
+/**
+ * Moves the sockets given to --listen to the file descriptors 3, 4, ... of the calling
+ * process and describes them in LISTEN_FDS and LISTEN_FDNAMES (e.g. 'tcp-8080'), see
+ * sd_listen_fds(3). The sockets are first duplicated above that range, so that none
+ * of them is overwritten before it has been moved.
+ *
+ * @return false if a socket could not be duplicated, true otherwise.
+ */
+bool passListenSockets(const std::vector<ListenSocket>& sockets)
+{
+    int count = (int) sockets.size();
+    std::vector<int> fds;
+    for (const auto& listenSocket : sockets)
+    {
+        int fd = fcntl(listenSocket.fd, F_DUPFD_CLOEXEC, LISTEN_FDS_START + count);
+        if (fd < 0)
+        {
+            LOG_F(ERROR, "Duplicate listen socket: FAILED [Errno %d]", errno);
+            return false;
+        }
+        fds.push_back(fd);
+    }
+    std::string names;
+    for (int i = 0; i < count; i++)
+    {
+        // dup2() clears FD_CLOEXEC, so the sockets are inherited by the command
+        dup2(fds[i], LISTEN_FDS_START + i);
+        close(fds[i]);
+        names += (i > 0 ? ":" : "") + std::string(sockets[i].protocol == IPPROTO_UDP ? "udp-" : "tcp-") +
+                 std::to_string(sockets[i].port);
+    }
+    setenv("LISTEN_FDS", std::to_string(count).c_str(), 1);
+    setenv("LISTEN_FDNAMES", names.c_str(), 1);
+    return true;
+}
+
+/**
+ * Returns whether the shell can replace itself with the given command through 'exec',
+ * i.e. the command contains no control operators, subshells or command substitutions
+ * and starts neither with a reserved word nor with a variable assignment, which 'exec'
+ * would take for the name of the command. Quoted operators are treated conservatively.
+ */
+bool isSimpleCommand(const std::string& command)
+{
+    static const std::set<std::string> reservedWords = {
+            "!", "{", "}", "[[", "]]", "case", "do", "done", "elif", "else", "esac", "fi", "for",
+            "function", "if", "in", "select", "then", "time", "until", "while", "exec"
+    };
+    if (command.find_first_of(";&|()`\n") != std::string::npos)
+        return false;
+    auto words = split(command, " ");
+    auto firstWord = std::find_if(words.cbegin(), words.cend(), [](const std::string& word) { return !word.empty(); });
+    if (firstWord == words.cend() || reservedWords.count(*firstWord))
+        return false;
+    size_t nameEnd = firstWord->find_first_not_of(
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_");
+    bool assignment = nameEnd != std::string::npos && nameEnd > 0 && (*firstWord)[nameEnd] == '=' &&
+                      !std::isdigit((unsigned char) (*firstWord)[0]);
+    return !assignment;
+}
+
+/**
+ * Runs the command of a container with its sockets given to --listen, see
+ * passListenSockets(). LISTEN_PID is set to the PID of the shell which runs the
+ * command. A simple command is run with 'exec' so that it keeps this PID, whereas
+ * other commands have to 'exec' the process which accepts the sockets themselves.
+ *
+ * @return the status of the command as returned by waitpid(), or -1 on failure.
+ */
+int runWithListenSockets(Container* container, const std::string& command)
+{
+    std::string shellCommand = isSimpleCommand(command) ? "exec " + command : command;
+    pid_t pid = fork();
+    if (pid < 0)
+        return -1;
+    if (pid == 0)
+    {
+        if (!passListenSockets(container->listenSockets))
+            _exit(127);
+        setenv("LISTEN_PID", std::to_string(getpid()).c_str(), 1);
+        execl("/bin/sh", "sh", "-c", shellCommand.c_str(), (char*) nullptr);
+        _exit(127);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) == -1)
+        return -1;
+    return status;
+}
+
+
 /**
  * Runs the container by invoking the system() function. Initializes the containerized
  * environment with the enterContainment() function. Performs actions listed in
  * exitContainment() upon exiting the container.
  *
  * @param arg: pointer to the Container struct which represents the container will be run.
+ * @return the exit status of the command, or -1 if it could not be executed.
  */
 int execute(void* arg)
 {
@@ -811,13 +1432,55 @@ int execute(void* arg)
 
     std::string command = container->command;
     std::cout << "Executing command: " << command << std::endl;
-    if (system(command.c_str()) == -1)
+    int status = container->listenSockets.empty() ? system(command.c_str())
+                                                  : runWithListenSockets(container, command);
+    if (status == -1)
     {
         LOG_F(ERROR, "Execute command %s: FAILED [Errno %d]", command.c_str(), errno);
         return -1;
     }
     exitContainment(container);
-    return 0;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/**
+ * Starts the worker threads which configure the network of a container in bridge mode:
+ * 1. Unless the container joins a namespace from the network pool, a worker which
+ * connects the container's network namespace to the bridge.
+ * 2. If the network pool is enabled, a worker which replenishes the pool while the
+ * container runs.
+ * 3. If the DNS forwarder is enabled, a worker which runs it, see startDnsForwarder().
+ * The workers are only started after the clone, so that the child is not copied
+ * while they hold locks.
+ */
+void startNetworkWorkers(Container* container, pid_t pid, bool pooledNetwork)
+{
+    if (!pooledNetwork)
+    {
+        // The PID of the unreaped child cannot be reused, so its namespace can be opened
+        // through /proc and configured directly without registering it anywhere
+        std::string networkNamespacePath = "/proc/" + std::to_string(pid) + "/ns/net";
+        int namespaceFd = open(networkNamespacePath.c_str(), O_RDONLY | O_CLOEXEC);
+        if (namespaceFd < 0)
+        {
+            LOG_F(ERROR, "Open %s: FAILED [Errno %d]", networkNamespacePath.c_str(), errno);
+            signalNetworkStatus(container, NETWORK_FAILED);
+        }
+        else
+        {
+            container->networkWorker = std::thread(initializeContainerNetwork, container, namespaceFd);
+        }
+    }
+    else if (container->networkAsync)
+    {
+        // A namespace from the pool is configured already
+        signalNetworkStatus(container, NETWORK_READY);
+    }
+    if (container->networkPoolSize > 0)
+        container->networkPoolWorker = std::thread(replenishNetworkPool, container->rootDir,
+                                                   container->network, container->networkPoolSize);
+    if (!container->network.dnsUpstream.empty())
+        startDnsForwarder(container);
 }
 
 /**
@@ -828,36 +1491,98 @@ int execute(void* arg)
  * Implementations from:
  * - https://cesarvr.github.io/post/2018-05-22-create-containers/
  * - https://github.com/7aske/ccont/blob/master/source/jail.c
+ * @return the exit status of the container, or -1 if it did not exit normally.
  */
-void startContainer(Container* container)
+int startContainer(Container* container)
 {
     std::string info = "Starting container " + container->id + " with pid " + std::to_string(getpid());
     LOG_F(INFO, "%s", info.c_str());
     std::cout << info << std::endl;
 
-    int flags =  SIGCHLD | CLONE_NEWPID | CLONE_NEWUTS | CLONE_NEWNS | CLONE_NEWNET;
+    int flags =  SIGCHLD | CLONE_NEWPID | CLONE_NEWUTS | CLONE_NEWNS;
+    // A container in host mode shares the host's network namespace, and a container
+    // with a namespace from the network pool or another container joins it instead
+    if (container->networkMode != NetworkHost && container->networkNamespaceFd < 0)
+        flags |= CLONE_NEWNET;
     char* childStack = createStack();
     int pid = clone(execute, childStack, flags, (void*) container);
+    bool pooledNetwork = container->networkNamespaceFd >= 0;
+    // The child has inherited the sockets given to --listen
+    for (auto& listenSocket : container->listenSockets)
+    {
+        close(listenSocket.fd);
+        listenSocket.fd = -1;
+    }
+    // Keeps the namespace of a bridged container open, so that its network statistics
+    // can still be collected after it has exited
+    int statsNamespaceFd = -1;
+    if (container->networkMode == NetworkBridge && pid >= 0)
+    {
+        std::string networkNamespacePath = "/proc/" + std::to_string(pid) + "/ns/net";
+        statsNamespaceFd = pooledNetwork ? fcntl(container->networkNamespaceFd, F_DUPFD_CLOEXEC, 0)
+                                         : open(networkNamespacePath.c_str(), O_RDONLY | O_CLOEXEC);
+    }
+    if (pooledNetwork)
+    {
+        close(container->networkNamespaceFd);
+        container->networkNamespaceFd = -1;
+    }
     if (pid < 0)
     {
         LOG_F(ERROR, "Start container %s: FAILED [Unable to create child process %d]", container->id.c_str(), pid);
-        return;
+        return -1;
     }
+    if (container->networkMode == NetworkBridge)
+        startNetworkWorkers(container, pid, pooledNetwork);
+
+    // Records the host PID of the container so that other commands (e.g. cp, export)
+    // can access its rootfs through /proc/<pid>/root, and in bridge mode its address,
+    // by which the DNS forwarder answers queries for the container's name
+    std::map<std::string, std::string> state = { { "pid", std::to_string(pid) } };
+    if (container->networkMode == NetworkBridge)
+    {
+        state["bridge"] = container->network.bridge;
+        state["network"] = container->network.name;
+        state["ip"] = container->ip;
+    }
+    if (container->networkMode == NetworkContainer)
+        state["network-owner"] = container->networkOwner;
+    if (!writeProperties(container->dir + "/state", state))
+        LOG_F(ERROR, "Write state of container %s: FAILED", container->id.c_str());
     int exitStatus;
     // Waits for the Container to finish executing the given command.
     if (waitpid(pid, &exitStatus, 0) == -1)
         LOG_F(INFO, "waitpid() failed for child process %d", pid);
+    if (statsNamespaceFd >= 0)
+    {
+        logNetworkStats(container->id, statsNamespaceFd);
+        close(statsNamespaceFd);
+    }
     if (WIFEXITED(exitStatus))
     {
         info = "Container " + container->id + " exit status " + std::to_string(WEXITSTATUS(exitStatus));
         LOG_F(INFO, "%s", info.c_str());
         std::cout << info << std::endl;
+        return WEXITSTATUS(exitStatus);
     }
-    else
-    {
-        // If seg fault happens during the execution
-        LOG_F(ERROR, "Container %s exited with status: %d", container->id.c_str(), exitStatus);
-    }
+    // If seg fault happens during the execution
+    LOG_F(ERROR, "Container %s exited with status: %d", container->id.c_str(), exitStatus);
+    return -1;
+}
+
+/**
+ * Retrieves the host PID of the running container with the given ID from
+ * <root-dir>/containers/<id>/state.
+ * @return the PID of the container, or -1 if the container is not running.
+ */
+pid_t getContainerPid(const std::string& rootDir, const std::string& containerId)
+{
+    auto state = readProperties(rootDir + "/containers/" + containerId + "/state");
+    if (!state.count("pid"))
+        return -1;
+
+    pid_t pid = std::stoi(state["pid"]);
+    return kill(pid, 0) == 0 ? pid : -1;
 }
 
 /**
@@ -888,16 +1613,30 @@ void buildContainerImage(Container* container)
 }
 
 
+/**
+ * Moves the upper-dir of the container to 'outputLayerDir' so that the changes made
+ * in the container become a layer. Since the container has exited, the upper-dir is
+ * renamed rather than copied.
+ */
+void saveContainerLayer(Container* container)
+{
+    std::string upperDir = container->dir + "/copy-on-write";
+    LOG_F(INFO, "Saving %s as layer %s", upperDir.c_str(), container->outputLayerDir.c_str());
+    std::filesystem::create_directories(std::filesystem::path(container->outputLayerDir).parent_path());
+    std::filesystem::rename(upperDir, container->outputLayerDir);
+    LOG_F(INFO, "Save layer %s: SUCCESS", container->outputLayerDir.c_str());
+}
+
 /**
  * Removes the cgroup limitations imposed on the container
- * for pids, CPU and memory by deleting the corresponding directories
+ * for pids, CPU, memory and freezer by deleting the corresponding directories
  * in /sys/fs/cgroup.
  */
 void removeCGroupDirs(Container* container)
 {
     LOG_F(INFO, "Removing CGroup folders of container %s", container->id.c_str());
     std::vector<std::string> resources = {
-            "pids", "memory", "cpu"
+            "pids", "memory", "cpu", "freezer"
     };
     for (const auto& resource : resources)
     {
@@ -924,9 +1663,9 @@ void removeContainerDirectory(Container* container)
     LOG_F(INFO, "Removing %s", containerDir.c_str());
     if (!std::filesystem::remove_all(containerDir))
         throw std::runtime_error("Remove directory " + containerDir + ": FAILED ");
-    if (!container->buildImage && container->isImage)
+    std::string containerCacheDir = container->rootDir + "/cache/" + container->id;
+    if (!container->buildImage && container->isImage && std::filesystem::exists(containerCacheDir))
     {
-        std::string containerCacheDir = container->rootDir + "/cache/" + container->id;
         LOG_F(INFO, "Removing %s", containerCacheDir.c_str());
         if (!std::filesystem::remove_all(containerCacheDir))
             throw std::runtime_error("Remove directory " + containerCacheDir + ": FAILED");
@@ -936,33 +1675,6 @@ void removeContainerDirectory(Container* container)
 }
 
 
-/**
- * Cleans up the networking environment by performing the following actions:
- * 1. Unmounts /var/run/netns/<container_id>.
- * 2. Deletes the veth pair.
- * 3. Deletes the network namespace by running 'ip netns del'.
- */
-void cleanUpContainerNetwork(Container* container)
-{
-    LOG_F(INFO, "Cleaning up container network environment");
-
-    std::string networkNamespacePath = "/var/run/netns/" + container->id;
-    if (umount(networkNamespacePath.c_str()) != 0)
-        throw std::runtime_error("Unmount " + networkNamespacePath + ": FAILED [Errno " + std::to_string(errno) + "]");
-
-    std::vector<std::string> commands = {
-            "ip link delete " + container->vEthPair.second,
-            "ip netns del " + container->id
-    };
-    for (const auto& command : commands)
-    {
-        if (system(command.c_str()) == -1)
-            throw std::runtime_error("Execute command " + command + ": FAILED");
-    }
-
-    LOG_F(INFO, "Clean up container network environment: SUCCESS");
-}
-
 /**
  * Frees all resources occupied by the given container struct.
  */
@@ -970,10 +1682,8 @@ void destroyContainer(Container* container)
 {
     delete container->resourceLimits;
 
-    sem_close(container->networkNsSemaphore);
-    sem_unlink(NETWORK_INIT_SEM_NAME);
-    sem_close(container->networkInitSemaphore);
-    sem_unlink(NETWORK_NS_SEM_NAME);
+    if (container->networkReadyFd >= 0)
+        close(container->networkReadyFd);
 
     delete container;
 }
@@ -983,23 +1693,38 @@ void destroyContainer(Container* container)
  * Performs the following actions:
  * 1. Builds a tarball image for the container and saves it
  * to <root-dir>/images.
- * 2. Deletes the container rootfs directory.
- * 3. Removes the container-associated folders created in the cgroup folder.
- * 4. Cleans up the networking environment of the container.
- * 5. Deallocates all the memory taken up by the given Container struct.
+ * 2. Saves the container's upper-dir as a layer if 'outputLayerDir' is set.
+ * 3. Deletes the container rootfs directory.
+ * 4. Removes the container-associated folders created in the cgroup folder.
+ * 5. Cleans up the networking environment of the container.
+ * 6. Deallocates all the memory taken up by the given Container struct.
  * @return true if clean up succeeds, false otherwise.
  */
 bool cleanUpContainer(Container* container)
 {
     std::string containerId = container->id;
     LOG_F(INFO, "Clean up container %s", containerId.c_str());
+    // With --network-async the command may exit while its network is still being connected,
+    // which has to finish before the network is cleaned up and the struct is freed
+    if (container->networkWorker.joinable())
+        container->networkWorker.join();
+    // The network pool must not be left with a partially configured namespace
+    if (container->networkPoolWorker.joinable())
+        container->networkPoolWorker.join();
+    stopDnsForwarder(container);
     try
     {
+        // The mount points of the host files are not part of the container's changes
+        removeMountPoints(container->dir, container->buildImage ? container->rootfs
+                                                                : container->dir + "/copy-on-write");
         if (container->buildImage)
             buildContainerImage(container);
+        if (!container->outputLayerDir.empty())
+            saveContainerLayer(container);
         removeContainerDirectory(container);
         removeCGroupDirs(container);
-        cleanUpContainerNetwork(container);
+        if (container->networkMode != NetworkHost)
+            cleanUpContainerNetwork(container);
         destroyContainer(container);
         std::cout << "Container " << containerId << " destroyed" << std::endl;
         LOG_F(INFO, "Clean up container %s: SUCCESS", containerId.c_str());
@@ -7,7 +7,10 @@
 
 #include <vector>
 #include <utility>
-#include <semaphore.h>
+#include <thread>
+
+#include "image.h"
+#include "ipam.h"
 
 /**
  * A struct representing the resource constraints
@@ -19,6 +22,78 @@ struct ResourceLimits
     int cpuShare;
     std::string memory;
     std::string swapMemory;
+    // Rates in bytes per second of the traffic from and to the container, 0 if unlimited
+    uint64_t egressRate;
+    uint64_t ingressRate;
+    // skb priority of the container's forwarded packets on the host (e.g. TC_PRIO_BULK)
+    uint32_t networkPriority;
+};
+
+/**
+ * The types of volumes that can be mounted into a container.
+ * Bind: a file or directory on the host bind-mounted into the container.
+ * Tmpfs: an in-memory file system that is discarded when the container exits.
+ * Shm: a tmpfs with the flags expected of /dev/shm (nosuid, nodev, noexec).
+ */
+enum VolumeType
+{
+    Bind, Tmpfs, Shm
+};
+
+/**
+ * The network modes of a container, selected with --network.
+ * NetworkNone: a network namespace of its own without any interface up.
+ * NetworkLoopback: a network namespace of its own with only the loopback interface up.
+ * NetworkHost: the network namespace of the host.
+ * NetworkBridge: a network namespace of its own connected to a bridge through the interfaces of its driver.
+ * NetworkContainer: the network namespace of another running container.
+ */
+enum NetworkMode
+{
+    NetworkNone, NetworkLoopback, NetworkHost, NetworkBridge, NetworkContainer
+};
+
+/**
+ * A struct representing a volume specified with -v, --volume.
+ */
+struct Volume
+{
+    VolumeType type;
+    // Path on the host for bind mounts, empty for tmpfs and shm volumes
+    std::string source;
+    // Absolute path inside the container
+    std::string target;
+    bool readOnly;
+    // Mount propagation flags (e.g. MS_SHARED | MS_REC), 0 if unspecified
+    unsigned long propagation;
+    // Additional mount data for tmpfs and shm volumes (e.g. size=64m)
+    std::string data;
+};
+
+/**
+ * A struct representing a port published with -P, --publish.
+ */
+struct PortMapping
+{
+    uint16_t hostPort;
+    uint16_t containerPort;
+    // IPPROTO_TCP or IPPROTO_UDP
+    int protocol;
+};
+
+/**
+ * A struct representing a socket given to --listen, which is bound on the host and
+ * passed into the container following the LISTEN_FDS convention.
+ */
+struct ListenSocket
+{
+    // IPv4 address on the host, 0.0.0.0 for all addresses
+    std::string address;
+    uint16_t port;
+    // IPPROTO_TCP or IPPROTO_UDP
+    int protocol;
+    // Bound socket, -1 until it is opened with openListenSockets()
+    int fd;
 };
 
 /**
@@ -51,9 +126,38 @@ struct Container
     std::string currentUser;
     std::string command;
     std::pair<std::string, std::string> vEthPair;
+    NetworkMode networkMode;
+    // Network the container is attached to and its IPv4 address in it, only used in bridge mode
+    Network network;
+    std::string ip;
+    // Whether the command starts before the network is attached, see --network-async
+    bool networkAsync;
+    // Number of configured network namespaces kept in the network pool, 0 if disabled
+    int networkPoolSize;
+    // Network namespace taken from the network pool, -1 if the container creates its own
+    int networkNamespaceFd;
+    // Connects the container's network namespace to the bridge, see initializeContainerNetwork()
+    std::thread networkWorker;
+    std::thread networkPoolWorker;
+    // DNS forwarder serving the gateway address while the container runs, see runDnsForwarder()
+    std::thread dnsWorker;
+    int dnsStopFd;
+    // Container whose network namespace is joined in container mode
+    std::string networkOwner;
+    // Ports forwarded from the host to the container, only used in bridge mode
+    std::vector<PortMapping> publishedPorts;
+    // Sockets passed to the container as file descriptors 3, 4, ...
+    std::vector<ListenSocket> listenSockets;
+    // Sysctls of the container's network namespace, e.g. net.core.somaxconn
+    std::map<std::string, std::string> sysctls;
+    std::vector<Volume> volumes;
+    // Layers of the container's rootfs from the bottom to the top
+    std::vector<Layer> layers;
+    // If not empty, the upper-dir is saved to this directory as a layer after exiting
+    std::string outputLayerDir;
     ResourceLimits* resourceLimits;
-    sem_t* networkNsSemaphore;
-    sem_t* networkInitSemaphore;
+    // Eventfd inherited by the container, on which it waits for its network to be configured
+    int networkReadyFd;
 };
 
 bool setUpContainer(Container* container);
@@ -63,8 +167,16 @@ Container* createContainer(std::string& distroName,
                            std::string& rootDir,
                            std::string& command,
                            ResourceLimits* resourceLimits,
+                           std::vector<Volume>& volumes,
                            bool buildImage,
                            bool isImage);
-void startContainer(Container* container);
+int startContainer(Container* container);
+Volume parseVolume(const std::string& spec);
+PortMapping parsePortMapping(const std::string& spec);
+ListenSocket parseListenSocket(const std::string& spec);
+std::pair<std::string, std::string> parseSysctl(const std::string& spec);
+void freezeContainer(const std::string& containerId, bool freeze);
+void removeMountPoints(const std::string& containerDir, const std::string& dir);
+pid_t getContainerPid(const std::string& rootDir, const std::string& containerId);
 
 #endif //CONTAINER_CPP_CONTAINER_H
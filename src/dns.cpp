@@ -0,0 +1,457 @@
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <stdexcept>
+#include <csignal>
+#include <cstring>
+#include <ostream>
+#include <unistd.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <loguru/loguru.hpp>
+
+#include "constants.h"
+#include "dns.h"
+#include "utils.h"
+
+using Clock = std::chrono::steady_clock;
+
+const size_t DNS_HEADER_SIZE = 12;
+// Largest message accepted over UDP, which covers the buffer sizes advertised with EDNS
+const size_t DNS_MESSAGE_SIZE = 4096;
+const uint16_t DNS_TYPE_A = 1;
+const uint16_t DNS_TYPE_OPT = 41;
+const uint16_t DNS_TYPE_ANY = 255;
+const uint16_t DNS_CLASS_IN = 1;
+const uint8_t DNS_RCODE_NXDOMAIN = 3;
+// Containers come and go, so their records are only cached briefly by the resolvers
+const uint32_t CONTAINER_RECORD_TTL = 5;
+const uint32_t MAX_CACHE_TTL = 3600;
+const size_t MAX_CACHE_ENTRIES = 4096;
+const auto UPSTREAM_TIMEOUT = std::chrono::seconds(5);
+
+/**
+ * The single question of a DNS query.
+ */
+struct DnsQuestion
+{
+    // The queried name without the trailing dot, in the case it was sent in
+    std::string name;
+    uint16_t type;
+    uint16_t dnsClass;
+    // Offset of the first byte after the question in the message
+    size_t end;
+};
+
+/**
+ * A response from the upstream server, together with the offsets of the TTLs of
+ * its records, which are decreased by the time spent in the cache when it is served.
+ */
+struct CachedResponse
+{
+    std::vector<uint8_t> message;
+    std::vector<size_t> ttlOffsets;
+    Clock::time_point storedAt;
+    Clock::time_point expiresAt;
+};
+
+/**
+ * A query which has been forwarded to the upstream server under a new ID.
+ */
+struct PendingQuery
+{
+    sockaddr_in client;
+    uint16_t clientId;
+    std::string cacheKey;
+    Clock::time_point deadline;
+};
+
+/**
+ * The state of a running DNS forwarder, see runDnsForwarder().
+ */
+struct DnsForwarder
+{
+    std::string rootDir;
+    // Name of the network whose containers the forwarder answers
+    std::string network;
+    int socketFd;
+    int upstreamFd;
+    std::map<std::string, CachedResponse> cache;
+    std::map<uint16_t, PendingQuery> pending;
+    std::mt19937 random;
+};
+
+uint16_t readU16(const uint8_t* data)
+{
+    return (uint16_t) ((data[0] << 8) | data[1]);
+}
+
+void writeU16(uint8_t* data, uint16_t value)
+{
+    data[0] = value >> 8;
+    data[1] = value & 0xff;
+}
+
+uint32_t readU32(const uint8_t* data)
+{
+    return ((uint32_t) readU16(data) << 16) | readU16(data + 2);
+}
+
+void writeU32(uint8_t* data, uint32_t value)
+{
+    writeU16(data, value >> 16);
+    writeU16(data + 2, value & 0xffff);
+}
+
+/**
+ * Parses the address of a DNS server given as <ip>[:<port>], where the port
+ * defaults to 53.
+ *
+ * @throw invalid_argument if the address is malformed.
+ */
+sockaddr_in parseDnsServer(const std::string& server)
+{
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(DNS_PORT);
+    auto fields = split(server, ":");
+    if (fields.size() > 2 || inet_pton(AF_INET, fields[0].c_str(), &address.sin_addr) != 1)
+        throw std::invalid_argument("[ERROR] Invalid DNS server " + server + "! Expected <ip>[:<port>]");
+    if (fields.size() == 2)
+    {
+        const std::string& port = fields[1];
+        if (port.empty() || port.size() > 5 || port.find_first_not_of("0123456789") != std::string::npos ||
+            std::stoi(port) < 1 || std::stoi(port) > 65535)
+            throw std::invalid_argument("[ERROR] Invalid port " + port + " of DNS server " + server + "!");
+        address.sin_port = htons((uint16_t) std::stoi(port));
+    }
+    return address;
+}
+
+/**
+ * Opens the UDP socket of a DNS forwarder bound to port 53 of the given address.
+ * The socket is opened with SO_REUSEPORT, so that the forwarders of all the kapsel
+ * processes with a container on the same bridge can serve its gateway address at
+ * the same time, with the kernel spreading the queries among them. It is opened with
+ * IP_FREEBIND as well, since the first container on a bridge starts its forwarder
+ * while the network worker may still be creating the bridge and its address.
+ *
+ * @throw runtime_error if the address is in use by a socket without SO_REUSEPORT.
+ */
+int openDnsSocket(const std::string& address)
+{
+    sockaddr_in socketAddress = parseDnsServer(address);
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        throw std::runtime_error("Create DNS socket: FAILED [Errno " + std::to_string(errno) + "]");
+    int enable = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) != 0 ||
+        setsockopt(fd, IPPROTO_IP, IP_FREEBIND, &enable, sizeof(enable)) != 0 ||
+        bind(fd, (sockaddr*) &socketAddress, sizeof(socketAddress)) != 0)
+    {
+        int error = errno;
+        close(fd);
+        throw std::runtime_error("Bind DNS socket to " + address + ": FAILED [Errno " + std::to_string(error) + "]");
+    }
+    return fd;
+}
+
+/**
+ * Parses the question of a query or response, which has to be the only one.
+ * Unlike the names in records, the name in the question is never compressed.
+ *
+ * @return false if the message is malformed.
+ */
+bool parseQuestion(const uint8_t* message, size_t size, DnsQuestion& question)
+{
+    if (size < DNS_HEADER_SIZE || readU16(message + 4) != 1)
+        return false;
+    question.name.clear();
+    size_t offset = DNS_HEADER_SIZE;
+    while (true)
+    {
+        if (offset >= size)
+            return false;
+        uint8_t length = message[offset++];
+        if (length == 0)
+            break;
+        if (length > 63 || offset + length > size)
+            return false;
+        if (!question.name.empty())
+            question.name += '.';
+        question.name.append((const char*) message + offset, length);
+        offset += length;
+    }
+    if (offset + 4 > size)
+        return false;
+    question.type = readU16(message + offset);
+    question.dnsClass = readU16(message + offset + 2);
+    question.end = offset + 4;
+    return true;
+}
+
+/**
+ * Moves 'offset' past the possibly compressed name at 'offset'.
+ *
+ * @return false if the name exceeds the message.
+ */
+bool skipName(const uint8_t* message, size_t size, size_t& offset)
+{
+    while (offset < size)
+    {
+        uint8_t length = message[offset];
+        // A pointer to a name elsewhere in the message ends the name
+        if ((length & 0xc0) == 0xc0)
+        {
+            offset += 2;
+            return offset <= size;
+        }
+        if (length > 63)
+            return false;
+        offset += 1 + length;
+        if (length == 0)
+            return offset <= size;
+    }
+    return false;
+}
+
+/**
+ * Collects the offsets of the TTLs of all the records in a response, except for the
+ * EDNS pseudo-record, whose TTL field holds flags.
+ *
+ * @return false if the response is malformed.
+ */
+bool getTtlOffsets(const uint8_t* message, size_t size, const DnsQuestion& question, std::vector<size_t>& offsets)
+{
+    size_t recordCount = readU16(message + 6) + readU16(message + 8) + readU16(message + 10);
+    size_t offset = question.end;
+    for (size_t i = 0; i < recordCount; i++)
+    {
+        if (!skipName(message, size, offset) || offset + 10 > size)
+            return false;
+        if (readU16(message + offset) != DNS_TYPE_OPT)
+            offsets.push_back(offset + 4);
+        offset += 10 + readU16(message + offset + 8);
+        if (offset > size)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Returns the key of the cached responses to the given question. Names are
+ * case-insensitive, so the name is lowercased.
+ */
+std::string getCacheKey(const DnsQuestion& question)
+{
+    std::string name = question.name;
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    return name + "/" + std::to_string(question.type) + "/" + std::to_string(question.dnsClass);
+}
+
+/**
+ * Looks up the IPv4 address of the running container with the given name (its ID)
+ * on the forwarder's network, which spans all the shards of a sharded network, in
+ * <root-dir>/containers/<id>/state.
+ *
+ * @return the address of the container, or an empty string if there is none.
+ */
+std::string lookUpContainer(const DnsForwarder& forwarder, const std::string& name)
+{
+    if (name.empty() || name.find_first_of("./") != std::string::npos)
+        return "";
+    auto state = readProperties(forwarder.rootDir + "/containers/" + name + "/state");
+    std::string network = state.count("network") ? state["network"] : state["bridge"];
+    if (!state.count("ip") || !state.count("pid") || network != forwarder.network ||
+        kill(std::stoi(state["pid"]), 0) != 0)
+        return "";
+    return state["ip"];
+}
+
+/**
+ * Builds the authoritative answer to a query for a container's name, which holds
+ * the container's address for A queries and no records for other types.
+ */
+std::vector<uint8_t> buildContainerAnswer(const uint8_t* query, const DnsQuestion& question, const std::string& ip)
+{
+    std::vector<uint8_t> response(query, query + question.end);
+    // QR and AA set, opcode and RD copied from the query, RA set and NOERROR
+    response[2] = 0x84 | (query[2] & 0x79);
+    response[3] = 0x80;
+    bool hasRecord = (question.type == DNS_TYPE_A || question.type == DNS_TYPE_ANY) && question.dnsClass == DNS_CLASS_IN;
+    writeU16(response.data() + 6, hasRecord ? 1 : 0);
+    writeU16(response.data() + 8, 0);
+    writeU16(response.data() + 10, 0);
+    if (!hasRecord)
+        return response;
+
+    uint8_t record[16] = { 0xc0, (uint8_t) DNS_HEADER_SIZE };
+    writeU16(record + 2, DNS_TYPE_A);
+    writeU16(record + 4, DNS_CLASS_IN);
+    writeU32(record + 6, CONTAINER_RECORD_TTL);
+    writeU16(record + 10, 4);
+    inet_pton(AF_INET, ip.c_str(), record + 12);
+    response.insert(response.end(), record, record + sizeof(record));
+    return response;
+}
+
+/**
+ * Caches a response from the upstream server for the smallest TTL of its records.
+ * Truncated responses, server failures and responses without records (e.g. an
+ * NXDOMAIN without SOA) are not cached.
+ */
+void cacheResponse(DnsForwarder& forwarder, const uint8_t* message, size_t size, const DnsQuestion& question,
+                   const std::string& key)
+{
+    uint8_t rcode = message[3] & 0x0f;
+    if ((message[2] & 0x02) || (rcode != 0 && rcode != DNS_RCODE_NXDOMAIN))
+        return;
+    std::vector<size_t> ttlOffsets;
+    if (!getTtlOffsets(message, size, question, ttlOffsets) || ttlOffsets.empty())
+        return;
+    uint32_t ttl = MAX_CACHE_TTL;
+    for (size_t offset : ttlOffsets)
+        ttl = std::min(ttl, readU32(message + offset));
+    if (ttl == 0)
+        return;
+
+    auto now = Clock::now();
+    if (forwarder.cache.size() >= MAX_CACHE_ENTRIES)
+    {
+        for (auto it = forwarder.cache.begin(); it != forwarder.cache.end();)
+            it = it->second.expiresAt <= now ? forwarder.cache.erase(it) : std::next(it);
+        if (forwarder.cache.size() >= MAX_CACHE_ENTRIES)
+            forwarder.cache.erase(forwarder.cache.begin());
+    }
+    forwarder.cache[key] = CachedResponse {
+            std::vector<uint8_t>(message, message + size), ttlOffsets, now, now + std::chrono::seconds(ttl)
+    };
+}
+
+/**
+ * Handles a query from a container:
+ * 1. A query for the name of a running container on the network is answered directly.
+ * 2. A query whose response is in the cache is answered from the cache.
+ * 3. Otherwise, the query is forwarded to the upstream server under a new random ID.
+ */
+void handleQuery(DnsForwarder& forwarder, uint8_t* buffer)
+{
+    sockaddr_in client{};
+    socklen_t clientLength = sizeof(client);
+    ssize_t size = recvfrom(forwarder.socketFd, buffer, DNS_MESSAGE_SIZE, 0, (sockaddr*) &client, &clientLength);
+    DnsQuestion question;
+    if (size < (ssize_t) DNS_HEADER_SIZE || (buffer[2] & 0x80) || !parseQuestion(buffer, size, question))
+        return;
+
+    std::string ip = lookUpContainer(forwarder, question.name);
+    if (!ip.empty())
+    {
+        auto response = buildContainerAnswer(buffer, question, ip);
+        sendto(forwarder.socketFd, response.data(), response.size(), 0, (sockaddr*) &client, clientLength);
+        return;
+    }
+
+    auto now = Clock::now();
+    std::string key = getCacheKey(question);
+    auto cached = forwarder.cache.find(key);
+    if (cached != forwarder.cache.end() && cached->second.expiresAt > now)
+    {
+        std::vector<uint8_t> response = cached->second.message;
+        memcpy(response.data(), buffer, 2);
+        auto elapsed = (uint32_t) std::chrono::duration_cast<std::chrono::seconds>(now - cached->second.storedAt).count();
+        for (size_t offset : cached->second.ttlOffsets)
+            writeU32(response.data() + offset, readU32(response.data() + offset) - elapsed);
+        sendto(forwarder.socketFd, response.data(), response.size(), 0, (sockaddr*) &client, clientLength);
+        return;
+    }
+
+    // The client retries a query which is dropped when too many are in flight
+    if (forwarder.pending.size() >= 1024)
+        return;
+    uint16_t id;
+    do
+        id = (uint16_t) forwarder.random();
+    while (forwarder.pending.count(id));
+    forwarder.pending[id] = PendingQuery { client, readU16(buffer), key, now + UPSTREAM_TIMEOUT };
+    writeU16(buffer, id);
+    if (send(forwarder.upstreamFd, buffer, size, 0) < 0)
+        LOG_F(WARNING, "Forward DNS query for %s: FAILED [Errno %d]", question.name.c_str(), errno);
+}
+
+/**
+ * Handles a response from the upstream server. A response is only accepted if its ID
+ * and question match a pending query, and is then cached and returned to the client.
+ */
+void handleResponse(DnsForwarder& forwarder, uint8_t* buffer)
+{
+    ssize_t size = recv(forwarder.upstreamFd, buffer, DNS_MESSAGE_SIZE, 0);
+    if (size < (ssize_t) DNS_HEADER_SIZE)
+        return;
+    auto pendingQuery = forwarder.pending.find(readU16(buffer));
+    DnsQuestion question;
+    if (pendingQuery == forwarder.pending.end() || !parseQuestion(buffer, size, question) ||
+        getCacheKey(question) != pendingQuery->second.cacheKey)
+        return;
+
+    PendingQuery query = pendingQuery->second;
+    forwarder.pending.erase(pendingQuery);
+    cacheResponse(forwarder, buffer, size, question, query.cacheKey);
+    writeU16(buffer, query.clientId);
+    sendto(forwarder.socketFd, buffer, size, 0, (sockaddr*) &query.client, sizeof(query.client));
+}
+
+/**
+ * Runs a caching DNS forwarder for the containers on the given network on 'socketFd',
+ * see openDnsSocket(), until 'stopFd' becomes readable. Names of running containers
+ * on the network are answered from their state, and all other queries are forwarded
+ * to 'upstream' (<ip>[:<port>]) and their responses cached for the smallest TTL of
+ * their records. Only UDP is served, so a client receiving a truncated response
+ * cannot retry over TCP. Closes 'socketFd' before returning.
+ */
+void runDnsForwarder(const std::string& rootDir, const std::string& network, const std::string& upstream,
+                     int socketFd, int stopFd)
+{
+    DnsForwarder forwarder { rootDir, network, socketFd, -1, {}, {}, std::mt19937(std::random_device()()) };
+    // A connected socket only receives responses from the upstream server
+    sockaddr_in upstreamAddress = parseDnsServer(upstream);
+    forwarder.upstreamFd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (forwarder.upstreamFd < 0 ||
+        connect(forwarder.upstreamFd, (sockaddr*) &upstreamAddress, sizeof(upstreamAddress)) != 0)
+    {
+        LOG_F(ERROR, "Connect to DNS server %s: FAILED [Errno %d]", upstream.c_str(), errno);
+        if (forwarder.upstreamFd >= 0)
+            close(forwarder.upstreamFd);
+        close(socketFd);
+        return;
+    }
+
+    LOG_F(INFO, "Run DNS forwarder for network %s with upstream %s", network.c_str(), upstream.c_str());
+    std::vector<uint8_t> buffer(DNS_MESSAGE_SIZE);
+    pollfd fds[] = { { stopFd, POLLIN, 0 }, { socketFd, POLLIN, 0 }, { forwarder.upstreamFd, POLLIN, 0 } };
+    while (true)
+    {
+        if (poll(fds, 3, 1000) < 0 && errno != EINTR)
+        {
+            LOG_F(ERROR, "Poll DNS sockets: FAILED [Errno %d]", errno);
+            break;
+        }
+        if (fds[0].revents)
+            break;
+        if (fds[1].revents & POLLIN)
+            handleQuery(forwarder, buffer.data());
+        if (fds[2].revents & POLLIN)
+            handleResponse(forwarder, buffer.data());
+
+        // Forgets the queries which the upstream server has not answered in time
+        auto now = Clock::now();
+        for (auto it = forwarder.pending.begin(); it != forwarder.pending.end();)
+            it = it->second.deadline <= now ? forwarder.pending.erase(it) : std::next(it);
+    }
+    close(forwarder.upstreamFd);
+    close(socketFd);
+    LOG_F(INFO, "Stop DNS forwarder for network %s: SUCCESS", network.c_str());
+}
@@ -0,0 +1,12 @@
+#ifndef CONTAINER_CPP_DNS_H
+#define CONTAINER_CPP_DNS_H
+
+#include <string>
+#include <netinet/in.h>
+
+sockaddr_in parseDnsServer(const std::string& server);
+int openDnsSocket(const std::string& address);
+void runDnsForwarder(const std::string& rootDir, const std::string& network, const std::string& upstream,
+                     int socketFd, int stopFd);
+
+#endif //CONTAINER_CPP_DNS_H
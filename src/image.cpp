@@ -0,0 +1,542 @@
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <algorithm>
+#include <thread>
+#include <set>
+#include <map>
+#include <mutex>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <sys/sysmacros.h>
+#include <loguru/loguru.hpp>
+
+#include "constants.h"
+#include "container.h"
+#include "image.h"
+#include "utils.h"
+
+std::map<LayerType, std::string> layerTypeToString = {
+        { DistroLayer, "distro" },
+        { ArchiveLayer, "archive" },
+        { DiffLayer, "layer" }
+};
+
+/**
+ * Returns the path to the manifest of the layered image with the given ID.
+ * The manifest lists the layers of the image from the bottom to the top.
+ */
+std::string getImageManifestPath(const std::string& rootDir, const std::string& imageId)
+{
+    return rootDir + "/images/" + imageId + ".layers";
+}
+
+/**
+ * Reads the list of layers from the given manifest. Each line of a manifest
+ * has the format '<type> <id>', e.g. 'distro ubuntu' or 'layer 3k2j5h1l0c9a'.
+ *
+ * @throw runtime_error if the manifest cannot be opened or contains an invalid entry.
+ * @return the layers ordered from the bottom to the top.
+ */
+std::vector<Layer> readManifest(const std::string& manifestPath)
+{
+    std::ifstream manifest(manifestPath);
+    if (manifest.fail())
+        throw std::runtime_error("Open manifest " + manifestPath + ": FAILED");
+
+    std::vector<Layer> layers;
+    std::string type, id;
+    while (manifest >> type >> id)
+    {
+        auto it = std::find_if(layerTypeToString.cbegin(), layerTypeToString.cend(),
+                               [&type](const auto& entry) { return entry.second == type; });
+        if (it == layerTypeToString.cend())
+            throw std::runtime_error("Invalid layer type " + type + " in manifest " + manifestPath);
+        layers.push_back(Layer { it->first, id });
+    }
+    return layers;
+}
+
+/**
+ * Writes the given list of layers to a manifest. See readManifest() for the format.
+ */
+void writeManifest(const std::string& manifestPath, const std::vector<Layer>& layers)
+{
+    std::ofstream manifest(manifestPath, std::ios::out | std::ios::trunc);
+    if (manifest.fail())
+        throw std::runtime_error("Write manifest " + manifestPath + ": FAILED");
+
+    for (const auto& layer : layers)
+        manifest << layerTypeToString[layer.type] << " " << layer.id << std::endl;
+}
+
+/**
+ * Returns the directory in which the files of the given layer are stored. The
+ * directory is used as one of the lower-dirs of an overlay fs.
+ */
+std::string getLayerDir(const std::string& rootDir, const Layer& layer)
+{
+    switch (layer.type)
+    {
+        case DistroLayer:
+            return rootDir + "/cache/" + layer.id + "/rootfs";
+        case ArchiveLayer:
+            return rootDir + "/cache/" + layer.id;
+        default:
+            return rootDir + "/layers/" + layer.id;
+    }
+}
+
+/**
+ * Returns the directories of the given layers in the order expected by
+ * the 'lowerdir' option of an overlay fs, i.e. from the top to the bottom.
+ */
+std::vector<std::string> getLowerDirs(const std::string& rootDir, const std::vector<Layer>& layers)
+{
+    std::vector<std::string> lowerDirs;
+    for (auto it = layers.crbegin(); it != layers.crend(); it++)
+        lowerDirs.push_back(getLayerDir(rootDir, *it));
+    return lowerDirs;
+}
+
+/**
+ * Computes the total size of the diff layers in the given list. The distro and
+ * archive layers are not included since they are shared with other images.
+ */
+uintmax_t getLayersSize(const std::string& rootDir, const std::vector<Layer>& layers)
+{
+    uintmax_t size = 0;
+    for (const auto& layer : layers)
+    {
+        if (layer.type != DiffLayer)
+            continue;
+        std::error_code error;
+        for (const auto& entry : std::filesystem::recursive_directory_iterator(getLayerDir(rootDir, layer), error))
+        {
+            if (entry.is_regular_file(error) && !entry.is_symlink(error))
+                size += entry.file_size(error);
+        }
+    }
+    return size;
+}
+
+/**
+ * Deletes the diff layers in <root-dir>/layers which are no longer referenced
+ * by the manifest of any image or of any container, whose overlay fs may still
+ * be mounted on them, or by the manifest of a build (<image-id>.layers.partial). Layers which are being created (<layer>.partial) are kept,
+ * since they are only renamed into place once their image's manifest is written.
+ */
+void removeUnusedLayers(const std::string& rootDir)
+{
+    std::string layersDir = rootDir + "/layers";
+    if (!std::filesystem::exists(layersDir))
+        return;
+
+    std::set<std::string> usedLayers;
+    for (const auto& entry : std::filesystem::directory_iterator(rootDir + "/images"))
+    {
+        // The manifest of an image which is being built, or whose build has failed, keeps its layers as a cache
+        if (entry.path().extension() != ".layers" && entry.path().stem().extension() != ".layers")
+            continue;
+        for (const auto& layer : readManifest(entry.path()))
+            usedLayers.insert(layer.id);
+    }
+    std::error_code error;
+    for (const auto& entry : std::filesystem::directory_iterator(rootDir + "/containers", error))
+    {
+        if (!std::filesystem::exists(entry.path() / "layers"))
+            continue;
+        for (const auto& layer : readManifest(entry.path() / "layers"))
+            usedLayers.insert(layer.id);
+    }
+
+    for (const auto& entry : std::filesystem::directory_iterator(layersDir))
+    {
+        if (usedLayers.count(entry.path().filename()) || entry.path().extension() == ".partial")
+            continue;
+        LOG_F(INFO, "Removing unused layer %s", entry.path().c_str());
+        std::filesystem::remove_all(entry.path());
+    }
+}
+
+/**
+ * Checks if the given file is an overlay fs whiteout, i.e. a character device
+ * with device number 0/0 which marks a deleted file.
+ */
+bool isWhiteout(const struct stat& attr)
+{
+    return S_ISCHR(attr.st_mode) && major(attr.st_rdev) == 0 && minor(attr.st_rdev) == 0;
+}
+
+/**
+ * Checks if the given relative path exists in the lower-dirs, which are ordered
+ * from the top to the bottom. A whiteout in a higher layer hides the path.
+ */
+bool existsInLowerDirs(const std::vector<std::string>& lowerDirs, const std::string& path)
+{
+    struct stat attr{};
+    for (const auto& lowerDir : lowerDirs)
+    {
+        if (lstat((lowerDir + path).c_str(), &attr) == 0)
+            return !isWhiteout(attr);
+    }
+    return false;
+}
+
+/**
+ * Recursively scans 'dir' in the upper-dir of an overlay fs and records each
+ * change as a pair of a change type and the path in the container:
+ * - 'A' if the path was added
+ * - 'C' if the path was changed, including opaque directories whose content
+ * in the lower-dirs has been hidden
+ * - 'D' if the path was deleted, i.e. it is a whiteout
+ */
+void scanUpperDir(const std::string& upperDir,
+                  const std::string& dir,
+                  const std::vector<std::string>& lowerDirs,
+                  std::vector<std::pair<char, std::string>>& changes)
+{
+    struct stat attr{};
+    std::vector<std::string> pending = { dir };
+    while (!pending.empty())
+    {
+        std::string path = pending.back();
+        pending.pop_back();
+        if (lstat((upperDir + path).c_str(), &attr) != 0)
+            continue;
+
+        if (isWhiteout(attr))
+        {
+            changes.emplace_back('D', path);
+            continue;
+        }
+
+        changes.emplace_back(existsInLowerDirs(lowerDirs, path) ? 'C' : 'A', path);
+        if (!S_ISDIR(attr.st_mode))
+            continue;
+
+        std::error_code error;
+        for (const auto& entry : std::filesystem::directory_iterator(upperDir + path, error))
+            pending.push_back(path + "/" + entry.path().filename().string());
+    }
+}
+
+/**
+ * Lists the changes made to the file system of a running container by scanning
+ * its upper-dir <root-dir>/containers/<id>/copy-on-write. Since only the upper-dir
+ * has to be visited, the cost is proportional to the size of the changes rather
+ * than the size of the rootfs. The top-level entries are distributed among worker
+ * threads so that large upper-dirs are scanned in parallel.
+ */
+void diffContainer(const std::string& rootDir, const std::string& containerId)
+{
+    std::string containerDir = rootDir + "/containers/" + containerId;
+    std::string upperDir = containerDir + "/copy-on-write";
+    if (!std::filesystem::exists(upperDir))
+        throw std::runtime_error("[ERROR] Container " + containerId + " is not running or was started with -b");
+
+    auto lowerDirs = getLowerDirs(rootDir, readManifest(containerDir + "/layers"));
+
+    std::vector<std::string> topLevelEntries;
+    for (const auto& entry : std::filesystem::directory_iterator(upperDir))
+        topLevelEntries.push_back("/" + entry.path().filename().string());
+
+    size_t workerCount = std::max(1u, std::thread::hardware_concurrency());
+    workerCount = std::min(workerCount, topLevelEntries.size());
+    std::vector<std::vector<std::pair<char, std::string>>> results(workerCount);
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < workerCount; i++)
+    {
+        workers.emplace_back([&, i]() {
+            for (size_t j = i; j < topLevelEntries.size(); j += workerCount)
+                scanUpperDir(upperDir, topLevelEntries[j], lowerDirs, results[i]);
+        });
+    }
+    for (auto& worker : workers)
+        worker.join();
+
+    std::vector<std::pair<char, std::string>> changes;
+    for (auto& result : results)
+        changes.insert(changes.end(), result.begin(), result.end());
+    std::sort(changes.begin(), changes.end(),
+              [](const auto& a, const auto& b) { return a.second < b.second; });
+
+    for (const auto& change : changes)
+        std::cout << change.first << " " << change.second << std::endl;
+}
+
+/**
+ * Saves the changes made to the file system of a running container as a new
+ * layered image without stopping the container. Performs the following actions:
+ * 1. Freezes the container's processes with the freezer cgroup so that the
+ * upper-dir is in a consistent state.
+ * 2. Copies the upper-dir into a new diff layer in <root-dir>/layers. The copy
+ * preserves the whiteouts and extended attributes of the overlay fs, and uses
+ * reflinks where the file system supports them.
+ * 3. Thaws the container.
+ * 4. Writes the manifest of the new image, which consists of the layers of
+ * the container followed by the new layer.
+ * The layer is copied to <layer>.partial and only renamed once the manifest refers
+ * to it, so that removeUnusedLayers() never sees it unreferenced.
+ */
+void commitContainer(const std::string& rootDir, const std::string& containerId, const std::string& imageId)
+{
+    std::string containerDir = rootDir + "/containers/" + containerId;
+    std::string upperDir = containerDir + "/copy-on-write";
+    if (!std::filesystem::exists(upperDir))
+        throw std::runtime_error("[ERROR] Container " + containerId + " is not running or was started with -b");
+
+    std::string manifestPath = getImageManifestPath(rootDir, imageId);
+    if (std::filesystem::exists(manifestPath) || std::filesystem::exists(rootDir + "/images/" + imageId + ".tar.gz"))
+        throw std::runtime_error("[ERROR] Image with ID " + imageId + " already exists");
+
+    auto layers = readManifest(containerDir + "/layers");
+    Layer layer { DiffLayer, generateContainerId() };
+    std::string layerDir = getLayerDir(rootDir, layer);
+    std::string partialDir = layerDir + ".partial";
+    std::filesystem::create_directories(rootDir + "/layers");
+    std::filesystem::create_directories(rootDir + "/images");
+
+    LOG_F(INFO, "Committing container %s to image %s", containerId.c_str(), imageId.c_str());
+    freezeContainer(containerId, true);
+    int status = system(("cp -a --reflink=auto " + upperDir + " " + partialDir).c_str());
+    try
+    {
+        freezeContainer(containerId, false);
+    }
+    catch (std::exception& ex)
+    {
+        // Thawing only fails if the container has exited in the meantime, which leaves nothing to thaw
+        LOG_F(WARNING, "%s", ex.what());
+    }
+    if (status != 0)
+    {
+        std::filesystem::remove_all(partialDir);
+        throw std::runtime_error("Copy " + upperDir + " to " + partialDir + ": FAILED");
+    }
+    removeMountPoints(containerDir, partialDir);
+
+    layers.push_back(layer);
+    writeManifest(manifestPath, layers);
+    std::filesystem::rename(partialDir, layerDir);
+    std::cout << "Container " << containerId << " committed to image " << imageId << std::endl;
+    LOG_F(INFO, "Commit container %s: SUCCESS", containerId.c_str());
+}
+
+/**
+ * A struct representing a layer stored in a Docker or OCI image tarball.
+ */
+struct PackagedLayer
+{
+    // Path of the layer's tarball inside the image tarball
+    std::string path;
+    // Command which decompresses the layer's tarball from stdin to stdout
+    std::string decompressCommand;
+    Layer layer;
+};
+
+/**
+ * Lists the entries in the given tarball. The keys of the returned map are the
+ * names with the leading './' removed, and the values are the names as stored.
+ */
+std::map<std::string, std::string> listArchiveEntries(const std::string& archive)
+{
+    std::map<std::string, std::string> entries;
+    for (const auto& entry : split(systemWithOutput("tar -tf " + archive), "\n"))
+    {
+        std::string name = entry.rfind("./", 0) == 0 ? entry.substr(2) : entry;
+        if (!name.empty())
+            entries[name] = entry;
+    }
+    return entries;
+}
+
+/**
+ * Reads a file from the given tarball without extracting it to the disk.
+ */
+std::string readArchiveEntry(const std::string& archive,
+                             const std::map<std::string, std::string>& entries,
+                             const std::string& name)
+{
+    if (!entries.count(name))
+        throw std::runtime_error("Find " + name + " in " + archive + ": FAILED");
+    return systemWithOutput("tar -xOf " + archive + " " + entries.at(name));
+}
+
+/**
+ * Checks if the given tarball was produced with 'docker save' or contains an
+ * image in the OCI image layout.
+ */
+bool isLayeredArchive(const std::string& archive)
+{
+    auto entries = listArchiveEntries(archive);
+    return entries.count("manifest.json") || (entries.count("oci-layout") && entries.count("index.json"));
+}
+
+/**
+ * Finds the layers of the image in a 'docker save' tarball or a tarball in the
+ * OCI image layout, ordered from the bottom to the top. The ID of a layer is
+ * derived from its digest, so that layers shared between images are only
+ * extracted once.
+ */
+std::vector<PackagedLayer> findArchiveLayers(const std::string& archive)
+{
+    std::vector<PackagedLayer> layers;
+    auto entries = listArchiveEntries(archive);
+    if (entries.count("manifest.json"))
+    {
+        // Layers are either <id>/layer.tar (legacy format) or blobs/sha256/<digest>
+        for (const auto& path : findJsonArray(readArchiveEntry(archive, entries, "manifest.json"), "Layers"))
+        {
+            std::filesystem::path layerPath(path);
+            std::string id = layerPath.filename() == "layer.tar" ?
+                    layerPath.parent_path().filename().string() : layerPath.filename().string();
+            if (!entries.count(path))
+                throw std::runtime_error("Find " + path + " in " + archive + ": FAILED");
+            layers.push_back(PackagedLayer { entries[path], "gzip -dcf", Layer { DiffLayer, id } });
+        }
+        return layers;
+    }
+
+    // Follows the OCI index until a manifest which lists layers is found
+    std::string manifest = readArchiveEntry(archive, entries, "index.json");
+    for (int level = 0; level < 4 && findJsonArray(manifest, "layers", "digest").empty(); level++)
+    {
+        auto digests = findJsonArray(manifest, "manifests", "digest");
+        if (digests.empty())
+            break;
+        auto digest = split(digests.front(), ":");
+        if (digest.size() != 2)
+            throw std::runtime_error("Invalid manifest digest " + digests.front());
+        manifest = readArchiveEntry(archive, entries, "blobs/" + digest[0] + "/" + digest[1]);
+    }
+
+    auto digests = findJsonArray(manifest, "layers", "digest");
+    auto mediaTypes = findJsonArray(manifest, "layers", "mediaType");
+    for (size_t i = 0; i < digests.size(); i++)
+    {
+        auto digest = split(digests[i], ":");
+        if (digest.size() != 2)
+            throw std::runtime_error("Invalid layer digest " + digests[i]);
+        std::string path = "blobs/" + digest[0] + "/" + digest[1];
+        if (!entries.count(path))
+            throw std::runtime_error("Find " + path + " in " + archive + ": FAILED");
+        bool isZstd = i < mediaTypes.size() && mediaTypes[i].find("zstd") != std::string::npos;
+        layers.push_back(PackagedLayer { entries[path],
+                                        isZstd ? "zstd -dc" : "gzip -dcf",
+                                        Layer { DiffLayer, digest[1] } });
+    }
+    return layers;
+}
+
+/**
+ * Converts the whiteouts of an OCI layer into the format of an overlay fs:
+ * - '.wh.<name>' becomes a character device <name> with device number 0/0
+ * - '.wh..wh..opq' becomes the xattr 'trusted.overlay.opaque=y' on its directory
+ */
+void convertWhiteouts(const std::string& layerDir)
+{
+    std::vector<std::filesystem::path> whiteouts;
+    for (const auto& entry : std::filesystem::recursive_directory_iterator(layerDir))
+    {
+        if (entry.path().filename().string().rfind(".wh.", 0) == 0)
+            whiteouts.push_back(entry.path());
+    }
+
+    for (const auto& whiteout : whiteouts)
+    {
+        std::string name = whiteout.filename();
+        std::filesystem::path parent = whiteout.parent_path();
+        std::filesystem::remove_all(whiteout);
+        if (name == ".wh..wh..opq")
+        {
+            if (setxattr(parent.c_str(), "trusted.overlay.opaque", "y", 1, 0) != 0)
+                throw std::runtime_error("Mark " + parent.string() + " opaque: FAILED [Errno " + std::to_string(errno) + "]");
+            continue;
+        }
+
+        std::filesystem::path target = parent / name.substr(4);
+        std::filesystem::remove_all(target);
+        if (mknod(target.c_str(), S_IFCHR, makedev(0, 0)) != 0)
+            throw std::runtime_error("Create whiteout " + target.string() + ": FAILED [Errno " + std::to_string(errno) + "]");
+    }
+}
+
+/**
+ * Imports a 'docker save' tarball or a tarball in the OCI image layout as a layered
+ * image. Performs the following actions:
+ * 1. Reads the image manifest from the tarball to find its layers.
+ * 2. Extracts each layer which is not present yet in <root-dir>/layers into its own
+ * directory. Each layer is streamed out of the tarball and extracted by a separate
+ * worker thread, so the layers are extracted in parallel and the tarball is never
+ * unpacked to a temporary location.
+ * 3. Converts the OCI whiteouts into overlay fs whiteouts, so that the layers can be
+ * stacked as lower-dirs without being flattened.
+ * 4. Registers the image by writing its manifest to <root-dir>/images.
+ * The layers are extracted into <layer>.partial and only renamed into place once the
+ * manifest refers to them, so that neither an interrupted import leaves an incomplete
+ * layer behind nor removeUnusedLayers() deletes the layers of an ongoing import.
+ */
+void importLayeredArchive(const std::string& rootDir, const std::string& imageId, const std::string& archive)
+{
+    auto packagedLayers = findArchiveLayers(archive);
+    if (packagedLayers.empty())
+        throw std::runtime_error("[ERROR] No layers found in " + archive);
+    std::filesystem::create_directories(rootDir + "/layers");
+
+    std::mutex errorMutex;
+    std::vector<std::string> errors;
+    std::vector<std::thread> workers;
+    std::set<std::string> extractedLayers;
+    for (const auto& packagedLayer : packagedLayers)
+    {
+        std::string layerDir = getLayerDir(rootDir, packagedLayer.layer);
+        // Skips layers shared with previously imported images or repeated in the same image
+        if (std::filesystem::exists(layerDir) || !extractedLayers.insert(packagedLayer.layer.id).second)
+            continue;
+
+        workers.emplace_back([&, packagedLayer, layerDir]() {
+            std::string partialDir = layerDir + ".partial";
+            try
+            {
+                LOG_F(INFO, "Extracting layer %s", packagedLayer.layer.id.c_str());
+                std::filesystem::remove_all(partialDir);
+                std::filesystem::create_directories(partialDir);
+                std::string command = "tar -xOf " + archive + " " + packagedLayer.path + " | " +
+                        packagedLayer.decompressCommand + " | tar -xpf - -C " + partialDir;
+                if (system(command.c_str()) != 0)
+                    throw std::runtime_error("Extract layer " + packagedLayer.layer.id + ": FAILED");
+                convertWhiteouts(partialDir);
+                LOG_F(INFO, "Extract layer %s: SUCCESS", packagedLayer.layer.id.c_str());
+            }
+            catch (std::exception& ex)
+            {
+                std::error_code error;
+                std::filesystem::remove_all(partialDir, error);
+                std::lock_guard<std::mutex> lock(errorMutex);
+                errors.emplace_back(ex.what());
+            }
+        });
+    }
+    for (auto& worker : workers)
+        worker.join();
+    if (!errors.empty())
+    {
+        std::error_code error;
+        for (const auto& layerId : extractedLayers)
+            std::filesystem::remove_all(getLayerDir(rootDir, Layer { DiffLayer, layerId }) + ".partial", error);
+        throw std::runtime_error(errors.front());
+    }
+
+    std::vector<Layer> layers;
+    for (const auto& packagedLayer : packagedLayers)
+        layers.push_back(packagedLayer.layer);
+    std::filesystem::create_directories(rootDir + "/images");
+    writeManifest(getImageManifestPath(rootDir, imageId), layers);
+    for (const auto& layerId : extractedLayers)
+    {
+        std::string layerDir = getLayerDir(rootDir, Layer { DiffLayer, layerId });
+        std::filesystem::rename(layerDir + ".partial", layerDir);
+    }
+}
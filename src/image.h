@@ -0,0 +1,40 @@
+#ifndef CONTAINER_CPP_IMAGE_H
+#define CONTAINER_CPP_IMAGE_H
+
+#include <string>
+#include <vector>
+
+/**
+ * The types of entries in the manifest of a layered image.
+ * DistroLayer: the root file system of one of the available distros.
+ * ArchiveLayer: an image built with 'buildImage' and stored as a tarball.
+ * DiffLayer: a layer in <root-dir>/layers which contains the changes made
+ * on top of the layers below it, including overlay fs whiteouts.
+ */
+enum LayerType
+{
+    DistroLayer, ArchiveLayer, DiffLayer
+};
+
+/**
+ * A struct representing an entry in the manifest of a layered image.
+ */
+struct Layer
+{
+    LayerType type;
+    std::string id;
+};
+
+std::string getImageManifestPath(const std::string& rootDir, const std::string& imageId);
+std::vector<Layer> readManifest(const std::string& manifestPath);
+void writeManifest(const std::string& manifestPath, const std::vector<Layer>& layers);
+std::string getLayerDir(const std::string& rootDir, const Layer& layer);
+std::vector<std::string> getLowerDirs(const std::string& rootDir, const std::vector<Layer>& layers);
+uintmax_t getLayersSize(const std::string& rootDir, const std::vector<Layer>& layers);
+void removeUnusedLayers(const std::string& rootDir);
+void diffContainer(const std::string& rootDir, const std::string& containerId);
+void commitContainer(const std::string& rootDir, const std::string& containerId, const std::string& imageId);
+bool isLayeredArchive(const std::string& archive);
+void importLayeredArchive(const std::string& rootDir, const std::string& imageId, const std::string& archive);
+
+#endif //CONTAINER_CPP_IMAGE_H
@@ -0,0 +1,463 @@
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <filesystem>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <loguru/loguru.hpp>
+
+#include "ipam.h"
+#include "utils.h"
+
+/**
+ * The allocation state of a network is stored in <root-dir>/network/<bridge>.ipam.
+ * The file starts with this header, followed by a bitmap with one bit for each
+ * address in the subnet, where a set bit marks an address that is in use.
+ */
+struct IpamHeader
+{
+    // Subnet the bitmap was created for
+    uint32_t subnet;
+    uint32_t prefixLength;
+    // Index of the bitmap word in which the last address was allocated
+    uint64_t nextWord;
+};
+
+/**
+ * Converts an IPv4 address in dotted notation to an integer in host byte order.
+ * @throw invalid_argument if the address is malformed.
+ */
+uint32_t ipToInteger(const std::string& ip)
+{
+    in_addr address{};
+    if (inet_pton(AF_INET, ip.c_str(), &address) != 1)
+        throw std::invalid_argument("[ERROR] Invalid IPv4 address " + ip);
+    return ntohl(address.s_addr);
+}
+
+std::string integerToIp(uint32_t address)
+{
+    in_addr addressStruct{};
+    addressStruct.s_addr = htonl(address);
+    char buffer[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addressStruct, buffer, sizeof(buffer));
+    return std::string(buffer);
+}
+
+std::string getSubnetString(const Network& network)
+{
+    return integerToIp(network.subnet) + "/" + std::to_string(network.prefixLength);
+}
+
+/**
+ * Creates a Network struct from the name of a bridge and a subnet in CIDR notation
+ * (e.g. 107.17.0.0/16). The gateway is the first host address in the subnet, and
+ * the network is named after the bridge.
+ *
+ * @throw invalid_argument if the bridge name or the subnet is invalid.
+ */
+Network parseNetwork(const std::string& bridge, const std::string& subnet)
+{
+    if (bridge.empty() || bridge.size() >= IFNAMSIZ || bridge.find_first_of("/: \t") != std::string::npos)
+        throw std::invalid_argument("[ERROR] Invalid bridge name " + bridge);
+
+    size_t slash = subnet.find('/');
+    if (slash == std::string::npos)
+        throw std::invalid_argument("[ERROR] Subnet " + subnet + " has to be in CIDR notation (e.g. 107.17.0.0/16)");
+    std::string prefix = subnet.substr(slash + 1);
+    if (prefix.empty() || prefix.find_first_not_of("0123456789") != std::string::npos ||
+        prefix.size() > 2 || std::stoi(prefix) < 8 || std::stoi(prefix) > 30)
+        throw std::invalid_argument("[ERROR] The prefix length of subnet " + subnet + " has to be between 8 and 30");
+
+    int prefixLength = std::stoi(prefix);
+    uint32_t mask = ~0u << (32 - prefixLength);
+    uint32_t address = ipToInteger(subnet.substr(0, slash)) & mask;
+    return Network { bridge, VethDriver, address, prefixLength, integerToIp(address + 1), bridge, 0, prefixLength,
+                     false, false, "", 0, 0, 0, FeatureDefault, FeatureDefault };
+}
+
+uint32_t getShardCount(const Network& network)
+{
+    if (network.shardPrefixLength == 0)
+        return 1;
+    return 1u << (network.shardPrefixLength - network.networkPrefixLength);
+}
+
+/**
+ * Returns the shard with the given index of a sharded network. Shard <n> is the n-th
+ * subnet of 'shardPrefixLength' bits in the network, on the bridge <name>-<n>, whose
+ * gateway is the first host address in the shard.
+ */
+Network getNetworkShard(const Network& network, uint32_t index)
+{
+    uint32_t networkAddress = network.subnet & (~0u << (32 - network.networkPrefixLength));
+    Network shard = network;
+    shard.bridge = network.name + "-" + std::to_string(index);
+    shard.subnet = networkAddress + index * (1u << (32 - network.shardPrefixLength));
+    shard.prefixLength = network.shardPrefixLength;
+    shard.gateway = integerToIp(shard.subnet + 1);
+    return shard;
+}
+
+/**
+ * Returns the number of 64-bit words in the bitmap of the given network.
+ */
+uint64_t getBitmapWordCount(const Network& network)
+{
+    uint64_t addressCount = 1ull << (32 - network.prefixLength);
+    return (addressCount + 63) / 64;
+}
+
+off_t getBitmapWordOffset(uint64_t index)
+{
+    return (off_t) (sizeof(IpamHeader) + index * sizeof(uint64_t));
+}
+
+/**
+ * Creates the bitmap of a new network, where the network address, the gateway and
+ * the broadcast address are reserved. The header is written last, so that a
+ * partially written file is initialized again.
+ */
+void initializeBitmap(int fd, const Network& network, IpamHeader& header)
+{
+    uint64_t addressCount = 1ull << (32 - network.prefixLength);
+    uint64_t gateway = ipToInteger(network.gateway) - network.subnet;
+    std::vector<uint64_t> bitmap(getBitmapWordCount(network), 0);
+    for (uint64_t reserved : { (uint64_t) 0, gateway, addressCount - 1 })
+        bitmap[reserved / 64] |= 1ull << (reserved % 64);
+    // Marks the bits beyond the end of subnets with fewer than 64 addresses
+    for (uint64_t i = addressCount; i < bitmap.size() * 64; i++)
+        bitmap[i / 64] |= 1ull << (i % 64);
+
+    header = IpamHeader { network.subnet, (uint32_t) network.prefixLength, 0 };
+    size_t bitmapSize = bitmap.size() * sizeof(uint64_t);
+    if (pwrite(fd, bitmap.data(), bitmapSize, getBitmapWordOffset(0)) != (ssize_t) bitmapSize ||
+        pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+        throw std::runtime_error("Initialize IPAM bitmap: FAILED [Errno " + std::to_string(errno) + "]");
+}
+
+std::string getIpamPath(const std::string& rootDir, const Network& network)
+{
+    return rootDir + "/network/" + network.bridge + ".ipam";
+}
+
+/**
+ * Opens the allocation state of the given network and takes an exclusive lock on it,
+ * which serializes concurrent launches across processes. The lock is released
+ * when the returned file descriptor is closed. A file which has been deleted by
+ * deleteIpamFile() while waiting for the lock is opened again.
+ *
+ * @param create whether the file is created if it does not exist.
+ * @throw invalid_argument if the bridge is already used with a different subnet.
+ * @return the locked file descriptor, or -1 if the file does not exist and 'create' is false.
+ */
+int lockIpamFile(const std::string& rootDir, const Network& network, IpamHeader& header, bool create = true)
+{
+    std::filesystem::create_directories(rootDir + "/network");
+    std::string path = getIpamPath(rootDir, network);
+    int fd = -1;
+    try
+    {
+        while (true)
+        {
+            fd = open(path.c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+            if (fd < 0 && !create && errno == ENOENT)
+                return -1;
+            if (fd < 0)
+                throw std::runtime_error("Open " + path + ": FAILED [Errno " + std::to_string(errno) + "]");
+            if (flock(fd, LOCK_EX) != 0)
+                throw std::runtime_error("Lock " + path + ": FAILED [Errno " + std::to_string(errno) + "]");
+            struct stat status{};
+            if (fstat(fd, &status) != 0 || status.st_nlink > 0)
+                break;
+            close(fd);
+            fd = -1;
+        }
+        if (pread(fd, &header, sizeof(header), 0) != sizeof(header))
+            initializeBitmap(fd, network, header);
+        else if (header.subnet != network.subnet || (int) header.prefixLength != network.prefixLength)
+            throw std::invalid_argument("[ERROR] Bridge " + network.bridge + " already uses subnet " +
+                                        integerToIp(header.subnet) + "/" + std::to_string(header.prefixLength));
+    }
+    catch (std::exception& ex)
+    {
+        if (fd >= 0)
+            close(fd);
+        throw;
+    }
+    return fd;
+}
+
+/**
+ * Counts the allocated addresses in the bitmap of a locked network, which excludes
+ * the network address, the gateway and the broadcast address.
+ */
+uint64_t countAllocatedBits(int fd, const Network& network)
+{
+    uint64_t addressCount = 1ull << (32 - network.prefixLength);
+    std::vector<uint64_t> bitmap(getBitmapWordCount(network), 0);
+    size_t bitmapSize = bitmap.size() * sizeof(uint64_t);
+    if (pread(fd, bitmap.data(), bitmapSize, getBitmapWordOffset(0)) != (ssize_t) bitmapSize)
+        throw std::runtime_error("Read IPAM bitmap: FAILED [Errno " + std::to_string(errno) + "]");
+    uint64_t count = 0;
+    for (uint64_t word : bitmap)
+        count += __builtin_popcountll(word);
+    // Subtracts the reserved bits and the bits beyond the end of small subnets
+    return count - 3 - (bitmap.size() * 64 - addressCount);
+}
+
+/**
+ * Allocates an unused IPv4 address in the subnet of the given network. The search
+ * starts at the bitmap word in which the previous address was allocated, so an
+ * allocation normally reads and writes a single word regardless of the number of
+ * containers.
+ *
+ * @throw runtime_error if the bitmap cannot be read or written.
+ * @return the allocated IPv4 address, or an empty string if all the addresses in the subnet are in use.
+ */
+std::string tryAllocateIp(const std::string& rootDir, const Network& network)
+{
+    IpamHeader header{};
+    int fd = lockIpamFile(rootDir, network, header);
+    uint64_t wordCount = getBitmapWordCount(network);
+    for (uint64_t i = 0; i < wordCount; i++)
+    {
+        uint64_t index = (header.nextWord + i) % wordCount;
+        uint64_t word = 0;
+        if (pread(fd, &word, sizeof(word), getBitmapWordOffset(index)) != sizeof(word))
+        {
+            int error = errno;
+            close(fd);
+            throw std::runtime_error("Read IPAM bitmap: FAILED [Errno " + std::to_string(error) + "]");
+        }
+        if (word == ~0ull)
+            continue;
+
+        int bit = __builtin_ctzll(~word);
+        word |= 1ull << bit;
+        header.nextWord = index;
+        if (pwrite(fd, &word, sizeof(word), getBitmapWordOffset(index)) != sizeof(word) ||
+            pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+        {
+            int error = errno;
+            close(fd);
+            throw std::runtime_error("Write IPAM bitmap: FAILED [Errno " + std::to_string(error) + "]");
+        }
+        close(fd);
+        return integerToIp(network.subnet + (uint32_t) (index * 64 + bit));
+    }
+    close(fd);
+    return "";
+}
+
+/**
+ * Allocates an unused IPv4 address in the subnet of the given network, see tryAllocateIp().
+ *
+ * @throw runtime_error if all the addresses in the subnet are in use.
+ * @return the allocated IPv4 address.
+ */
+std::string allocateIp(const std::string& rootDir, const Network& network)
+{
+    std::string ip = tryAllocateIp(rootDir, network);
+    if (ip.empty())
+        throw std::runtime_error("Allocate IPv4 address in " + getSubnetString(network) + ": FAILED [no free address]");
+    return ip;
+}
+
+/**
+ * Returns the given IPv4 address to the pool of the given network. If no address of
+ * the network is in use afterwards, 'onUnused' is called while the network is still
+ * locked, so that no address can be allocated in the meantime.
+ */
+void releaseIp(const std::string& rootDir, const Network& network, const std::string& ip,
+               const std::function<void()>& onUnused)
+{
+    // The network address and the broadcast address are never released
+    uint64_t offset = ipToInteger(ip) - network.subnet;
+    if (offset < 1 || offset >= (1ull << (32 - network.prefixLength)) - 1)
+        throw std::runtime_error("Release IPv4 address " + ip + ": FAILED [not in " + getSubnetString(network) + "]");
+
+    IpamHeader header{};
+    int fd = lockIpamFile(rootDir, network, header);
+    uint64_t word = 0;
+    bool success = pread(fd, &word, sizeof(word), getBitmapWordOffset(offset / 64)) == sizeof(word);
+    word &= ~(1ull << (offset % 64));
+    success = success && pwrite(fd, &word, sizeof(word), getBitmapWordOffset(offset / 64)) == sizeof(word);
+    if (!success)
+    {
+        close(fd);
+        throw std::runtime_error("Release IPv4 address " + ip + ": FAILED [Errno " + std::to_string(errno) + "]");
+    }
+    LOG_F(INFO, "Release IPv4 address %s: SUCCESS", ip.c_str());
+
+    try
+    {
+        if (onUnused && countAllocatedBits(fd, network) == 0)
+            onUnused();
+    }
+    catch (std::exception& ex)
+    {
+        close(fd);
+        throw;
+    }
+    close(fd);
+}
+
+/**
+ * Returns the number of addresses in use in the given network, by containers or by
+ * the slots of its network pool, or 0 if no address has ever been allocated in it.
+ */
+uint64_t countAllocatedIps(const std::string& rootDir, const Network& network)
+{
+    IpamHeader header{};
+    int fd = lockIpamFile(rootDir, network, header, false);
+    if (fd < 0)
+        return 0;
+    try
+    {
+        uint64_t count = countAllocatedBits(fd, network);
+        close(fd);
+        return count;
+    }
+    catch (std::exception& ex)
+    {
+        close(fd);
+        throw;
+    }
+}
+
+/**
+ * Deletes the allocation state of the given network, unless any of its addresses is
+ * in use. 'onDelete' is called while the network is still locked, e.g. to delete its
+ * bridge, so that a concurrent launch either allocates its address before and keeps
+ * the network, or after and starts over with a new bridge.
+ *
+ * @return false if an address of the network is in use, true otherwise.
+ */
+bool deleteIpamFile(const std::string& rootDir, const Network& network, const std::function<void()>& onDelete)
+{
+    IpamHeader header{};
+    int fd = lockIpamFile(rootDir, network, header, false);
+    if (fd < 0)
+    {
+        onDelete();
+        return true;
+    }
+    try
+    {
+        if (countAllocatedBits(fd, network) > 0)
+        {
+            close(fd);
+            return false;
+        }
+        onDelete();
+        unlink(getIpamPath(rootDir, network).c_str());
+    }
+    catch (std::exception& ex)
+    {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    return true;
+}
+
+/**
+ * Returns the bridges which have an allocation state in <root-dir>/network, i.e. every
+ * bridge containers have been attached to, whether it belongs to a network created
+ * with 'network create' or not, with the subnet stored in its IPAM header.
+ */
+std::vector<Network> listIpamNetworks(const std::string& rootDir)
+{
+    std::vector<Network> networks;
+    std::error_code error;
+    for (const auto& entry : std::filesystem::directory_iterator(rootDir + "/network", error))
+    {
+        if (entry.path().extension() != ".ipam")
+            continue;
+        int fd = open(entry.path().c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        // The header is written last, so a file without a complete header holds no addresses yet
+        IpamHeader header{};
+        bool success = pread(fd, &header, sizeof(header), 0) == sizeof(header);
+        close(fd);
+        if (success)
+            networks.push_back(parseNetwork(entry.path().stem(), integerToIp(header.subnet) + "/" +
+                                                                 std::to_string(header.prefixLength)));
+    }
+    return networks;
+}
+
+std::string getNetworkDefinitionPath(const std::string& rootDir, const std::string& name)
+{
+    return rootDir + "/network/networks/" + name;
+}
+
+bool networkExists(const std::string& rootDir, const std::string& name)
+{
+    return std::filesystem::exists(getNetworkDefinitionPath(rootDir, name));
+}
+
+/**
+ * Loads the network created with 'network create' under the given name. Its definition
+ * holds the subnet of the network in CIDR notation ('subnet'), the address of its
+ * gateway ('gateway') and the prefix length of its shards ('shard-prefix', 0 if it is
+ * not sharded).
+ *
+ * @throw invalid_argument if there is no such network.
+ */
+Network loadNetwork(const std::string& rootDir, const std::string& name)
+{
+    auto definition = readProperties(getNetworkDefinitionPath(rootDir, name));
+    if (!definition.count("subnet"))
+        throw std::invalid_argument("[ERROR] Network " + name + " does not exist");
+    Network network = parseNetwork(name, definition["subnet"]);
+    if (definition.count("gateway"))
+        network.gateway = definition["gateway"];
+    if (definition.count("shard-prefix"))
+        network.shardPrefixLength = std::stoi(definition["shard-prefix"]);
+    return network;
+}
+
+void saveNetwork(const std::string& rootDir, const Network& network)
+{
+    std::string path = getNetworkDefinitionPath(rootDir, network.name);
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path());
+    std::map<std::string, std::string> definition = {
+            { "subnet", getSubnetString(network) },
+            { "gateway", network.gateway },
+            { "shard-prefix", std::to_string(network.shardPrefixLength) }
+    };
+    if (!writeProperties(path, definition))
+        throw std::runtime_error("Write " + path + ": FAILED");
+}
+
+/**
+ * Returns the networks created with 'network create', sorted by name.
+ */
+std::vector<Network> listNetworks(const std::string& rootDir)
+{
+    std::vector<std::string> names;
+    std::error_code error;
+    for (const auto& entry : std::filesystem::directory_iterator(rootDir + "/network/networks", error))
+        names.push_back(entry.path().filename());
+    std::sort(names.begin(), names.end());
+
+    std::vector<Network> networks;
+    for (const auto& name : names)
+        networks.push_back(loadNetwork(rootDir, name));
+    return networks;
+}
+
+void deleteNetworkDefinition(const std::string& rootDir, const std::string& name)
+{
+    std::string path = getNetworkDefinitionPath(rootDir, name);
+    if (unlink(path.c_str()) != 0)
+        throw std::runtime_error("Delete " + path + ": FAILED [Errno " + std::to_string(errno) + "]");
+}
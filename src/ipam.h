@@ -0,0 +1,93 @@
+#ifndef CONTAINER_CPP_IPAM_H
+#define CONTAINER_CPP_IPAM_H
+
+#include <string>
+#include <map>
+#include <vector>
+#include <functional>
+#include <cstdint>
+
+/**
+ * The kinds of interfaces through which a container is connected to its network,
+ * selected with --network-driver.
+ * VethDriver: a veth pair attached to the bridge.
+ * NetkitDriver: a netkit pair attached to the bridge, falling back to veth on kernels without netkit.
+ * MacvlanDriver: a macvlan interface in bridge mode on top of the parent device.
+ * IpvlanL2Driver and IpvlanL3Driver: an ipvlan interface in L2 or L3 mode on top of the parent device.
+ */
+enum NetworkDriver
+{
+    VethDriver, NetkitDriver, MacvlanDriver, IpvlanL2Driver, IpvlanL3Driver
+};
+
+extern std::map<std::string, NetworkDriver> stringToNetworkDriver;
+
+/**
+ * The setting of an offload feature (GRO or GSO) of a container's interface, selected
+ * with --gro and --gso. FeatureDefault leaves the kernel's default in place.
+ */
+enum LinkFeature
+{
+    FeatureDefault, FeatureOff, FeatureOn
+};
+
+/**
+ * A struct representing a bridge network from which containers are assigned
+ * IPv4 addresses. For the macvlan and ipvlan drivers, the bridge is the parent
+ * device of the containers' interfaces instead.
+ * A network created with 'network create' may be sharded, i.e. split into subnets
+ * of 'shardPrefixLength' bits, each on a bridge <name>-<n> of its own. Until a shard
+ * is selected for a container, 'bridge', 'subnet' and 'prefixLength' describe the
+ * whole network.
+ */
+struct Network
+{
+    std::string bridge;
+    NetworkDriver driver;
+    // Network address of the subnet in host byte order
+    uint32_t subnet;
+    int prefixLength;
+    // Address of the bridge, by default the first host address in the subnet
+    std::string gateway;
+    // Name of the network, which is the bridge unless the network is sharded
+    std::string name;
+    // Prefix length of the shards of the network, 0 if it is not sharded
+    int shardPrefixLength;
+    // Prefix length of the whole network, which contains the subnets of all its shards
+    int networkPrefixLength;
+    // Whether traffic within the subnet bypasses connection tracking
+    bool notrack;
+    // Whether traffic between containers is redirected by BPF instead of crossing the bridge
+    bool fastPath;
+    // Upstream server (<ip>[:<port>]) of the DNS forwarder on the gateway, empty if it is disabled
+    std::string dnsUpstream;
+    // MTU, number of TX and RX queues and TX queue length of the container's interface, 0 for the defaults
+    uint32_t mtu;
+    uint32_t queues;
+    uint32_t txQueueLength;
+    LinkFeature gro;
+    LinkFeature gso;
+};
+
+uint32_t ipToInteger(const std::string& ip);
+std::string integerToIp(uint32_t address);
+std::string getSubnetString(const Network& network);
+Network parseNetwork(const std::string& bridge, const std::string& subnet);
+uint32_t getShardCount(const Network& network);
+Network getNetworkShard(const Network& network, uint32_t index);
+std::string tryAllocateIp(const std::string& rootDir, const Network& network);
+std::string allocateIp(const std::string& rootDir, const Network& network);
+void releaseIp(const std::string& rootDir, const Network& network, const std::string& ip,
+               const std::function<void()>& onUnused = nullptr);
+uint64_t countAllocatedIps(const std::string& rootDir, const Network& network);
+bool deleteIpamFile(const std::string& rootDir, const Network& network, const std::function<void()>& onDelete);
+std::vector<Network> listIpamNetworks(const std::string& rootDir);
+
+// Networks created with 'network create', which are stored in <root-dir>/network/networks/<name>
+bool networkExists(const std::string& rootDir, const std::string& name);
+Network loadNetwork(const std::string& rootDir, const std::string& name);
+void saveNetwork(const std::string& rootDir, const Network& network);
+std::vector<Network> listNetworks(const std::string& rootDir);
+void deleteNetworkDefinition(const std::string& rootDir, const std::string& name);
+
+#endif //CONTAINER_CPP_IPAM_H
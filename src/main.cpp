@@ -1,29 +1,103 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <iterator>
 #include <filesystem>
 #include <time.h>
 #include <sys/stat.h>
+#include <linux/pkt_sched.h>
 #include <loguru/loguru.hpp>
+// Options given multiple times (e.g. -v, --sysctl) are collected into vectors, whose
+// values must not be split any further, since volume options are separated by commas
+// and sysctl values may hold lists (e.g. net.ipv4.ip_local_reserved_ports=8080,9148)
+#define CXXOPTS_VECTOR_DELIMITER '\0'
 #include <cxxopts/cxxopts.hpp>
 
 #include "container.h"
+#include "network.h"
+#include "dns.h"
 #include "constants.h"
+#include "image.h"
+#include "transfer.h"
+#include "build.h"
+#include "netstats.h"
 #include "utils.h"
 
+static_assert(CXXOPTS_VECTOR_DELIMITER != ',', "cxxopts would split values containing commas");
+
 std::map<std::string, CommandType> stringToCommandType = {
         { "run", Run },
         { "ls", List },
         { "list", List },
         { "rm", Delete },
         { "remove", Delete },
-        { "delete", Delete }
+        { "delete", Delete },
+        { "diff", Diff },
+        { "commit", Commit },
+        { "cp", Copy },
+        { "export", Export },
+        { "import", Import },
+        { "build", Build },
+        { "netstats", NetStats },
+        { "network", NetworkCommand }
+};
+
+std::map<std::string, NetworkMode> stringToNetworkMode = {
+        { "none", NetworkNone },
+        { "loopback", NetworkLoopback },
+        { "host", NetworkHost },
+        { "bridge", NetworkBridge }
+};
+
+std::map<std::string, uint32_t> stringToNetworkPriority = {
+        { "low", TC_PRIO_BULK },
+        { "normal", TC_PRIO_BESTEFFORT },
+        { "high", TC_PRIO_INTERACTIVE }
+};
+
+// Sysctls given to --sysctl-profile, which the sysctls given to --sysctl override
+std::map<std::string, std::vector<std::string>> stringToSysctlProfile = {
+        // Many short-lived connections, e.g. web servers and proxies
+        { "web", {
+                "net.core.somaxconn=4096",
+                "net.ipv4.tcp_max_syn_backlog=4096",
+                "net.ipv4.ip_local_port_range=1024 65535",
+                "net.ipv4.tcp_tw_reuse=1",
+                "net.ipv4.tcp_fin_timeout=15"
+        } },
+        // Long-lived bulk transfers, e.g. storage and replication
+        { "throughput", {
+                "net.ipv4.tcp_rmem=4096 131072 16777216",
+                "net.ipv4.tcp_wmem=4096 65536 16777216",
+                "net.ipv4.tcp_slow_start_after_idle=0",
+                "net.ipv4.tcp_mtu_probing=1"
+        } },
+        // Small request/response messages, e.g. RPC and databases
+        { "latency", {
+                "net.ipv4.tcp_notsent_lowat=16384",
+                "net.ipv4.tcp_slow_start_after_idle=0",
+                "net.ipv4.tcp_fastopen=3"
+        } }
+};
+
+std::map<std::string, NetworkDriver> stringToNetworkDriver = {
+        { "veth", VethDriver },
+        { "netkit", NetkitDriver },
+        { "macvlan", MacvlanDriver },
+        { "ipvlan-l2", IpvlanL2Driver },
+        { "ipvlan-l3", IpvlanL3Driver }
+};
+
+std::map<std::string, LinkFeature> stringToLinkFeature = {
+        { "on", FeatureOn },
+        { "off", FeatureOff }
 };
 
 
 /**
  * A helper function that fetches a list of container images from the
- * directory <root-dir>/images/.
+ * directory <root-dir>/images/. The size of a layered image is the total
+ * size of its diff layers.
  * @return the images as a vector of 'Image' structs, which contain the
  * relevant data.
  */
@@ -38,7 +112,11 @@ std::vector<Image> getContainerImages(const std::string& rootDir)
         stat(archive.path().c_str(), &attr);
         std::string lastModified(trimEnd(ctime(&attr.st_mtime)));
 
-        uintmax_t fileSize = std::filesystem::file_size(archive);
+        uintmax_t fileSize;
+        if (archive.path().extension() == ".layers")
+            fileSize = getLayersSize(rootDir, readManifest(archive.path()));
+        else
+            fileSize = std::filesystem::file_size(archive);
         images.emplace_back(Image { imageId, fileSize, lastModified });
     }
     return images;
@@ -65,15 +143,39 @@ void run(std::string rootDir,
          std::string distroName,
          std::string command,
          ResourceLimits* resourceLimits,
+         std::vector<Volume> volumes,
+         NetworkMode networkMode,
+         const std::string& networkOwner,
+         const Network& network,
+         int networkPoolSize,
+         bool networkAsync,
+         std::vector<PortMapping> publishedPorts,
+         const std::map<std::string, std::string>& sysctls,
+         std::vector<ListenSocket> listenSockets,
+         bool onDemand,
          bool buildImage)
 {
     bool isImage = imageExists(rootDir, containerId);
+    openListenSockets(listenSockets);
+    if (onDemand)
+    {
+        std::cout << "Container " << containerId << " waiting for a connection" << std::endl;
+        waitForConnection(listenSockets);
+    }
 
     if (isImage)
         std::cout << "Running image " << containerId << std::endl;
 
     Container* container = createContainer(distroName, containerId, rootDir,
-                                           command, resourceLimits, buildImage, isImage);
+                                           command, resourceLimits, volumes, buildImage, isImage);
+    container->networkMode = networkMode;
+    container->networkOwner = networkOwner;
+    container->network = network;
+    container->networkPoolSize = networkPoolSize;
+    container->networkAsync = networkAsync;
+    container->publishedPorts = publishedPorts;
+    container->sysctls = sysctls;
+    container->listenSockets = listenSockets;
     if (setUpContainer(container))
     {
         startContainer(container);
@@ -98,8 +200,10 @@ void list(const std::string& rootDir)
 }
 
 /**
- * Removes the container images (tarballs) specified by the vector of containerIds
- * from the directory <root-dir>/images/.
+ * Removes the container images (tarballs or manifests of layered images) specified
+ * by the vector of containerIds from the directory <root-dir>/images/, together with
+ * the manifest of a failed build of the image. The layers which are no longer used
+ * by any image are removed as well.
  */
 void remove(const std::string& rootDir, const std::vector<std::string>& imageIds)
 {
@@ -107,6 +211,8 @@ void remove(const std::string& rootDir, const std::vector<std::string>& imageIds
     for (const auto& imageId : imageIds)
     {
         auto imagePath = imageDir / (imageId + ".tar.gz");
+        if (!std::filesystem::exists(imagePath))
+            imagePath = getImageManifestPath(rootDir, imageId);
         if (!std::filesystem::exists(imagePath))
         {
             std::cout << "Image with ID " << imageId << " does not exist" << std::endl;
@@ -118,7 +224,10 @@ void remove(const std::string& rootDir, const std::vector<std::string>& imageIds
             else
                 std::cout << "Failed to remove image with ID " << imageId << ": [Errno " << errno << "]" << std::endl;
         }
+        // Drops the layers cached by a failed build of the image as well
+        std::filesystem::remove(getImageManifestPath(rootDir, imageId) + ".partial");
     }
+    removeUnusedLayers(rootDir);
 }
 
 
@@ -139,6 +248,14 @@ int main(int argc, char* argv[])
             ("r,root-dir", "The directory where all Kapsel related files will be stored.",
                     cxxopts::value<std::string>()->default_value("../res"))
             ("b,build", "Build an image of the container after exiting.")
+            ("f,file", "The Kapselfile from which the image is built with the command type 'build'.",
+                    cxxopts::value<std::string>()->default_value("Kapselfile"))
+            ("v,volume", "Mount a volume into the container. Can be specified multiple times. "
+                         "Formats: <host-path>:<container-path>[:<options>], tmpfs:<container-path>[:<options>] "
+                         "and shm:<container-path>[:<options>]. Options: 'ro', 'rw', a propagation mode "
+                         "{'private', 'rprivate', 'shared', 'rshared', 'slave', 'rslave'} and, for tmpfs and shm, "
+                         "mount data (e.g. 'size=64m').",
+                         cxxopts::value<std::vector<std::string>>())
 
             // Resource limits
             ("p,process-number", "The maximum number of processes can be created in the container. "
@@ -151,14 +268,118 @@ int main(int argc, char* argv[])
             ("s,memory-swap", "The maximum amount for the sum of memory and swap usage in the container. "
                               "Use -1 to remove limit.",
                               cxxopts::value<std::string>()->default_value("512m"))
+            ("egress-rate", "The rate limit of the traffic sent by the container in bridge mode with the veth "
+                            "or netkit driver, e.g. '100kbit', '10mbit' or '1gbit'. Use 0 to remove limit.",
+                    cxxopts::value<std::string>()->default_value("0"))
+            ("ingress-rate", "The rate limit of the traffic received by the container in bridge mode with "
+                             "the veth or netkit driver. Use 0 to remove limit.",
+                    cxxopts::value<std::string>()->default_value("0"))
+            ("network-priority", "The skb priority (as set by SO_PRIORITY) of the packets the container sends "
+                                 "through the host, by which priority-aware qdiscs on the host's uplink, such as "
+                                 "pfifo_fast, order them. No qdisc is installed on the uplink. Available options "
+                                 "are {'low', 'normal', 'high'}.",
+                    cxxopts::value<std::string>()->default_value("normal"))
+
+            // Networking
+            ("network", "The network mode of the container. Available options are {'none', 'loopback', 'host', "
+                        "'bridge', 'container:<id>'}. 'none' and 'loopback' isolate the container without and "
+                        "with a loopback interface, 'host' shares the network stack of the host, 'bridge' "
+                        "connects the container to the bridge given to --bridge and 'container:<id>' joins the "
+                        "network stack of the running container <id>.",
+                    cxxopts::value<std::string>()->default_value("bridge"))
+            ("bridge", "The network the container is attached to: a network created with the command type "
+                       "'network', or otherwise a bridge of this name, which is created if it does not exist. "
+                       "For the macvlan and ipvlan drivers, the parent device of the container's interface, "
+                       "which is created as a dummy device if it does not exist.",
+                    cxxopts::value<std::string>()->default_value(BRIDGE_NAME))
+            ("notrack", "Exempt the traffic between the containers in the subnet of the bridge from "
+                        "connection tracking. Stays in effect for the bridge once used.")
+            ("fast-path", "Redirect the packets between the containers on the bridge with a tc BPF program "
+                          "instead of passing them through the bridge. Requires the veth or netkit driver "
+                          "and falls back to the bridge if BPF is not available.")
+            ("dns", "Serve the container a caching DNS forwarder on the gateway address of the bridge, which "
+                    "answers the IDs of the running containers on the bridge and forwards other queries to "
+                    "the server given to --dns-upstream. Requires the veth or netkit driver.")
+            ("dns-upstream", "The DNS server to which the forwarder enabled with --dns forwards queries. "
+                             "Format: <ip>[:<port>].",
+                    cxxopts::value<std::string>()->default_value(DEFAULT_NAMESERVER))
+            ("network-driver", "The interface connecting a bridged container. Available options are {'veth', "
+                               "'netkit', 'macvlan', 'ipvlan-l2', 'ipvlan-l3'}. 'netkit' falls back to 'veth' "
+                               "on kernels older than 6.7.",
+                    cxxopts::value<std::string>()->default_value("veth"))
+            ("subnet", "The subnet in CIDR notation from which the addresses of the bridge and its "
+                       "containers are allocated. A bridge keeps the subnet it was first used with, and a "
+                       "network created with 'network create' the one given there.",
+                    cxxopts::value<std::string>()->default_value(DEFAULT_SUBNET))
+            ("gateway", "The address of the bridge of a network created with 'network create'. Defaults to "
+                        "the first host address in the subnet.",
+                    cxxopts::value<std::string>())
+            ("shard-prefix", "Split a network created with 'network create' into subnets of this prefix "
+                             "length, each on a bridge <name>-<n> of its own, e.g. 22 for up to 1021 "
+                             "containers per bridge. Containers fill the shards in order, and the bridges "
+                             "of the shards after the first are deleted once empty. Use 0 for a single bridge.",
+                    cxxopts::value<int>()->default_value("0"))
+            ("network-pool", "The number of configured network namespaces kept ready for the bridge. "
+                             "A container takes its network from the pool, which is replenished in the "
+                             "background, instead of setting it up at start. Use 0 to disable the pool.",
+                    cxxopts::value<int>()->default_value("0"))
+            ("mtu", "The MTU of the container's interface in bridge mode, e.g. 9000 for jumbo frames. A "
+                    "bridge takes the smallest MTU of its ports. Use 0 for the kernel's default.",
+                    cxxopts::value<uint32_t>()->default_value("0"))
+            ("queues", "The number of TX and RX queues of the container's interface in bridge mode, so that "
+                       "multiple CPUs can send and receive in parallel. Use 0 for the kernel's default.",
+                    cxxopts::value<uint32_t>()->default_value("0"))
+            ("txqueuelen", "The length of the TX queue of the container's interface in bridge mode. Use 0 for "
+                           "the kernel's default.",
+                    cxxopts::value<uint32_t>()->default_value("0"))
+            ("gro", "Enable or disable generic receive offload on the container's interface in bridge mode, "
+                    "and on its host side for the veth and netkit drivers. Available options are {'on', 'off'}.",
+                    cxxopts::value<std::string>())
+            ("gso", "Enable or disable generic segmentation offload on the container's interface in bridge "
+                    "mode, and on its host side for the veth and netkit drivers. Available options are "
+                    "{'on', 'off'}.",
+                    cxxopts::value<std::string>())
+            ("network-async", "Start the command right away with the loopback interface up, while the "
+                              "container is attached to the bridge in the background. The file "
+                              "/run/kapsel/network-ready (holding the container's IP) or "
+                              "/run/kapsel/network-failed appears in the container once done.")
+            ("sysctl", "Set a sysctl of the container's network namespace. Can be specified multiple times. "
+                       "Format: <key>=<value>, where <key> is a sysctl isolated per network namespace "
+                       "(e.g. 'net.core.somaxconn', 'net.ipv4.tcp_rmem' or 'net.ipv4.ip_local_port_range').",
+                    cxxopts::value<std::vector<std::string>>())
+            ("sysctl-profile", "Set the sysctls of a preset for a common workload, which --sysctl overrides. "
+                               "Available options are {'web', 'throughput', 'latency'}.",
+                    cxxopts::value<std::string>())
+            ("listen", "Bind a socket on the host and pass it to the container as file descriptor 3, 4, ... "
+                       "following the LISTEN_FDS convention of sd_listen_fds(3). Can be specified multiple "
+                       "times. Format: [<ip>:]<port>[/<protocol>], where <protocol> is 'tcp' (default) or "
+                       "'udp'.",
+                    cxxopts::value<std::vector<std::string>>())
+            ("on-demand", "Only start the container when the first connection (or datagram) arrives on the "
+                          "sockets given to --listen, which the container then accepts itself.")
+            ("P,publish", "Forward a port of the host to the container in bridge mode. Can be specified "
+                          "multiple times. Format: <host-port>:<container-port>[/<protocol>], where "
+                          "<protocol> is 'tcp' (default) or 'udp'.",
+                    cxxopts::value<std::vector<std::string>>())
 
             // Logging
             ("l,logging", "Enable logging to log file <root-dir>/logs/<container-id>.log.")
 
-            ("cmd-type", "Type of actions to perform. Available options are {'run', 'list', 'delete'}.\n"
+            ("cmd-type", "Type of actions to perform. Available options are {'run', 'list', 'delete', 'diff', 'commit', 'cp', "
+                         "'export', 'import', 'build', 'netstats', 'network'}.\n"
                          "run   : executes the preceding command inside a container.\n"
                          "list  : lists the container images which have been built.\n"
-                         "delete: remove the container images which have the preceding list of IDs.",
+                         "delete: remove the container images which have the preceding list of IDs.\n"
+                         "diff  : lists the files changed in the running container with the preceding ID.\n"
+                         "commit: saves the changes of the running container <container-id> as image <image-id>.\n"
+                         "cp    : copies files between <src> and <dest>, either of which can be <container-id>:<path>.\n"
+                         "export: writes a tarball of the running container or image with the preceding ID to stdout.\n"
+                         "import: creates image <image-id> from a rootfs tarball <archive>, or stdin if omitted.\n"
+                         "build : builds image <image-id> from the Kapselfile given to -f, --file.\n"
+                         "netstats: prints the network counters and TCP stats of the running container with the "
+                         "preceding ID.\n"
+                         "network: 'create <name>' creates a network from --subnet, --gateway and --shard-prefix, "
+                         "'ls' lists the networks and 'rm <name>' removes an unused network with its bridges.",
              cxxopts::value<std::string>())
 
             ("args", "The arguments that will passed to command type <cmd-type>. "
@@ -204,6 +425,128 @@ int main(int argc, char* argv[])
         resourceLimits->cpuShare = parsedOptions["cpu-share"].as<int>();
         resourceLimits->memory = parsedOptions["memory"].as<std::string>();
         resourceLimits->swapMemory = parsedOptions["memory-swap"].as<std::string>();
+        resourceLimits->egressRate = parseRate(parsedOptions["egress-rate"].as<std::string>());
+        resourceLimits->ingressRate = parseRate(parsedOptions["ingress-rate"].as<std::string>());
+        std::string networkPriorityString = parsedOptions["network-priority"].as<std::string>();
+        if (!stringToNetworkPriority.count(networkPriorityString))
+            throw std::invalid_argument("[ERROR] Network priority " + networkPriorityString + " is not an option!");
+        resourceLimits->networkPriority = stringToNetworkPriority[networkPriorityString];
+
+        // Volumes
+        std::vector<Volume> volumes;
+        if (parsedOptions.count("volume"))
+        {
+            for (const auto& spec : parsedOptions["volume"].as<std::vector<std::string>>())
+                volumes.push_back(parseVolume(spec));
+        }
+
+        // Networking
+        std::string networkModeString = parsedOptions["network"].as<std::string>();
+        NetworkMode networkMode = NetworkContainer;
+        std::string networkOwner;
+        if (networkModeString.rfind("container:", 0) == 0 && networkModeString.size() > 10)
+            networkOwner = networkModeString.substr(10);
+        else if (stringToNetworkMode.count(networkModeString))
+            networkMode = stringToNetworkMode[networkModeString];
+        else
+            throw std::invalid_argument("[ERROR] Network mode " + networkModeString + " is not an option!");
+        std::string bridge = parsedOptions["bridge"].as<std::string>();
+        Network network;
+        if (networkExists(rootDir, bridge))
+        {
+            network = loadNetwork(rootDir, bridge);
+            if (commandType == Run && parsedOptions.count("subnet"))
+                throw std::invalid_argument("[ERROR] Network " + bridge + " uses subnet " + getSubnetString(network) +
+                                            ", which --subnet cannot change");
+        }
+        else
+            network = parseNetwork(bridge, parsedOptions["subnet"].as<std::string>());
+        std::string networkDriverString = parsedOptions["network-driver"].as<std::string>();
+        if (!stringToNetworkDriver.count(networkDriverString))
+            throw std::invalid_argument("[ERROR] Network driver " + networkDriverString + " is not an option!");
+        network.driver = stringToNetworkDriver[networkDriverString];
+        network.notrack = parsedOptions["notrack"].as<bool>();
+        network.fastPath = parsedOptions["fast-path"].as<bool>();
+        if (network.fastPath && network.driver != VethDriver && network.driver != NetkitDriver)
+            throw std::invalid_argument("[ERROR] The fast path requires the veth or netkit driver");
+        if (network.shardPrefixLength > 0 && network.driver != VethDriver && network.driver != NetkitDriver)
+            throw std::invalid_argument("[ERROR] The sharded network " + network.name +
+                                        " requires the veth or netkit driver");
+        // A pool is kept per bridge, whereas the shard is only selected at launch
+        if (network.shardPrefixLength > 0 && parsedOptions["network-pool"].as<int>() > 0)
+            throw std::invalid_argument("[ERROR] --network-pool cannot be used with the sharded network " +
+                                        network.name);
+        if (parsedOptions["dns"].as<bool>())
+        {
+            if (network.driver != VethDriver && network.driver != NetkitDriver)
+                throw std::invalid_argument("[ERROR] The DNS forwarder requires the veth or netkit driver");
+            network.dnsUpstream = parsedOptions["dns-upstream"].as<std::string>();
+            parseDnsServer(network.dnsUpstream);
+        }
+        network.mtu = parsedOptions["mtu"].as<uint32_t>();
+        if (network.mtu > 0 && (network.mtu < 68 || network.mtu > 65535))
+            throw std::invalid_argument("[ERROR] The MTU has to be between 68 and 65535");
+        network.queues = parsedOptions["queues"].as<uint32_t>();
+        if (network.queues > 256)
+            throw std::invalid_argument("[ERROR] The number of queues has to be between 1 and 256");
+        network.txQueueLength = parsedOptions["txqueuelen"].as<uint32_t>();
+        if (parsedOptions.count("gro"))
+        {
+            std::string groString = parsedOptions["gro"].as<std::string>();
+            if (!stringToLinkFeature.count(groString))
+                throw std::invalid_argument("[ERROR] GRO setting " + groString + " is not an option!");
+            network.gro = stringToLinkFeature[groString];
+        }
+        if (parsedOptions.count("gso"))
+        {
+            std::string gsoString = parsedOptions["gso"].as<std::string>();
+            if (!stringToLinkFeature.count(gsoString))
+                throw std::invalid_argument("[ERROR] GSO setting " + gsoString + " is not an option!");
+            network.gso = stringToLinkFeature[gsoString];
+        }
+        if ((resourceLimits->ingressRate > 0 || resourceLimits->egressRate > 0) && network.driver != VethDriver &&
+            network.driver != NetkitDriver)
+            throw std::invalid_argument("[ERROR] Rate limits require the veth or netkit driver");
+        std::vector<PortMapping> publishedPorts;
+        if (parsedOptions.count("publish"))
+        {
+            for (const auto& spec : parsedOptions["publish"].as<std::vector<std::string>>())
+                publishedPorts.push_back(parsePortMapping(spec));
+        }
+
+        std::vector<ListenSocket> listenSockets;
+        if (parsedOptions.count("listen"))
+        {
+            for (const auto& spec : parsedOptions["listen"].as<std::vector<std::string>>())
+                listenSockets.push_back(parseListenSocket(spec));
+        }
+        if (parsedOptions["on-demand"].as<bool>() && listenSockets.empty())
+            throw std::invalid_argument("[ERROR] --on-demand requires at least one socket given to --listen");
+
+        std::map<std::string, std::string> sysctls;
+        std::vector<std::string> sysctlSpecs;
+        if (parsedOptions.count("sysctl-profile"))
+        {
+            std::string profile = parsedOptions["sysctl-profile"].as<std::string>();
+            if (!stringToSysctlProfile.count(profile))
+                throw std::invalid_argument("[ERROR] Sysctl profile " + profile + " is not an option!");
+            sysctlSpecs = stringToSysctlProfile[profile];
+        }
+        if (parsedOptions.count("sysctl"))
+        {
+            for (const auto& spec : parsedOptions["sysctl"].as<std::vector<std::string>>())
+                sysctlSpecs.push_back(spec);
+        }
+        for (const auto& spec : sysctlSpecs)
+        {
+            auto sysctl = parseSysctl(spec);
+            sysctls[sysctl.first] = sysctl.second;
+        }
+        // A container without a network namespace of its own would change another one
+        if (parsedOptions["network-async"].as<bool>() && networkMode != NetworkBridge)
+            throw std::invalid_argument("[ERROR] --network-async requires the bridge network mode");
+        if (!sysctls.empty() && (networkMode == NetworkHost || networkMode == NetworkContainer))
+            throw std::invalid_argument("[ERROR] Sysctls require a network namespace of the container's own");
 
         // Enables logging
         loguru::g_stderr_verbosity = loguru::Verbosity_ERROR;
@@ -222,7 +565,10 @@ int main(int argc, char* argv[])
                 std::copy(args.begin(), args.end(), std::ostream_iterator<std::string>(command, " "));
                 if (command.str().empty())
                     throw std::runtime_error("Command to run cannot be empty!");
-                run(rootDir, containerId, distroName, command.str(), resourceLimits,
+                run(rootDir, containerId, distroName, command.str(), resourceLimits, volumes,
+                    networkMode, networkOwner, network,
+                    parsedOptions["network-pool"].as<int>(), parsedOptions["network-async"].as<bool>(),
+                    publishedPorts, sysctls, listenSockets, parsedOptions["on-demand"].as<bool>(),
                     parsedOptions["build"].as<bool>());
                 break;
             }
@@ -234,6 +580,64 @@ int main(int argc, char* argv[])
                 remove(rootDir, args);
                 break;
 
+            case Diff:
+                if (args.size() != 1 || args[0].empty())
+                    throw std::invalid_argument("[ERROR] Usage: diff <container-id>");
+                diffContainer(rootDir, args[0]);
+                break;
+
+            case Commit:
+                if (args.size() != 2)
+                    throw std::invalid_argument("[ERROR] Usage: commit <container-id> <image-id>");
+                commitContainer(rootDir, args[0], args[1]);
+                break;
+
+            case Copy:
+                if (args.size() != 2)
+                    throw std::invalid_argument("[ERROR] Usage: cp <src> <dest>");
+                copyFiles(rootDir, args[0], args[1]);
+                break;
+
+            case Export:
+                if (args.size() != 1 || args[0].empty())
+                    throw std::invalid_argument("[ERROR] Usage: export <id>");
+                exportRootfs(rootDir, args[0]);
+                break;
+
+            case Import:
+                if (args.empty() || args.size() > 2 || args[0].empty())
+                    throw std::invalid_argument("[ERROR] Usage: import <image-id> [archive]");
+                importImage(rootDir, args[0], args.size() == 2 ? args[1] : "-");
+                break;
+
+            case Build:
+                if (args.size() != 1 || args[0].empty())
+                    throw std::invalid_argument("[ERROR] Usage: build <image-id>");
+                buildImageFromFile(rootDir, args[0], parsedOptions["file"].as<std::string>(), *resourceLimits);
+                delete resourceLimits;
+                break;
+
+            case NetStats:
+                if (args.size() != 1 || args[0].empty())
+                    throw std::invalid_argument("[ERROR] Usage: netstats <container-id>");
+                printNetworkStats(rootDir, args[0]);
+                break;
+
+            case NetworkCommand:
+                if (args.size() == 1 && (args[0] == "ls" || args[0] == "list"))
+                    printNetworks(rootDir);
+                else if (args.size() == 2 && args[0] == "create" && parsedOptions.count("subnet"))
+                    createNetwork(rootDir, args[1], parsedOptions["subnet"].as<std::string>(),
+                                  parsedOptions.count("gateway") ? parsedOptions["gateway"].as<std::string>() : "",
+                                  parsedOptions["shard-prefix"].as<int>());
+                else if (args.size() == 2 && (args[0] == "rm" || args[0] == "remove"))
+                    removeNetwork(rootDir, args[1]);
+                else
+                    throw std::invalid_argument("[ERROR] Usage: network create <name> --subnet <subnet> "
+                                                "[--gateway <ip>] [--shard-prefix <length>] | network ls | "
+                                                "network rm <name>");
+                break;
+
             default:
                 throw std::invalid_argument("[ERROR] Command " + commandTypeString + " not supported!");
         }
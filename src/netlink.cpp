@@ -0,0 +1,686 @@
+#include <string>
+#include <map>
+#include <atomic>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_link.h>
+#include <linux/veth.h>
+#include <linux/pkt_sched.h>
+#include <linux/pkt_cls.h>
+#include <linux/tc_act/tc_mirred.h>
+#include <linux/if_ether.h>
+#include <linux/ethtool.h>
+#include <linux/sockios.h>
+
+#include "netlink.h"
+
+// The netkit attributes are missing from the kernel headers before Linux 6.7
+#ifndef IFLA_NETKIT_MAX
+#define IFLA_NETKIT_PEER_INFO 1
+#define IFLA_NETKIT_MODE 5
+#define NETKIT_L2 0
+#endif
+
+/**
+ * Appends data to the request, pads it to a multiple of 4 bytes as required by
+ * netlink and updates the length of the message which is being built.
+ */
+void appendData(NetlinkRequest& request, const void* data, size_t size)
+{
+    auto* bytes = (const char*) data;
+    request.buffer.insert(request.buffer.end(), bytes, bytes + size);
+    request.buffer.resize(NLMSG_ALIGN(request.buffer.size()), 0);
+    auto* header = (nlmsghdr*) (request.buffer.data() + request.messageOffset);
+    header->nlmsg_len = request.buffer.size() - request.messageOffset;
+}
+
+/**
+ * Starts a new message in the request. The message is acknowledged by the kernel,
+ * so that sendNetlinkRequest() can report the errors of each message in a batch.
+ *
+ * @param type the message type, e.g. RTM_NEWLINK.
+ * @param flags flags in addition to NLM_F_REQUEST and NLM_F_ACK, e.g. NLM_F_CREATE.
+ * @param header the family specific header, e.g. struct ifinfomsg.
+ */
+void beginNetlinkMessage(NetlinkRequest& request, uint16_t type, uint16_t flags,
+                         const void* header, size_t headerSize)
+{
+    request.messageOffset = request.buffer.size();
+    request.nestedOffsets.clear();
+
+    nlmsghdr messageHeader{};
+    messageHeader.nlmsg_type = type;
+    messageHeader.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+    appendData(request, &messageHeader, sizeof(messageHeader));
+    appendData(request, header, headerSize);
+}
+
+/**
+ * Adds an attribute to the message which is being built.
+ */
+void addAttribute(NetlinkRequest& request, uint16_t type, const void* data, size_t size)
+{
+    rtattr attribute{};
+    attribute.rta_type = type;
+    attribute.rta_len = RTA_LENGTH(size);
+    appendData(request, &attribute, sizeof(attribute));
+    appendData(request, data, size);
+}
+
+void addStringAttribute(NetlinkRequest& request, uint16_t type, const std::string& value)
+{
+    addAttribute(request, type, value.c_str(), value.size() + 1);
+}
+
+void addU32Attribute(NetlinkRequest& request, uint16_t type, uint32_t value)
+{
+    addAttribute(request, type, &value, sizeof(value));
+}
+
+/**
+ * Opens a nested attribute. All the attributes added until the matching call
+ * to endNestedAttribute() are contained in it.
+ */
+void beginNestedAttribute(NetlinkRequest& request, uint16_t type)
+{
+    request.nestedOffsets.push_back(request.buffer.size());
+    rtattr attribute{};
+    attribute.rta_type = type;
+    appendData(request, &attribute, sizeof(attribute));
+}
+
+void endNestedAttribute(NetlinkRequest& request)
+{
+    size_t offset = request.nestedOffsets.back();
+    request.nestedOffsets.pop_back();
+    auto* attribute = (rtattr*) (request.buffer.data() + offset);
+    attribute->rta_len = request.buffer.size() - offset;
+}
+
+/**
+ * Opens a netlink socket of the given protocol (e.g. NETLINK_ROUTE) in the network
+ * namespace of the calling thread.
+ *
+ * @throw runtime_error if the socket cannot be created.
+ * @return the file descriptor of the socket.
+ */
+int openNetlinkSocket(int protocol)
+{
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, protocol);
+    if (fd < 0)
+        throw std::runtime_error("Open netlink socket: FAILED [Errno " + std::to_string(errno) + "]");
+
+    sockaddr_nl address{};
+    address.nl_family = AF_NETLINK;
+    // Acknowledgements do not have to include the original message
+    int enable = 1;
+    setsockopt(fd, SOL_NETLINK, NETLINK_CAP_ACK, &enable, sizeof(enable));
+    if (bind(fd, (sockaddr*) &address, sizeof(address)) != 0)
+    {
+        close(fd);
+        throw std::runtime_error("Bind netlink socket: FAILED [Errno " + std::to_string(errno) + "]");
+    }
+    return fd;
+}
+
+/**
+ * Opens a netlink socket in the network namespace referred to by 'namespaceFd'.
+ * A socket stays in the namespace in which it was created, hence the calling thread
+ * only has to enter the namespace while the socket is being created. This allows
+ * the namespace to be configured without spawning 'ip netns exec'.
+ */
+int openNetlinkSocketInNamespace(int namespaceFd, int protocol)
+{
+    int currentNamespaceFd = open("/proc/thread-self/ns/net", O_RDONLY | O_CLOEXEC);
+    if (currentNamespaceFd < 0)
+        throw std::runtime_error("Open current network namespace: FAILED [Errno " + std::to_string(errno) + "]");
+
+    if (setns(namespaceFd, CLONE_NEWNET) != 0)
+    {
+        close(currentNamespaceFd);
+        throw std::runtime_error("Enter network namespace: FAILED [Errno " + std::to_string(errno) + "]");
+    }
+
+    int fd = -1;
+    std::string error;
+    try
+    {
+        fd = openNetlinkSocket(protocol);
+    }
+    catch (std::exception& ex)
+    {
+        error = ex.what();
+    }
+
+    if (setns(currentNamespaceFd, CLONE_NEWNET) != 0)
+        error = "Restore network namespace: FAILED [Errno " + std::to_string(errno) + "]";
+    close(currentNamespaceFd);
+    if (!error.empty())
+    {
+        if (fd >= 0)
+            close(fd);
+        throw std::runtime_error(error);
+    }
+    return fd;
+}
+
+/**
+ * Assigns sequence numbers to the messages in the request.
+ * @return the sequence numbers of the messages which expect an acknowledgement,
+ * mapped to their message types.
+ */
+std::map<uint32_t, uint16_t> assignSequenceNumbers(NetlinkRequest& request)
+{
+    static std::atomic<uint32_t> sequence(time(nullptr));
+    std::map<uint32_t, uint16_t> pending;
+    for (size_t offset = 0; offset < request.buffer.size(); )
+    {
+        auto* header = (nlmsghdr*) (request.buffer.data() + offset);
+        header->nlmsg_seq = ++sequence;
+        if (header->nlmsg_flags & NLM_F_ACK)
+            pending[header->nlmsg_seq] = header->nlmsg_type;
+        offset += NLMSG_ALIGN(header->nlmsg_len);
+    }
+    return pending;
+}
+
+/**
+ * Sends all the messages in the request to the kernel with a single system call and
+ * waits for their acknowledgements. The kernel processes every message in the batch
+ * even if one of them fails.
+ *
+ * @param ignoredErrors errno values which are not treated as failures (e.g. EEXIST).
+ * @throw runtime_error if any of the messages fails.
+ */
+void sendNetlinkRequest(int fd, NetlinkRequest& request, const std::vector<int>& ignoredErrors)
+{
+    auto pending = assignSequenceNumbers(request);
+    if (send(fd, request.buffer.data(), request.buffer.size(), 0) < 0)
+        throw std::runtime_error("Send netlink request: FAILED [Errno " + std::to_string(errno) + "]");
+
+    int error = 0;
+    uint16_t failedType = 0;
+    std::vector<char> buffer(32768);
+    while (!pending.empty())
+    {
+        ssize_t length = recv(fd, buffer.data(), buffer.size(), 0);
+        if (length < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error("Receive netlink response: FAILED [Errno " + std::to_string(errno) + "]");
+        }
+
+        int remaining = (int) length;
+        for (auto* header = (nlmsghdr*) buffer.data(); NLMSG_OK(header, remaining); header = NLMSG_NEXT(header, remaining))
+        {
+            if (header->nlmsg_type != NLMSG_ERROR || !pending.count(header->nlmsg_seq))
+                continue;
+            auto* ack = (nlmsgerr*) NLMSG_DATA(header);
+            if (ack->error != 0 && error == 0 &&
+                std::find(ignoredErrors.cbegin(), ignoredErrors.cend(), -ack->error) == ignoredErrors.cend())
+            {
+                error = -ack->error;
+                failedType = pending[header->nlmsg_seq];
+            }
+            pending.erase(header->nlmsg_seq);
+        }
+    }
+
+    if (error != 0)
+        throw std::runtime_error("Netlink request of type " + std::to_string(failedType) +
+                                 ": FAILED [Errno " + std::to_string(error) + "]");
+}
+
+/**
+ * Sends a request which expects a response (e.g. RTM_GETLINK) and collects the
+ * messages of the response. Dump requests are read until NLMSG_DONE.
+ *
+ * @throw runtime_error if the request fails.
+ * @return the payload-carrying messages, each including its netlink header.
+ */
+std::vector<std::vector<char>> queryNetlink(int fd, NetlinkRequest& request)
+{
+    assignSequenceNumbers(request);
+    if (send(fd, request.buffer.data(), request.buffer.size(), 0) < 0)
+        throw std::runtime_error("Send netlink request: FAILED [Errno " + std::to_string(errno) + "]");
+
+    std::vector<std::vector<char>> messages;
+    std::vector<char> buffer(65536);
+    while (true)
+    {
+        ssize_t length = recv(fd, buffer.data(), buffer.size(), 0);
+        if (length < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error("Receive netlink response: FAILED [Errno " + std::to_string(errno) + "]");
+        }
+
+        int remaining = (int) length;
+        for (auto* header = (nlmsghdr*) buffer.data(); NLMSG_OK(header, remaining); header = NLMSG_NEXT(header, remaining))
+        {
+            if (header->nlmsg_type == NLMSG_DONE)
+                return messages;
+            if (header->nlmsg_type == NLMSG_ERROR)
+            {
+                int error = -((nlmsgerr*) NLMSG_DATA(header))->error;
+                if (error != 0)
+                    throw std::runtime_error("Netlink query: FAILED [Errno " + std::to_string(error) + "]");
+                return messages;
+            }
+            messages.emplace_back((char*) header, (char*) header + header->nlmsg_len);
+            if (!(header->nlmsg_flags & NLM_F_MULTI))
+                return messages;
+        }
+    }
+}
+
+/**
+ * Adds a message which creates a network bridge with the given name.
+ */
+void addBridge(NetlinkRequest& request, const std::string& name)
+{
+    ifinfomsg header{};
+    beginNetlinkMessage(request, RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL, &header, sizeof(header));
+    addStringAttribute(request, IFLA_IFNAME, name);
+    beginNestedAttribute(request, IFLA_LINKINFO);
+    addStringAttribute(request, IFLA_INFO_KIND, "bridge");
+    endNestedAttribute(request);
+}
+
+/**
+ * Adds the given attributes of a new link to the message which is being built,
+ * or to the description of the peer of a pair.
+ */
+void addLinkAttributes(NetlinkRequest& request, const LinkAttributes& attributes)
+{
+    if (attributes.mtu > 0)
+        addU32Attribute(request, IFLA_MTU, attributes.mtu);
+    if (attributes.txQueueLength > 0)
+        addU32Attribute(request, IFLA_TXQLEN, attributes.txQueueLength);
+    if (attributes.queues > 0)
+    {
+        addU32Attribute(request, IFLA_NUM_TX_QUEUES, attributes.queues);
+        addU32Attribute(request, IFLA_NUM_RX_QUEUES, attributes.queues);
+    }
+}
+
+/**
+ * Adds a message which creates a veth pair. The peer is created directly in the
+ * network namespace referred to by 'peerNamespaceFd', so that it does not have to
+ * be moved there afterwards. Both ends get the given attributes, since the queues
+ * can only be chosen at creation.
+ */
+void addVethPair(NetlinkRequest& request, const std::string& name, const std::string& peerName, int peerNamespaceFd,
+                 const LinkAttributes& attributes)
+{
+    ifinfomsg header{};
+    beginNetlinkMessage(request, RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL, &header, sizeof(header));
+    addStringAttribute(request, IFLA_IFNAME, name);
+    addLinkAttributes(request, attributes);
+    beginNestedAttribute(request, IFLA_LINKINFO);
+    addStringAttribute(request, IFLA_INFO_KIND, "veth");
+    beginNestedAttribute(request, IFLA_INFO_DATA);
+    // The peer is described by a struct ifinfomsg followed by its own attributes
+    beginNestedAttribute(request, VETH_INFO_PEER);
+    ifinfomsg peerHeader{};
+    appendData(request, &peerHeader, sizeof(peerHeader));
+    addStringAttribute(request, IFLA_IFNAME, peerName);
+    addU32Attribute(request, IFLA_NET_NS_FD, peerNamespaceFd);
+    addLinkAttributes(request, attributes);
+    endNestedAttribute(request);
+    endNestedAttribute(request);
+    endNestedAttribute(request);
+}
+
+/**
+ * Adds a message which creates a dummy device with the given name, which serves as
+ * the parent device of macvlan and ipvlan interfaces.
+ */
+void addDummy(NetlinkRequest& request, const std::string& name)
+{
+    ifinfomsg header{};
+    beginNetlinkMessage(request, RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL, &header, sizeof(header));
+    addStringAttribute(request, IFLA_IFNAME, name);
+    beginNestedAttribute(request, IFLA_LINKINFO);
+    addStringAttribute(request, IFLA_INFO_KIND, "dummy");
+    endNestedAttribute(request);
+}
+
+/**
+ * Adds a message which creates an intermediate functional block device with the given
+ * name. Packets redirected to it pass its qdiscs and then continue where they came from,
+ * which allows shaping the ingress of another link.
+ */
+void addIfb(NetlinkRequest& request, const std::string& name)
+{
+    ifinfomsg header{};
+    beginNetlinkMessage(request, RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL, &header, sizeof(header));
+    addStringAttribute(request, IFLA_IFNAME, name);
+    beginNestedAttribute(request, IFLA_LINKINFO);
+    addStringAttribute(request, IFLA_INFO_KIND, "ifb");
+    endNestedAttribute(request);
+}
+
+/**
+ * Adds a netkit pair in L2 mode, which is used like a veth pair but whose peer
+ * forwards packets to the host's stack without going through a backlog queue.
+ * Requires Linux 6.7 or later.
+ */
+void addNetkitPair(NetlinkRequest& request, const std::string& name, const std::string& peerName, int peerNamespaceFd,
+                   const LinkAttributes& attributes)
+{
+    ifinfomsg header{};
+    beginNetlinkMessage(request, RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL, &header, sizeof(header));
+    addStringAttribute(request, IFLA_IFNAME, name);
+    addLinkAttributes(request, attributes);
+    beginNestedAttribute(request, IFLA_LINKINFO);
+    addStringAttribute(request, IFLA_INFO_KIND, "netkit");
+    beginNestedAttribute(request, IFLA_INFO_DATA);
+    addU32Attribute(request, IFLA_NETKIT_MODE, NETKIT_L2);
+    beginNestedAttribute(request, IFLA_NETKIT_PEER_INFO);
+    ifinfomsg peerHeader{};
+    appendData(request, &peerHeader, sizeof(peerHeader));
+    addStringAttribute(request, IFLA_IFNAME, peerName);
+    addU32Attribute(request, IFLA_NET_NS_FD, peerNamespaceFd);
+    addLinkAttributes(request, attributes);
+    endNestedAttribute(request);
+    endNestedAttribute(request);
+    endNestedAttribute(request);
+}
+
+/**
+ * Adds a macvlan interface in bridge mode on top of the parent link, created
+ * directly in the network namespace referred to by 'namespaceFd'.
+ */
+void addMacvlan(NetlinkRequest& request, const std::string& name, int parentIndex, int namespaceFd,
+                const LinkAttributes& attributes)
+{
+    ifinfomsg header{};
+    beginNetlinkMessage(request, RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL, &header, sizeof(header));
+    addStringAttribute(request, IFLA_IFNAME, name);
+    addU32Attribute(request, IFLA_LINK, parentIndex);
+    addU32Attribute(request, IFLA_NET_NS_FD, namespaceFd);
+    addLinkAttributes(request, attributes);
+    beginNestedAttribute(request, IFLA_LINKINFO);
+    addStringAttribute(request, IFLA_INFO_KIND, "macvlan");
+    beginNestedAttribute(request, IFLA_INFO_DATA);
+    addU32Attribute(request, IFLA_MACVLAN_MODE, MACVLAN_MODE_BRIDGE);
+    endNestedAttribute(request);
+    endNestedAttribute(request);
+}
+
+/**
+ * Adds an ipvlan interface in the given mode (IPVLAN_MODE_L2 or IPVLAN_MODE_L3) on
+ * top of the parent link, created directly in the network namespace referred to by
+ * 'namespaceFd'.
+ */
+void addIpvlan(NetlinkRequest& request, const std::string& name, int parentIndex, uint16_t mode, int namespaceFd,
+               const LinkAttributes& attributes)
+{
+    ifinfomsg header{};
+    beginNetlinkMessage(request, RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL, &header, sizeof(header));
+    addStringAttribute(request, IFLA_IFNAME, name);
+    addU32Attribute(request, IFLA_LINK, parentIndex);
+    addU32Attribute(request, IFLA_NET_NS_FD, namespaceFd);
+    addLinkAttributes(request, attributes);
+    beginNestedAttribute(request, IFLA_LINKINFO);
+    addStringAttribute(request, IFLA_INFO_KIND, "ipvlan");
+    beginNestedAttribute(request, IFLA_INFO_DATA);
+    addAttribute(request, IFLA_IPVLAN_MODE, &mode, sizeof(mode));
+    endNestedAttribute(request);
+    endNestedAttribute(request);
+}
+
+/**
+ * Adds a message which attaches the link with the given name to a bridge.
+ */
+void setLinkMaster(NetlinkRequest& request, const std::string& name, int masterIndex)
+{
+    ifinfomsg header{};
+    beginNetlinkMessage(request, RTM_NEWLINK, 0, &header, sizeof(header));
+    addStringAttribute(request, IFLA_IFNAME, name);
+    addU32Attribute(request, IFLA_MASTER, masterIndex);
+}
+
+/**
+ * Adds a message which sets the state of the link with the given name to 'up'.
+ */
+void setLinkUp(NetlinkRequest& request, const std::string& name)
+{
+    ifinfomsg header{};
+    header.ifi_flags = IFF_UP;
+    header.ifi_change = IFF_UP;
+    beginNetlinkMessage(request, RTM_NEWLINK, 0, &header, sizeof(header));
+    addStringAttribute(request, IFLA_IFNAME, name);
+}
+
+/**
+ * Adds a message which deletes the link with the given name. Deleting one end of
+ * a veth pair deletes the other end as well.
+ */
+void deleteLink(NetlinkRequest& request, const std::string& name)
+{
+    ifinfomsg header{};
+    beginNetlinkMessage(request, RTM_DELLINK, 0, &header, sizeof(header));
+    addStringAttribute(request, IFLA_IFNAME, name);
+}
+
+/**
+ * Adds a message which assigns an IPv4 address and its broadcast address to a link.
+ */
+void addAddress(NetlinkRequest& request, int linkIndex, const std::string& ip, int prefixLength)
+{
+    in_addr address{};
+    if (inet_pton(AF_INET, ip.c_str(), &address) != 1)
+        throw std::runtime_error("Invalid IPv4 address " + ip);
+    in_addr broadcast{};
+    uint32_t mask = prefixLength == 0 ? 0 : htonl(~((1u << (32 - prefixLength)) - 1));
+    broadcast.s_addr = address.s_addr | ~mask;
+
+    ifaddrmsg header{};
+    header.ifa_family = AF_INET;
+    header.ifa_prefixlen = prefixLength;
+    header.ifa_scope = RT_SCOPE_UNIVERSE;
+    header.ifa_index = linkIndex;
+    beginNetlinkMessage(request, RTM_NEWADDR, NLM_F_CREATE | NLM_F_REPLACE, &header, sizeof(header));
+    addAttribute(request, IFA_LOCAL, &address, sizeof(address));
+    addAttribute(request, IFA_ADDRESS, &address, sizeof(address));
+    addAttribute(request, IFA_BROADCAST, &broadcast, sizeof(broadcast));
+}
+
+/**
+ * Adds a message which sets the default IPv4 route to the given gateway.
+ */
+void addDefaultRoute(NetlinkRequest& request, const std::string& gateway)
+{
+    in_addr address{};
+    if (inet_pton(AF_INET, gateway.c_str(), &address) != 1)
+        throw std::runtime_error("Invalid IPv4 address " + gateway);
+
+    rtmsg header{};
+    header.rtm_family = AF_INET;
+    header.rtm_table = RT_TABLE_MAIN;
+    header.rtm_protocol = RTPROT_BOOT;
+    header.rtm_scope = RT_SCOPE_UNIVERSE;
+    header.rtm_type = RTN_UNICAST;
+    beginNetlinkMessage(request, RTM_NEWROUTE, NLM_F_CREATE | NLM_F_REPLACE, &header, sizeof(header));
+    addAttribute(request, RTA_GATEWAY, &address, sizeof(address));
+}
+
+/**
+ * Looks up the index of the link with the given name in the network namespace
+ * of the given netlink socket.
+ *
+ * @throw runtime_error if the link does not exist.
+ */
+int getLinkIndex(int fd, const std::string& name)
+{
+    NetlinkRequest request;
+    ifinfomsg header{};
+    beginNetlinkMessage(request, RTM_GETLINK, 0, &header, sizeof(header));
+    addStringAttribute(request, IFLA_IFNAME, name);
+    auto messages = queryNetlink(fd, request);
+    if (messages.empty())
+        throw std::runtime_error("Find link " + name + ": FAILED");
+    return ((ifinfomsg*) NLMSG_DATA((nlmsghdr*) messages.front().data()))->ifi_index;
+}
+
+/**
+ * Enables or disables an offload feature of a link with a legacy ethtool command
+ * (e.g. ETHTOOL_SGRO or ETHTOOL_SGSO). The ioctl is served by the network namespace
+ * of the socket 'fd', which may be any socket, such as a netlink socket opened with
+ * openNetlinkSocketInNamespace().
+ */
+void setLinkFeature(int fd, const std::string& name, uint32_t command, bool enabled)
+{
+    ethtool_value value{};
+    value.cmd = command;
+    value.data = enabled ? 1 : 0;
+    ifreq request{};
+    strncpy(request.ifr_name, name.c_str(), IFNAMSIZ - 1);
+    request.ifr_data = (char*) &value;
+    if (ioctl(fd, SIOCETHTOOL, &request) != 0)
+        throw std::runtime_error("Set feature " + std::to_string(command) + " of " + name + ": FAILED [Errno " +
+                                 std::to_string(errno) + "]");
+}
+
+/**
+ * Adds a message which creates a queueing discipline without options on a link,
+ * e.g. fq_codel as the leaf of a class.
+ *
+ * @param handle the handle of the new qdisc, e.g. TC_H_MAKE(0x10 << 16, 0) for 10:.
+ * @param parent the handle of the parent class, or TC_H_ROOT.
+ */
+void addQdisc(NetlinkRequest& request, int linkIndex, const std::string& kind, uint32_t handle, uint32_t parent)
+{
+    tcmsg header{};
+    header.tcm_family = AF_UNSPEC;
+    header.tcm_ifindex = linkIndex;
+    header.tcm_handle = handle;
+    header.tcm_parent = parent;
+    beginNetlinkMessage(request, RTM_NEWQDISC, NLM_F_CREATE | NLM_F_EXCL, &header, sizeof(header));
+    addStringAttribute(request, TCA_KIND, kind);
+}
+
+/**
+ * Adds a message which creates an HTB qdisc as the root qdisc of a link, where
+ * unclassified packets are sent to the class with the minor number 'defaultClass'.
+ */
+void addHtbQdisc(NetlinkRequest& request, int linkIndex, uint32_t handle, uint32_t defaultClass)
+{
+    addQdisc(request, linkIndex, "htb", handle, TC_H_ROOT);
+    tc_htb_glob options{};
+    options.version = 3;
+    options.rate2quantum = 10;
+    options.defcls = defaultClass;
+    beginNestedAttribute(request, TCA_OPTIONS);
+    addAttribute(request, TCA_HTB_INIT, &options, sizeof(options));
+    endNestedAttribute(request);
+}
+
+/**
+ * Adds a message which creates an HTB class limited to 'rate' bytes per second.
+ * The bucket holds the bytes sent at that rate in one millisecond plus a full
+ * sized packet, as the tc command does by default.
+ */
+void addHtbClass(NetlinkRequest& request, int linkIndex, uint32_t classId, uint32_t parent, uint64_t rate)
+{
+    tcmsg header{};
+    header.tcm_family = AF_UNSPEC;
+    header.tcm_ifindex = linkIndex;
+    header.tcm_handle = classId;
+    header.tcm_parent = parent;
+    beginNetlinkMessage(request, RTM_NEWTCLASS, NLM_F_CREATE | NLM_F_EXCL, &header, sizeof(header));
+    addStringAttribute(request, TCA_KIND, "htb");
+
+    tc_htb_opt options{};
+    options.rate.rate = (uint32_t) std::min<uint64_t>(rate, ~0u);
+    options.rate.linklayer = TC_LINKLAYER_ETHERNET;
+    options.ceil = options.rate;
+    // The bucket size is given as the time to send it in scheduler ticks of 64 ns
+    uint64_t burst = rate / 1000 + 1600;
+    options.buffer = (uint32_t) std::min<uint64_t>(burst * 1000000000ull / rate / 64, ~0u);
+    options.cbuffer = options.buffer;
+    beginNestedAttribute(request, TCA_OPTIONS);
+    addAttribute(request, TCA_HTB_PARMS, &options, sizeof(options));
+    // Rates which do not fit into 32 bits are passed separately
+    if (rate > ~0u)
+    {
+        addAttribute(request, TCA_HTB_RATE64, &rate, sizeof(rate));
+        addAttribute(request, TCA_HTB_CEIL64, &rate, sizeof(rate));
+    }
+    endNestedAttribute(request);
+}
+
+/**
+ * Adds a message which attaches a BPF program in direct-action mode to the ingress
+ * of a link, where the program's return value decides the fate of each packet.
+ * The link needs a clsact qdisc, see addQdisc().
+ */
+void addIngressBpfFilter(NetlinkRequest& request, int linkIndex, int programFd, const std::string& name)
+{
+    tcmsg header{};
+    header.tcm_family = AF_UNSPEC;
+    header.tcm_ifindex = linkIndex;
+    header.tcm_parent = TC_H_MAKE(TC_H_CLSACT, TC_H_MIN_INGRESS);
+    // Priority 1, all protocols
+    header.tcm_info = TC_H_MAKE(1 << 16, htons(ETH_P_ALL));
+    beginNetlinkMessage(request, RTM_NEWTFILTER, NLM_F_CREATE | NLM_F_EXCL, &header, sizeof(header));
+    addStringAttribute(request, TCA_KIND, "bpf");
+    beginNestedAttribute(request, TCA_OPTIONS);
+    addU32Attribute(request, TCA_BPF_FD, programFd);
+    addStringAttribute(request, TCA_BPF_NAME, name);
+    addU32Attribute(request, TCA_BPF_FLAGS, TCA_BPF_FLAG_ACT_DIRECT);
+    endNestedAttribute(request);
+}
+
+/**
+ * Adds a message which redirects all the packets received by a link to the egress of
+ * the link 'targetIndex' (e.g. an ifb device, see addIfb()), through a u32 filter which
+ * matches every packet and a mirred action. The link needs a clsact qdisc, see addQdisc().
+ */
+void addIngressRedirectFilter(NetlinkRequest& request, int linkIndex, int targetIndex)
+{
+    tcmsg header{};
+    header.tcm_family = AF_UNSPEC;
+    header.tcm_ifindex = linkIndex;
+    header.tcm_parent = TC_H_MAKE(TC_H_CLSACT, TC_H_MIN_INGRESS);
+    // Priority 1, all protocols
+    header.tcm_info = TC_H_MAKE(1 << 16, htons(ETH_P_ALL));
+    beginNetlinkMessage(request, RTM_NEWTFILTER, NLM_F_CREATE | NLM_F_EXCL, &header, sizeof(header));
+    addStringAttribute(request, TCA_KIND, "u32");
+    beginNestedAttribute(request, TCA_OPTIONS);
+    // A selector with a single key whose mask is 0 matches every packet
+    char selector[sizeof(tc_u32_sel) + sizeof(tc_u32_key)] = {};
+    auto* selectorHeader = (tc_u32_sel*) selector;
+    selectorHeader->flags = TC_U32_TERMINAL;
+    selectorHeader->nkeys = 1;
+    addAttribute(request, TCA_U32_SEL, selector, sizeof(selector));
+    beginNestedAttribute(request, TCA_U32_ACT);
+    // Actions are nested under their position in the list, starting at 1
+    beginNestedAttribute(request, 1);
+    addStringAttribute(request, TCA_ACT_KIND, "mirred");
+    beginNestedAttribute(request, TCA_ACT_OPTIONS);
+    tc_mirred mirred{};
+    mirred.action = TC_ACT_STOLEN;
+    mirred.eaction = TCA_EGRESS_REDIR;
+    mirred.ifindex = (uint32_t) targetIndex;
+    addAttribute(request, TCA_MIRRED_PARMS, &mirred, sizeof(mirred));
+    endNestedAttribute(request);
+    endNestedAttribute(request);
+    endNestedAttribute(request);
+    endNestedAttribute(request);
+}
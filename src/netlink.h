@@ -0,0 +1,74 @@
+#ifndef CONTAINER_CPP_NETLINK_H
+#define CONTAINER_CPP_NETLINK_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+/**
+ * A struct representing a batch of netlink messages which are sent to the
+ * kernel with a single system call.
+ */
+struct NetlinkRequest
+{
+    std::vector<char> buffer;
+    // Offset of the header of the message which is being built
+    size_t messageOffset = 0;
+    // Offsets of the nested attributes which have not been closed yet
+    std::vector<size_t> nestedOffsets;
+};
+
+/**
+ * Optional attributes of a new link, where 0 keeps the kernel's default.
+ */
+struct LinkAttributes
+{
+    uint32_t mtu;
+    // Number of both TX and RX queues
+    uint32_t queues;
+    uint32_t txQueueLength;
+};
+
+// Generic netlink message construction
+void beginNetlinkMessage(NetlinkRequest& request, uint16_t type, uint16_t flags,
+                         const void* header, size_t headerSize);
+void addAttribute(NetlinkRequest& request, uint16_t type, const void* data, size_t size);
+void addStringAttribute(NetlinkRequest& request, uint16_t type, const std::string& value);
+void addU32Attribute(NetlinkRequest& request, uint16_t type, uint32_t value);
+void beginNestedAttribute(NetlinkRequest& request, uint16_t type);
+void endNestedAttribute(NetlinkRequest& request);
+
+// Netlink sockets
+int openNetlinkSocket(int protocol);
+int openNetlinkSocketInNamespace(int namespaceFd, int protocol);
+void sendNetlinkRequest(int fd, NetlinkRequest& request, const std::vector<int>& ignoredErrors = {});
+std::vector<std::vector<char>> queryNetlink(int fd, NetlinkRequest& request);
+
+// Links, addresses and routes
+void addBridge(NetlinkRequest& request, const std::string& name);
+void addVethPair(NetlinkRequest& request, const std::string& name, const std::string& peerName, int peerNamespaceFd,
+                 const LinkAttributes& attributes = {});
+void addDummy(NetlinkRequest& request, const std::string& name);
+void addIfb(NetlinkRequest& request, const std::string& name);
+void addNetkitPair(NetlinkRequest& request, const std::string& name, const std::string& peerName, int peerNamespaceFd,
+                   const LinkAttributes& attributes = {});
+void addMacvlan(NetlinkRequest& request, const std::string& name, int parentIndex, int namespaceFd,
+                const LinkAttributes& attributes = {});
+void addIpvlan(NetlinkRequest& request, const std::string& name, int parentIndex, uint16_t mode, int namespaceFd,
+               const LinkAttributes& attributes = {});
+void setLinkMaster(NetlinkRequest& request, const std::string& name, int masterIndex);
+void setLinkUp(NetlinkRequest& request, const std::string& name);
+void deleteLink(NetlinkRequest& request, const std::string& name);
+void addAddress(NetlinkRequest& request, int linkIndex, const std::string& ip, int prefixLength);
+void addDefaultRoute(NetlinkRequest& request, const std::string& gateway);
+int getLinkIndex(int fd, const std::string& name);
+void setLinkFeature(int fd, const std::string& name, uint32_t command, bool enabled);
+
+// Traffic control
+void addQdisc(NetlinkRequest& request, int linkIndex, const std::string& kind, uint32_t handle, uint32_t parent);
+void addHtbQdisc(NetlinkRequest& request, int linkIndex, uint32_t handle, uint32_t defaultClass);
+void addHtbClass(NetlinkRequest& request, int linkIndex, uint32_t classId, uint32_t parent, uint64_t rate);
+void addIngressBpfFilter(NetlinkRequest& request, int linkIndex, int programFd, const std::string& name);
+void addIngressRedirectFilter(NetlinkRequest& request, int linkIndex, int targetIndex);
+
+#endif //CONTAINER_CPP_NETLINK_H
@@ -0,0 +1,323 @@
+#include <string>
+#include <vector>
+#include <sstream>
+#include <iterator>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_link.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+#include <loguru/loguru.hpp>
+
+#include "netstats.h"
+#include "netlink.h"
+#include "container.h"
+
+/**
+ * Collects the counters of all interfaces except the loopback from RTM_GETLINK
+ * (IFLA_STATS64) in the namespace of the netlink socket 'fd'.
+ */
+std::vector<LinkStats> collectLinkStats(int fd)
+{
+    NetlinkRequest request;
+    ifinfomsg header{};
+    header.ifi_family = AF_UNSPEC;
+    beginNetlinkMessage(request, RTM_GETLINK, NLM_F_DUMP, &header, sizeof(header));
+
+    std::vector<LinkStats> links;
+    for (const auto& message : queryNetlink(fd, request))
+    {
+        auto* messageHeader = (nlmsghdr*) message.data();
+        auto* link = (ifinfomsg*) NLMSG_DATA(messageHeader);
+        if (messageHeader->nlmsg_type != RTM_NEWLINK || link->ifi_flags & IFF_LOOPBACK)
+            continue;
+
+        LinkStats stats{};
+        int remaining = (int) IFLA_PAYLOAD(messageHeader);
+        for (auto* attribute = IFLA_RTA(link); RTA_OK(attribute, remaining); attribute = RTA_NEXT(attribute, remaining))
+        {
+            if (attribute->rta_type == IFLA_IFNAME)
+            {
+                stats.name = (char*) RTA_DATA(attribute);
+            }
+            else if (attribute->rta_type == IFLA_STATS64)
+            {
+                rtnl_link_stats64 counters{};
+                memcpy(&counters, RTA_DATA(attribute), std::min(sizeof(counters), (size_t) RTA_PAYLOAD(attribute)));
+                stats.rxBytes = counters.rx_bytes;
+                stats.rxPackets = counters.rx_packets;
+                stats.rxDropped = counters.rx_dropped;
+                stats.rxErrors = counters.rx_errors;
+                stats.txBytes = counters.tx_bytes;
+                stats.txPackets = counters.tx_packets;
+                stats.txDropped = counters.tx_dropped;
+                stats.txErrors = counters.tx_errors;
+            }
+        }
+        links.push_back(stats);
+    }
+    return links;
+}
+
+/**
+ * Adds the established TCP connections of the given address family to the RTT and
+ * retransmit summary. The connections are dumped with inet_diag (SOCK_DIAG_BY_FAMILY)
+ * together with their struct tcp_info, in the namespace of the sock_diag socket 'fd'.
+ */
+void collectConnectionStats(int fd, uint8_t family, TcpStats& stats, uint64_t& rttSum)
+{
+    NetlinkRequest request;
+    inet_diag_req_v2 header{};
+    header.sdiag_family = family;
+    header.sdiag_protocol = IPPROTO_TCP;
+    header.idiag_states = 1 << TCP_ESTABLISHED;
+    header.idiag_ext = 1 << (INET_DIAG_INFO - 1);
+    beginNetlinkMessage(request, SOCK_DIAG_BY_FAMILY, NLM_F_DUMP, &header, sizeof(header));
+
+    for (const auto& message : queryNetlink(fd, request))
+    {
+        auto* messageHeader = (nlmsghdr*) message.data();
+        if (messageHeader->nlmsg_type != SOCK_DIAG_BY_FAMILY)
+            continue;
+        auto* connection = (inet_diag_msg*) NLMSG_DATA(messageHeader);
+        int remaining = (int) (messageHeader->nlmsg_len - NLMSG_LENGTH(sizeof(*connection)));
+        for (auto* attribute = (rtattr*) (connection + 1); RTA_OK(attribute, remaining);
+             attribute = RTA_NEXT(attribute, remaining))
+        {
+            if (attribute->rta_type != INET_DIAG_INFO)
+                continue;
+            tcp_info info{};
+            memcpy(&info, RTA_DATA(attribute), std::min(sizeof(info), (size_t) RTA_PAYLOAD(attribute)));
+            stats.minRtt = stats.connections == 0 ? info.tcpi_rtt : std::min(stats.minRtt, info.tcpi_rtt);
+            stats.maxRtt = std::max(stats.maxRtt, info.tcpi_rtt);
+            stats.connectionRetransmits += info.tcpi_total_retrans;
+            stats.connections++;
+            rttSum += info.tcpi_rtt;
+        }
+    }
+}
+
+/**
+ * Opens a file in the network namespace referred to by 'namespaceFd'. Files in
+ * /proc/net keep referring to the namespace they were opened in, hence the calling
+ * thread only has to enter the namespace while the file is being opened.
+ */
+int openFileInNamespace(int namespaceFd, const std::string& path)
+{
+    int currentNamespaceFd = open("/proc/thread-self/ns/net", O_RDONLY | O_CLOEXEC);
+    if (currentNamespaceFd < 0)
+        throw std::runtime_error("Open current network namespace: FAILED [Errno " + std::to_string(errno) + "]");
+    if (setns(namespaceFd, CLONE_NEWNET) != 0)
+    {
+        close(currentNamespaceFd);
+        throw std::runtime_error("Enter network namespace: FAILED [Errno " + std::to_string(errno) + "]");
+    }
+
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    std::string error;
+    if (fd < 0)
+        error = "Open " + path + ": FAILED [Errno " + std::to_string(errno) + "]";
+    if (setns(currentNamespaceFd, CLONE_NEWNET) != 0)
+        error = "Restore network namespace: FAILED [Errno " + std::to_string(errno) + "]";
+    close(currentNamespaceFd);
+    if (!error.empty())
+    {
+        if (fd >= 0)
+            close(fd);
+        throw std::runtime_error(error);
+    }
+    return fd;
+}
+
+/**
+ * Reads the number of TCP segments sent and retransmitted in the network namespace
+ * referred to by 'namespaceFd' from the 'Tcp:' lines of /proc/net/snmp, which hold
+ * the names of the counters and their values.
+ */
+void collectSegmentStats(int namespaceFd, TcpStats& stats)
+{
+    int fd = openFileInNamespace(namespaceFd, "/proc/thread-self/net/snmp");
+    std::string content;
+    char buffer[4096];
+    ssize_t length;
+    while ((length = read(fd, buffer, sizeof(buffer))) > 0)
+        content.append(buffer, length);
+    close(fd);
+
+    std::istringstream lines(content);
+    std::vector<std::vector<std::string>> tcpLines;
+    for (std::string line; std::getline(lines, line); )
+    {
+        if (line.rfind("Tcp:", 0) != 0)
+            continue;
+        std::istringstream words(line);
+        tcpLines.emplace_back(std::istream_iterator<std::string>(words), std::istream_iterator<std::string>());
+    }
+    if (tcpLines.size() != 2 || tcpLines[0].size() != tcpLines[1].size())
+        throw std::runtime_error("Parse /proc/net/snmp: FAILED");
+    for (size_t i = 1; i < tcpLines[0].size(); i++)
+    {
+        if (tcpLines[0][i] == "OutSegs")
+            stats.segmentsSent = std::stoull(tcpLines[1][i]);
+        else if (tcpLines[0][i] == "RetransSegs")
+            stats.segmentsRetransmitted = std::stoull(tcpLines[1][i]);
+    }
+}
+
+/**
+ * Collects the network statistics of the network namespace referred to by
+ * 'namespaceFd' by performing the following actions:
+ * 1. Reads the counters of its interfaces over rtnetlink, see collectLinkStats().
+ * 2. Reads the TCP segment counters of the namespace, see collectSegmentStats().
+ * 3. Summarizes the RTTs and retransmits of the established IPv4 and IPv6 TCP
+ * connections over inet_diag, see collectConnectionStats().
+ * The namespace stays usable after the container has exited as long as 'namespaceFd'
+ * is open, so that the statistics can also be collected at exit.
+ *
+ * @throw runtime_error if the statistics cannot be collected.
+ */
+NetworkStats collectNetworkStats(int namespaceFd)
+{
+    NetworkStats stats{};
+    int routeFd = openNetlinkSocketInNamespace(namespaceFd, NETLINK_ROUTE);
+    try
+    {
+        stats.links = collectLinkStats(routeFd);
+    }
+    catch (std::exception& ex)
+    {
+        close(routeFd);
+        throw;
+    }
+    close(routeFd);
+
+    collectSegmentStats(namespaceFd, stats.tcp);
+
+    uint64_t rttSum = 0;
+    int diagFd = openNetlinkSocketInNamespace(namespaceFd, NETLINK_SOCK_DIAG);
+    try
+    {
+        collectConnectionStats(diagFd, AF_INET, stats.tcp, rttSum);
+    }
+    catch (std::exception& ex)
+    {
+        close(diagFd);
+        throw;
+    }
+    close(diagFd);
+    // IPv6 connections are only summarized if inet6_diag is available
+    diagFd = openNetlinkSocketInNamespace(namespaceFd, NETLINK_SOCK_DIAG);
+    try
+    {
+        collectConnectionStats(diagFd, AF_INET6, stats.tcp, rttSum);
+    }
+    catch (std::exception& ex)
+    {
+        LOG_F(WARNING, "Collect IPv6 TCP connections: FAILED");
+        LOG_F(WARNING, "%s", ex.what());
+    }
+    close(diagFd);
+    if (stats.tcp.connections > 0)
+        stats.tcp.averageRtt = rttSum / stats.tcp.connections;
+    return stats;
+}
+
+/**
+ * Formats the statistics as a table of the interfaces followed by the TCP summary,
+ * one line per string.
+ */
+std::vector<std::string> formatNetworkStats(const NetworkStats& stats)
+{
+    std::vector<std::string> lines;
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "%-20s  %14s  %10s  %8s  %8s  %14s  %10s  %8s  %8s", "Interface",
+             "RX bytes", "RX packets", "RX drops", "RX errs", "TX bytes", "TX packets", "TX drops", "TX errs");
+    lines.emplace_back(buffer);
+    for (const auto& link : stats.links)
+    {
+        snprintf(buffer, sizeof(buffer), "%-20s  %14lu  %10lu  %8lu  %8lu  %14lu  %10lu  %8lu  %8lu",
+                 link.name.c_str(), link.rxBytes, link.rxPackets, link.rxDropped, link.rxErrors,
+                 link.txBytes, link.txPackets, link.txDropped, link.txErrors);
+        lines.emplace_back(buffer);
+    }
+
+    const TcpStats& tcp = stats.tcp;
+    double retransmitRate = tcp.segmentsSent > 0 ? 100.0 * tcp.segmentsRetransmitted / tcp.segmentsSent : 0;
+    snprintf(buffer, sizeof(buffer), "TCP segments: %lu sent, %lu retransmitted (%.2f%%)",
+             tcp.segmentsSent, tcp.segmentsRetransmitted, retransmitRate);
+    lines.emplace_back(buffer);
+    snprintf(buffer, sizeof(buffer), "TCP connections: %u established, %lu retransmits, "
+                                     "RTT min/avg/max %.3f/%.3f/%.3f ms", tcp.connections, tcp.connectionRetransmits,
+             tcp.minRtt / 1000.0, tcp.averageRtt / 1000.0, tcp.maxRtt / 1000.0);
+    lines.emplace_back(buffer);
+    return lines;
+}
+
+/**
+ * Prints the network statistics of the running container with the given ID, whose
+ * network namespace is opened through /proc/<pid>/ns/net.
+ *
+ * @throw runtime_error if the container is not running or shares the host's network.
+ */
+void printNetworkStats(const std::string& rootDir, const std::string& containerId)
+{
+    pid_t pid = getContainerPid(rootDir, containerId);
+    if (pid < 0)
+        throw std::runtime_error("[ERROR] Container " + containerId + " is not running");
+
+    std::string namespacePath = "/proc/" + std::to_string(pid) + "/ns/net";
+    struct stat containerNamespace{};
+    struct stat hostNamespace{};
+    if (stat(namespacePath.c_str(), &containerNamespace) != 0 || stat("/proc/self/ns/net", &hostNamespace) != 0)
+        throw std::runtime_error("Stat " + namespacePath + ": FAILED [Errno " + std::to_string(errno) + "]");
+    if (containerNamespace.st_ino == hostNamespace.st_ino && containerNamespace.st_dev == hostNamespace.st_dev)
+        throw std::runtime_error("[ERROR] Container " + containerId + " shares the network of the host");
+
+    int namespaceFd = open(namespacePath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (namespaceFd < 0)
+        throw std::runtime_error("Open " + namespacePath + ": FAILED [Errno " + std::to_string(errno) + "]");
+    NetworkStats stats;
+    try
+    {
+        stats = collectNetworkStats(namespaceFd);
+    }
+    catch (std::exception& ex)
+    {
+        close(namespaceFd);
+        throw;
+    }
+    close(namespaceFd);
+    for (const auto& line : formatNetworkStats(stats))
+        std::cout << line << std::endl;
+}
+
+/**
+ * Logs the network statistics of an exited container. Failures are only logged,
+ * since they must not prevent the container from being cleaned up.
+ */
+void logNetworkStats(const std::string& containerId, int namespaceFd)
+{
+    try
+    {
+        LOG_F(INFO, "Network stats of container %s:", containerId.c_str());
+        for (const auto& line : formatNetworkStats(collectNetworkStats(namespaceFd)))
+            LOG_F(INFO, "%s", line.c_str());
+    }
+    catch (std::exception& ex)
+    {
+        LOG_F(WARNING, "Collect network stats of container %s: FAILED", containerId.c_str());
+        LOG_F(WARNING, "%s", ex.what());
+    }
+}
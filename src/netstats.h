@@ -0,0 +1,53 @@
+#ifndef CONTAINER_CPP_NETSTATS_H
+#define CONTAINER_CPP_NETSTATS_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+/**
+ * Counters of an interface in a container's network namespace, seen from inside
+ * the container, i.e. 'rx' is the traffic received by the container.
+ */
+struct LinkStats
+{
+    std::string name;
+    uint64_t rxBytes;
+    uint64_t rxPackets;
+    uint64_t rxDropped;
+    uint64_t rxErrors;
+    uint64_t txBytes;
+    uint64_t txPackets;
+    uint64_t txDropped;
+    uint64_t txErrors;
+};
+
+/**
+ * A summary of TCP in a container's network namespace. The segment counters cover
+ * the whole lifetime of the namespace, whereas the RTTs and retransmits of the
+ * connections only cover the connections which are currently established.
+ */
+struct TcpStats
+{
+    uint64_t segmentsSent;
+    uint64_t segmentsRetransmitted;
+    uint32_t connections;
+    uint64_t connectionRetransmits;
+    // Smoothed RTTs of the connections in microseconds, 0 without connections
+    uint32_t minRtt;
+    uint32_t averageRtt;
+    uint32_t maxRtt;
+};
+
+struct NetworkStats
+{
+    std::vector<LinkStats> links;
+    TcpStats tcp;
+};
+
+NetworkStats collectNetworkStats(int namespaceFd);
+std::vector<std::string> formatNetworkStats(const NetworkStats& stats);
+void printNetworkStats(const std::string& rootDir, const std::string& containerId);
+void logNetworkStats(const std::string& containerId, int namespaceFd);
+
+#endif //CONTAINER_CPP_NETSTATS_H
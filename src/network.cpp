@@ -0,0 +1,1573 @@
+#include <string>
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <net/if.h>
+#include <sys/mount.h>
+#include <sys/file.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <linux/netlink.h>
+#include <linux/if_link.h>
+#include <linux/ethtool.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter_ipv4.h>
+#include <linux/netfilter/nf_tables.h>
+#include <linux/rtnetlink.h>
+#include <linux/pkt_sched.h>
+#include <loguru/loguru.hpp>
+
+#include "constants.h"
+#include "network.h"
+#include "netlink.h"
+#include "nftables.h"
+#include "bpf.h"
+#include "dns.h"
+#include "utils.h"
+
+/**
+ * Returns true if the given network connects containers through interfaces stacked
+ * on a parent device (macvlan or ipvlan) rather than through pairs attached to a bridge.
+ */
+bool usesParentDevice(const Network& network)
+{
+    return network.driver == MacvlanDriver || network.driver == IpvlanL2Driver || network.driver == IpvlanL3Driver;
+}
+
+/**
+ * Returns the names of the interfaces connecting a network namespace to the given
+ * network, where the first is placed in the namespace and the second on the host.
+ * Interfaces stacked on a parent device have no host side, so the second is empty.
+ * A valid interface name contains less than 16 characters, so the suffix is at most
+ * 9 characters long.
+ */
+std::pair<std::string, std::string> getInterfaceNames(const Network& network, const std::string& suffix)
+{
+    if (network.driver == MacvlanDriver)
+        return std::make_pair("mv0@" + suffix, "");
+    if (network.driver == IpvlanL2Driver || network.driver == IpvlanL3Driver)
+        return std::make_pair("ipv0@" + suffix, "");
+    return std::make_pair("veth0@" + suffix, "veth1@" + suffix);
+}
+
+/**
+ * Deletes the given nftables table together with its chains and rules, unless it
+ * does not exist.
+ */
+void deleteNetfilterTable(const std::string& table)
+{
+    NetlinkRequest request;
+    beginNftablesBatch(request);
+    deleteNftablesTable(request, table);
+    endNftablesBatch(request);
+
+    int fd = openNetlinkSocket(NETLINK_NETFILTER);
+    try
+    {
+        sendNetlinkRequest(fd, request, { ENOENT });
+    }
+    catch (std::exception& ex)
+    {
+        close(fd);
+        throw;
+    }
+    close(fd);
+}
+
+/**
+ * Masquerades the traffic which the containers on the bridge of the given network send
+ * out of the network, e.g. to the internet. The rule is installed once per bridge, in
+ * the table kapsel-nat-<bridge>, and matches packets from the bridge's subnet to
+ * addresses outside the whole network, so that the containers on the shards of a
+ * sharded network reach each other under their own addresses. Deleting the table
+ * removes the rule together with the bridge, see deleteNetworkDevice().
+ */
+void installMasqueradeRules(const Network& network)
+{
+    std::string table = "kapsel-nat-" + network.bridge;
+    uint32_t networkMask = ~0u << (32 - network.networkPrefixLength);
+    uint32_t source = htonl(network.subnet);
+    uint32_t sourceMask = htonl(~0u << (32 - network.prefixLength));
+    uint32_t destination = htonl(network.subnet & networkMask);
+    uint32_t destinationMask = htonl(networkMask);
+    uint32_t zero = 0;
+
+    NetlinkRequest request;
+    beginNftablesBatch(request);
+    // The table is created exclusively, so that the batch fails if it already exists
+    addNftablesTable(request, table);
+    auto* header = (nlmsghdr*) (request.buffer.data() + request.messageOffset);
+    header->nlmsg_flags |= NLM_F_EXCL;
+    addNftablesChain(request, table, "postrouting", "nat", NF_INET_POST_ROUTING, NF_IP_PRI_NAT_SRC);
+    beginNftablesRule(request, table, "postrouting");
+    addPayloadExpression(request, NFT_PAYLOAD_NETWORK_HEADER, 12, sizeof(source), NFT_REG_1);
+    addBitwiseExpression(request, NFT_REG_1, &sourceMask, &zero, sizeof(sourceMask));
+    addCmpExpression(request, NFT_REG_1, &source, sizeof(source));
+    addPayloadExpression(request, NFT_PAYLOAD_NETWORK_HEADER, 16, sizeof(destination), NFT_REG_1);
+    addBitwiseExpression(request, NFT_REG_1, &destinationMask, &zero, sizeof(destinationMask));
+    addCmpExpression(request, NFT_REG_1, &destination, sizeof(destination), NFT_CMP_NEQ);
+    addMasqueradeExpression(request);
+    endNftablesRule(request);
+    endNftablesBatch(request);
+
+    int fd = openNetlinkSocket(NETLINK_NETFILTER);
+    try
+    {
+        sendNetlinkRequest(fd, request, { EEXIST });
+    }
+    catch (std::exception& ex)
+    {
+        close(fd);
+        throw;
+    }
+    close(fd);
+}
+
+/**
+ * Creates the network device of the given network, assigns it the gateway address
+ * and sets its status to 'up'. The device is a bridge, or a dummy device serving as
+ * the parent of macvlan and ipvlan interfaces. Concurrent containers may race to
+ * create the device, hence EEXIST is not treated as an error.
+ */
+void createNetworkDevice(int fd, const Network& network)
+{
+    NetlinkRequest request;
+    if (usesParentDevice(network))
+        addDummy(request, network.bridge);
+    else
+        addBridge(request, network.bridge);
+    sendNetlinkRequest(fd, request, { EEXIST });
+
+    int deviceIndex = (int) if_nametoindex(network.bridge.c_str());
+    if (deviceIndex == 0)
+        throw std::runtime_error("Create network device " + network.bridge + ": FAILED [Errno " + std::to_string(errno) + "]");
+    request = NetlinkRequest();
+    addAddress(request, deviceIndex, network.gateway, network.prefixLength);
+    setLinkUp(request, network.bridge);
+    sendNetlinkRequest(fd, request, { EEXIST });
+    if (usesParentDevice(network))
+    {
+        LOG_F(INFO, "Create dummy device %s: SUCCESS", network.bridge.c_str());
+        return;
+    }
+
+    // Changes the policy on IP table, which a base chain of nftables cannot override
+    // FIXME There might exist another solution
+    // From: https://serverfault.com/questions/694889/cannot-ping-linux-network-namespace-within-the-same-subnet
+    std::string command = "iptables --policy FORWARD ACCEPT";
+    if (system(command.c_str()) == -1)
+        throw std::runtime_error("Execute command " + command + ": FAILED");
+    // Enable sending requests and getting responses to/from internet
+    installMasqueradeRules(network);
+    // The shards of a network reach each other through the host's routing
+    if (network.shardPrefixLength > 0)
+    {
+        std::ofstream file("/proc/sys/net/ipv4/ip_forward");
+        file << "1" << std::endl;
+        if (!file)
+            throw std::runtime_error("Enable IPv4 forwarding: FAILED");
+    }
+    LOG_F(INFO, "Create bridge %s: SUCCESS", network.bridge.c_str());
+}
+
+/**
+ * Deletes the network device of the given network together with the state kapsel
+ * keeps for it on the host: its masquerading rules and the pinned objects of its
+ * BPF fast path. A device which does not exist is not treated as an error.
+ */
+void deleteNetworkDevice(const Network& network)
+{
+    int fd = openNetlinkSocket(NETLINK_ROUTE);
+    NetlinkRequest request;
+    deleteLink(request, network.bridge);
+    try
+    {
+        sendNetlinkRequest(fd, request, { ENODEV });
+    }
+    catch (std::exception& ex)
+    {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    deleteNetfilterTable("kapsel-nat-" + network.bridge);
+    unpinFastPath(network.bridge);
+    LOG_F(INFO, "Delete network device %s: SUCCESS", network.bridge.c_str());
+}
+
+LinkAttributes getLinkAttributes(const Network& network)
+{
+    return LinkAttributes { network.mtu, network.queues, network.txQueueLength };
+}
+
+/**
+ * Applies the GRO and GSO settings of the given network to an interface in the network
+ * namespace of the socket 'fd'. Features left at FeatureDefault are not touched.
+ */
+void setLinkFeatures(int fd, const std::string& name, const Network& network)
+{
+    if (network.gro != FeatureDefault)
+        setLinkFeature(fd, name, ETHTOOL_SGRO, network.gro == FeatureOn);
+    if (network.gso != FeatureDefault)
+        setLinkFeature(fd, name, ETHTOOL_SGSO, network.gso == FeatureOn);
+}
+
+/**
+ * Creates the host side of the connection between the network namespace referred to
+ * by 'namespaceFd' and the given network, with the container's interface being placed
+ * directly in the namespace:
+ * - veth and netkit: a pair whose host side is attached to the bridge and set to 'up'.
+ * A netkit pair which cannot be created, e.g. on kernels older than 6.7, is replaced
+ * with a veth pair of the same names.
+ * - macvlan and ipvlan: an interface on top of the parent device.
+ * The interfaces are created with the MTU, queues and TX queue length of the network.
+ */
+void addNamespaceInterface(int hostFd,
+                           int namespaceFd,
+                           const Network& network,
+                           const std::pair<std::string, std::string>& interfaces)
+{
+    int deviceIndex = (int) if_nametoindex(network.bridge.c_str());
+    LinkAttributes attributes = getLinkAttributes(network);
+    NetlinkRequest request;
+    switch (network.driver)
+    {
+        case MacvlanDriver:
+            addMacvlan(request, interfaces.first, deviceIndex, namespaceFd, attributes);
+            sendNetlinkRequest(hostFd, request);
+            return;
+        case IpvlanL2Driver:
+        case IpvlanL3Driver:
+            addIpvlan(request, interfaces.first, deviceIndex,
+                      network.driver == IpvlanL2Driver ? IPVLAN_MODE_L2 : IPVLAN_MODE_L3, namespaceFd, attributes);
+            sendNetlinkRequest(hostFd, request);
+            return;
+        case NetkitDriver:
+            try
+            {
+                addNetkitPair(request, interfaces.second, interfaces.first, namespaceFd, attributes);
+                setLinkMaster(request, interfaces.second, deviceIndex);
+                setLinkUp(request, interfaces.second);
+                sendNetlinkRequest(hostFd, request);
+                setLinkFeatures(hostFd, interfaces.second, network);
+                return;
+            }
+            catch (std::exception& ex)
+            {
+                LOG_F(WARNING, "Create netkit pair: FAILED, falling back to veth");
+                LOG_F(WARNING, "%s", ex.what());
+                // Removes the pair in case it was created but could not be attached
+                request = NetlinkRequest();
+                deleteLink(request, interfaces.second);
+                sendNetlinkRequest(hostFd, request, { ENODEV });
+                request = NetlinkRequest();
+            }
+            [[fallthrough]];
+        default:
+            addVethPair(request, interfaces.second, interfaces.first, namespaceFd, attributes);
+            setLinkMaster(request, interfaces.second, deviceIndex);
+            setLinkUp(request, interfaces.second);
+            sendNetlinkRequest(hostFd, request);
+            setLinkFeatures(hostFd, interfaces.second, network);
+    }
+}
+
+/**
+ * Connects the network namespace referred to by 'namespaceFd' to the given network
+ * by performing the following actions:
+ * 1. If not already present, creates the bridge (or the dummy parent device) of the
+ * network, sets its status to 'up', and assigns it the gateway address.
+ * 2. Creates the container's interface directly in the network namespace, see
+ * addNamespaceInterface(), and applies the GRO and GSO settings to it.
+ * 3. Assigns the given IPv4 address to the container's interface.
+ * 4. Ups the container's interface and the namespace's localhost.
+ * 5. Adds the gateway as the default gateway in the namespace.
+ * All of the above is done with rtnetlink messages sent from this process. The messages
+ * for the host and for the namespace are each sent in a single batch, where the socket
+ * for the namespace is opened inside of it.
+ * References:
+ * - https://dev.to/polarbit/how-docker-container-networking-works-mimic-it-using-linux-network-namespaces-9mj
+ * - https://man7.org/linux/man-pages/man7/rtnetlink.7.html
+ */
+void connectNetworkNamespace(int namespaceFd,
+                             const Network& network,
+                             const std::string& ip,
+                             const std::pair<std::string, std::string>& interfaces)
+{
+    int hostFd = openNetlinkSocket(NETLINK_ROUTE);
+    int containerFd = -1;
+    try
+    {
+        // Checks if the bridge or the parent device already exists
+        std::string devicePath = "/sys/class/net/" + network.bridge + (usesParentDevice(network) ? "" : "/bridge");
+        if (!std::filesystem::exists(devicePath))
+            createNetworkDevice(hostFd, network);
+        addNamespaceInterface(hostFd, namespaceFd, network, interfaces);
+
+        containerFd = openNetlinkSocketInNamespace(namespaceFd, NETLINK_ROUTE);
+        setLinkFeatures(containerFd, interfaces.first, network);
+        NetlinkRequest containerRequest;
+        addAddress(containerRequest, getLinkIndex(containerFd, interfaces.first), ip, network.prefixLength);
+        setLinkUp(containerRequest, interfaces.first);
+        setLinkUp(containerRequest, "lo");
+        addDefaultRoute(containerRequest, network.gateway);
+        sendNetlinkRequest(containerFd, containerRequest);
+    }
+    catch (std::exception& ex)
+    {
+        close(hostFd);
+        if (containerFd >= 0)
+            close(containerFd);
+        throw;
+    }
+    close(hostFd);
+    close(containerFd);
+}
+
+/**
+ * Returns the directory of the pool of the given network, which is separated by the
+ * driver and by the link options, since these are fixed when a slot is created.
+ * For instance, slots with an MTU of 9000 and 4 queues are in <bridge>/veth-mtu9000-q4.
+ */
+std::string getNetworkPoolDir(const std::string& rootDir, const Network& network)
+{
+    std::string options;
+    if (network.mtu > 0)
+        options += "-mtu" + std::to_string(network.mtu);
+    if (network.queues > 0)
+        options += "-q" + std::to_string(network.queues);
+    if (network.txQueueLength > 0)
+        options += "-txq" + std::to_string(network.txQueueLength);
+    if (network.gro != FeatureDefault)
+        options += network.gro == FeatureOn ? "-gro" : "-nogro";
+    if (network.gso != FeatureDefault)
+        options += network.gso == FeatureOn ? "-gso" : "-nogso";
+    for (const auto& [name, driver] : stringToNetworkDriver)
+    {
+        if (driver == network.driver)
+            return rootDir + "/network/pool/" + network.bridge + "/" + name + options;
+    }
+    throw std::runtime_error("Unknown network driver " + std::to_string(network.driver));
+}
+
+/**
+ * Creates a new network namespace and pins it by bind-mounting it on 'path', so that
+ * it outlives this process. The calling thread only enters the namespace while it
+ * is being mounted.
+ */
+void createPinnedNetworkNamespace(const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0);
+    if (fd < 0)
+        throw std::runtime_error("Create " + path + ": FAILED [Errno " + std::to_string(errno) + "]");
+    close(fd);
+
+    int currentNamespaceFd = open("/proc/thread-self/ns/net", O_RDONLY | O_CLOEXEC);
+    if (currentNamespaceFd < 0)
+        throw std::runtime_error("Open current network namespace: FAILED [Errno " + std::to_string(errno) + "]");
+    std::string error;
+    if (unshare(CLONE_NEWNET) != 0)
+        error = "Create network namespace: FAILED [Errno " + std::to_string(errno) + "]";
+    else if (mount("/proc/thread-self/ns/net", path.c_str(), nullptr, MS_BIND, nullptr) != 0)
+        error = "Pin network namespace on " + path + ": FAILED [Errno " + std::to_string(errno) + "]";
+    if (setns(currentNamespaceFd, CLONE_NEWNET) != 0 && error.empty())
+        error = "Restore network namespace: FAILED [Errno " + std::to_string(errno) + "]";
+    close(currentNamespaceFd);
+    if (!error.empty())
+        throw std::runtime_error(error);
+}
+
+/**
+ * Adds a fully configured network namespace to the pool of the given network.
+ * The pool of a network is located in <root-dir>/network/pool/<bridge>/<driver>[<options>], where
+ * each slot consists of the pinned namespace <slot> and the file <slot>.ready which
+ * holds its IPv4 address. The interfaces of a slot are named after the slot.
+ */
+void addNetworkPoolSlot(const std::string& rootDir, const Network& network)
+{
+    std::string slot = generateContainerId(9);
+    std::string slotPath = getNetworkPoolDir(rootDir, network) + "/" + slot;
+    std::string ip = allocateIp(rootDir, network);
+    try
+    {
+        createPinnedNetworkNamespace(slotPath);
+        int namespaceFd = open(slotPath.c_str(), O_RDONLY | O_CLOEXEC);
+        if (namespaceFd < 0)
+            throw std::runtime_error("Open " + slotPath + ": FAILED [Errno " + std::to_string(errno) + "]");
+        try
+        {
+            connectNetworkNamespace(namespaceFd, network, ip, getInterfaceNames(network, slot));
+        }
+        catch (std::exception& ex)
+        {
+            close(namespaceFd);
+            throw;
+        }
+        close(namespaceFd);
+
+        // The slot only becomes visible to containers once it is fully configured
+        if (!writeProperties(slotPath + ".conf", { { "ip", ip } }) ||
+            rename((slotPath + ".conf").c_str(), (slotPath + ".ready").c_str()) != 0)
+            throw std::runtime_error("Register network pool slot " + slot + ": FAILED");
+    }
+    catch (std::exception& ex)
+    {
+        // Unmounting the namespace destroys it together with its interfaces
+        umount2(slotPath.c_str(), MNT_DETACH);
+        unlink(slotPath.c_str());
+        unlink((slotPath + ".conf").c_str());
+        releaseIp(rootDir, network, ip);
+        throw;
+    }
+}
+
+/**
+ * Adds slots to the network pool of the given network until it holds 'size' ready
+ * namespaces. Only one process replenishes the pool of a network at a time, others
+ * return immediately.
+ */
+void replenishNetworkPool(const std::string& rootDir, const Network& network, int size)
+{
+    std::string poolDir = getNetworkPoolDir(rootDir, network);
+    std::filesystem::create_directories(poolDir);
+    std::string lockPath = poolDir + "/.lock";
+    int lockFd = open(lockPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lockFd < 0 || flock(lockFd, LOCK_EX | LOCK_NB) != 0)
+    {
+        if (lockFd >= 0)
+            close(lockFd);
+        return;
+    }
+
+    try
+    {
+        int readyCount = 0;
+        for (const auto& entry : std::filesystem::directory_iterator(poolDir))
+        {
+            if (entry.path().extension() == ".ready")
+                readyCount++;
+        }
+        for (int i = readyCount; i < size; i++)
+            addNetworkPoolSlot(rootDir, network);
+        LOG_F(INFO, "Replenish network pool of %s: SUCCESS [%d added]", network.bridge.c_str(),
+              std::max(size - readyCount, 0));
+    }
+    catch (std::exception& ex)
+    {
+        LOG_F(ERROR, "Replenish network pool of %s: FAILED", network.bridge.c_str());
+        LOG_F(ERROR, "%s", ex.what());
+    }
+    close(lockFd);
+}
+
+/**
+ * Takes a ready namespace from the network pool of the container's network and
+ * keeps it open in 'networkNamespaceFd' for the container to join. A slot is claimed
+ * by renaming its .ready file, which only one of several concurrent launches can do.
+ *
+ * @return true if a namespace has been taken from the pool, false if the pool is empty.
+ */
+bool claimNetworkPoolSlot(Container* container)
+{
+    std::string poolDir = getNetworkPoolDir(container->rootDir, container->network);
+    if (!std::filesystem::exists(poolDir))
+        return false;
+
+    for (const auto& entry : std::filesystem::directory_iterator(poolDir))
+    {
+        if (entry.path().extension() != ".ready")
+            continue;
+        std::string slot = entry.path().stem().string();
+        std::string slotPath = poolDir + "/" + slot;
+        std::string claimedPath = slotPath + ".claimed";
+        if (rename(entry.path().c_str(), claimedPath.c_str()) != 0)
+            continue;
+
+        // The open file descriptor keeps the namespace alive once it is unpinned
+        auto properties = readProperties(claimedPath);
+        container->networkNamespaceFd = open(slotPath.c_str(), O_RDONLY | O_CLOEXEC);
+        int error = errno;
+        umount2(slotPath.c_str(), MNT_DETACH);
+        unlink(slotPath.c_str());
+        unlink(claimedPath.c_str());
+        if (container->networkNamespaceFd < 0)
+        {
+            LOG_F(ERROR, "Claim network pool slot %s: FAILED [Errno %d]", slot.c_str(), error);
+            releaseIp(container->rootDir, container->network, properties["ip"]);
+            continue;
+        }
+
+        container->ip = properties["ip"];
+        container->vEthPair = getInterfaceNames(container->network, slot);
+        LOG_F(INFO, "Claim network pool slot %s: SUCCESS", slot.c_str());
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Removes the ready slots from the network pools of the given network, i.e. from its pools
+ * of all drivers and link options, and releases their addresses. Slots are claimed like in
+ * claimNetworkPoolSlot(), so a slot a container has claimed already is left to it. A pool
+ * which is being replenished is only drained once the replenishment has finished.
+ *
+ * @return the number of slots removed.
+ */
+int drainNetworkPool(const std::string& rootDir, const Network& network)
+{
+    int count = 0;
+    std::error_code error;
+    for (const auto& poolEntry : std::filesystem::directory_iterator(rootDir + "/network/pool/" + network.bridge, error))
+    {
+        std::string poolDir = poolEntry.path();
+        std::string lockPath = poolDir + "/.lock";
+        int lockFd = open(lockPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (lockFd < 0 || flock(lockFd, LOCK_EX) != 0)
+        {
+            int lockError = errno;
+            if (lockFd >= 0)
+                close(lockFd);
+            throw std::runtime_error("Lock " + lockPath + ": FAILED [Errno " + std::to_string(lockError) + "]");
+        }
+
+        std::vector<std::string> slots;
+        for (const auto& entry : std::filesystem::directory_iterator(poolDir))
+        {
+            if (entry.path().extension() == ".ready")
+                slots.push_back(entry.path().stem());
+        }
+        try
+        {
+            for (const auto& slot : slots)
+            {
+                std::string slotPath = poolDir + "/" + slot;
+                std::string claimedPath = slotPath + ".claimed";
+                if (rename((slotPath + ".ready").c_str(), claimedPath.c_str()) != 0)
+                    continue;
+                auto properties = readProperties(claimedPath);
+                // Unmounting the namespace destroys it together with its interfaces
+                umount2(slotPath.c_str(), MNT_DETACH);
+                unlink(slotPath.c_str());
+                unlink(claimedPath.c_str());
+                if (properties.count("ip"))
+                    releaseIp(rootDir, network, properties["ip"]);
+                count++;
+            }
+        }
+        catch (std::exception& ex)
+        {
+            close(lockFd);
+            throw;
+        }
+        close(lockFd);
+    }
+    LOG_F(INFO, "Drain network pool of %s: SUCCESS [%d removed]", network.bridge.c_str(), count);
+    return count;
+}
+
+std::string getContainerTableName(const Container* container)
+{
+    return "kapsel-" + container->id;
+}
+
+/**
+ * Adds a rule to the given chain which forwards connections to the given port on any
+ * of the host's addresses to the container. The rule matches the transport protocol,
+ * the destination port and a local destination address, and then rewrites the
+ * destination to the container's address and port.
+ */
+void addPortForwardingRule(NetlinkRequest& request,
+                           const std::string& table,
+                           const std::string& chain,
+                           const PortMapping& port,
+                           const std::string& ip)
+{
+    in_addr address{};
+    inet_pton(AF_INET, ip.c_str(), &address);
+    auto protocol = (uint8_t) port.protocol;
+    uint16_t hostPort = htons(port.hostPort);
+    uint16_t containerPort = htons(port.containerPort);
+    uint32_t localAddressType = RTN_LOCAL;
+
+    beginNftablesRule(request, table, chain);
+    addMetaExpression(request, NFT_META_L4PROTO, NFT_REG_1);
+    addCmpExpression(request, NFT_REG_1, &protocol, sizeof(protocol));
+    // The destination port is at the same offset in TCP and UDP headers
+    addPayloadExpression(request, NFT_PAYLOAD_TRANSPORT_HEADER, 2, sizeof(hostPort), NFT_REG_1);
+    addCmpExpression(request, NFT_REG_1, &hostPort, sizeof(hostPort));
+    addAddressTypeExpression(request, NFT_REG_1);
+    addCmpExpression(request, NFT_REG_1, &localAddressType, sizeof(localAddressType));
+    addImmediateExpression(request, NFT_REG_1, &address.s_addr, sizeof(address.s_addr));
+    addImmediateExpression(request, NFT_REG_2, &containerPort, sizeof(containerPort));
+    addDnatExpression(request, NFT_REG_1, NFT_REG_2);
+    endNftablesRule(request);
+}
+
+/**
+ * Adds a rule to the given chain which sets the skb priority of the packets sent by the
+ * container, so that queues on the host that take it into account, such as the
+ * bands of pfifo_fast and prio, favour or defer them. It is only a mark, no priority
+ * class is set up by kapsel.
+ */
+void addPriorityRule(NetlinkRequest& request, const std::string& table, const std::string& chain,
+                     const std::string& ip, uint32_t priority)
+{
+    in_addr address{};
+    inet_pton(AF_INET, ip.c_str(), &address);
+
+    beginNftablesRule(request, table, chain);
+    // The source address is at offset 12 of the IPv4 header
+    addPayloadExpression(request, NFT_PAYLOAD_NETWORK_HEADER, 12, sizeof(address.s_addr), NFT_REG_1);
+    addCmpExpression(request, NFT_REG_1, &address.s_addr, sizeof(address.s_addr));
+    addImmediateExpression(request, NFT_REG_1, &priority, sizeof(priority));
+    addMetaSetExpression(request, NFT_META_PRIORITY, NFT_REG_1);
+    endNftablesRule(request);
+}
+
+bool hasContainerRules(const Container* container)
+{
+    return !container->publishedPorts.empty() || container->resourceLimits->networkPriority != TC_PRIO_BESTEFFORT;
+}
+
+/**
+ * Installs the netfilter rules of the container in an nftables table of its own,
+ * named kapsel-<container-id>, so that they are removed by deleting the table:
+ * - For each published port, DNAT rules forwarding it to the container. Connections
+ * from other hosts are translated in the prerouting hook and those from the host
+ * itself in the output hook. The translated packets are forwarded by the kernel,
+ * without a proxy process in the data path.
+ * - If the container's network priority is not the default one, a rule setting the
+ * priority of its forwarded packets.
+ */
+void installContainerRules(Container* container)
+{
+    if (!hasContainerRules(container))
+        return;
+
+    std::string table = getContainerTableName(container);
+    NetlinkRequest request;
+    beginNftablesBatch(request);
+    addNftablesTable(request, table);
+    if (!container->publishedPorts.empty())
+    {
+        addNftablesChain(request, table, "prerouting", "nat", NF_INET_PRE_ROUTING, NF_IP_PRI_NAT_DST);
+        addNftablesChain(request, table, "output", "nat", NF_INET_LOCAL_OUT, NF_IP_PRI_NAT_DST);
+        for (const auto& port : container->publishedPorts)
+        {
+            addPortForwardingRule(request, table, "prerouting", port, container->ip);
+            addPortForwardingRule(request, table, "output", port, container->ip);
+        }
+    }
+    if (container->resourceLimits->networkPriority != TC_PRIO_BESTEFFORT)
+    {
+        addNftablesChain(request, table, "forward", "filter", NF_INET_FORWARD, NF_IP_PRI_MANGLE);
+        addPriorityRule(request, table, "forward", container->ip, container->resourceLimits->networkPriority);
+    }
+    endNftablesBatch(request);
+
+    int fd = openNetlinkSocket(NETLINK_NETFILTER);
+    try
+    {
+        sendNetlinkRequest(fd, request);
+    }
+    catch (std::exception& ex)
+    {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    LOG_F(INFO, "Install container rules: SUCCESS [%zu ports published]", container->publishedPorts.size());
+}
+
+/**
+ * Removes the netfilter rules of a container by deleting its table, see
+ * installContainerRules().
+ */
+void removeContainerRules(const std::string& table)
+{
+    deleteNetfilterTable(table);
+    LOG_F(INFO, "Remove container rules: SUCCESS");
+}
+
+/**
+ * Exempts the traffic between the addresses in the subnet of the given network from
+ * connection tracking, so that container-to-container flows neither pay for conntrack
+ * lookups nor fill the conntrack table. The rule is installed once per network, in
+ * the table kapsel-notrack-<bridge>, and matches bridged packets in the prerouting
+ * hook at the priority of the raw table, i.e. before conntrack sees them. Packets
+ * are only seen there if bridged traffic is passed to netfilter (br_netfilter).
+ * Since the replies are not tracked either, a container cannot reach the published
+ * ports of another container in the same subnet through the host's addresses.
+ */
+void installNotrackRules(const Network& network)
+{
+    std::string table = "kapsel-notrack-" + network.bridge;
+    // Both the source and the destination address are reduced to their subnet
+    uint32_t addresses[2] = { htonl(network.subnet), htonl(network.subnet) };
+    uint32_t masks[2] = { htonl(~0u << (32 - network.prefixLength)), htonl(~0u << (32 - network.prefixLength)) };
+    uint32_t zeros[2] = { 0, 0 };
+
+    NetlinkRequest request;
+    beginNftablesBatch(request);
+    // The table is created exclusively, so that the batch fails if it already exists
+    addNftablesTable(request, table);
+    auto* header = (nlmsghdr*) (request.buffer.data() + request.messageOffset);
+    header->nlmsg_flags |= NLM_F_EXCL;
+    addNftablesChain(request, table, "prerouting", "filter", NF_INET_PRE_ROUTING, NF_IP_PRI_RAW);
+    beginNftablesRule(request, table, "prerouting");
+    // The source and the destination address are adjacent at offset 12 of the IPv4 header
+    addPayloadExpression(request, NFT_PAYLOAD_NETWORK_HEADER, 12, sizeof(addresses), NFT_REG_1);
+    addBitwiseExpression(request, NFT_REG_1, masks, zeros, sizeof(masks));
+    addCmpExpression(request, NFT_REG_1, addresses, sizeof(addresses));
+    addNotrackExpression(request);
+    endNftablesRule(request);
+    endNftablesBatch(request);
+
+    int fd = openNetlinkSocket(NETLINK_NETFILTER);
+    try
+    {
+        sendNetlinkRequest(fd, request, { EEXIST });
+    }
+    catch (std::exception& ex)
+    {
+        close(fd);
+        throw;
+    }
+    close(fd);
+}
+
+/**
+ * Adds an HTB qdisc to the given link whose only class limits its egress to 'rate'
+ * bytes per second, with fq_codel as the leaf qdisc so that the flows sharing the
+ * limit are queued fairly. Kernels without fq_codel keep HTB's default FIFO leaf.
+ */
+void limitLinkRate(int fd, int linkIndex, uint64_t rate)
+{
+    NetlinkRequest request;
+    addHtbQdisc(request, linkIndex, TC_H_MAKE(1 << 16, 0), 1);
+    addHtbClass(request, linkIndex, TC_H_MAKE(1 << 16, 1), TC_H_MAKE(1 << 16, 0), rate);
+    sendNetlinkRequest(fd, request);
+
+    request = NetlinkRequest();
+    addQdisc(request, linkIndex, "fq_codel", TC_H_MAKE(0x10 << 16, 0), TC_H_MAKE(1 << 16, 1));
+    try
+    {
+        sendNetlinkRequest(fd, request);
+    }
+    catch (std::exception& ex)
+    {
+        LOG_F(WARNING, "Add fq_codel qdisc: FAILED, keeping the default leaf qdisc");
+        LOG_F(WARNING, "%s", ex.what());
+    }
+}
+
+/**
+ * Returns the name of the ifb device which shapes the traffic received by the given
+ * host side of a veth pair, e.g. ifb@<suffix> for veth1@<suffix>.
+ */
+std::string getIfbName(const std::string& hostInterface)
+{
+    return "ifb" + hostInterface.substr(hostInterface.find('@'));
+}
+
+/**
+ * Applies the container's egress and ingress rate limits on the host side of its veth
+ * pair, where the container cannot remove them even though it may administer its own
+ * interface:
+ * - The ingress rate limits the egress of the host side of the veth pair, through
+ * which all the traffic to the container passes.
+ * - The egress rate limits the traffic received by the host side of the veth pair.
+ * Since the ingress of a link cannot be shaped, the traffic is redirected to an ifb
+ * device (see getIfbName()), whose egress is shaped instead and which hands it back.
+ * The qdiscs of the host side are removed together with the veth pair, whereas the ifb
+ * device is deleted by releaseNetworkResources().
+ *
+ * @throw invalid_argument if a rate is given for a driver without host side.
+ */
+void applyTrafficLimits(Container* container)
+{
+    const auto* limits = container->resourceLimits;
+    if (limits->ingressRate == 0 && limits->egressRate == 0)
+        return;
+    if (container->vEthPair.second.empty())
+        throw std::invalid_argument("[ERROR] Rate limits require the veth or netkit driver");
+    const std::string& hostInterface = container->vEthPair.second;
+    int fd = openNetlinkSocket(NETLINK_ROUTE);
+    try
+    {
+        int linkIndex = getLinkIndex(fd, hostInterface);
+        if (limits->ingressRate > 0)
+            limitLinkRate(fd, linkIndex, limits->ingressRate);
+        if (limits->egressRate > 0)
+        {
+            std::string ifbName = getIfbName(hostInterface);
+            NetlinkRequest request;
+            addIfb(request, ifbName);
+            setLinkUp(request, ifbName);
+            sendNetlinkRequest(fd, request);
+            int ifbIndex = getLinkIndex(fd, ifbName);
+            limitLinkRate(fd, ifbIndex, limits->egressRate);
+
+            request = NetlinkRequest();
+            addQdisc(request, linkIndex, "clsact", TC_H_MAKE(TC_H_CLSACT, 0), TC_H_CLSACT);
+            addIngressRedirectFilter(request, linkIndex, ifbIndex);
+            sendNetlinkRequest(fd, request);
+        }
+    }
+    catch (std::exception& ex)
+    {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    LOG_F(INFO, "Apply traffic limits: SUCCESS [egress %lu B/s, ingress %lu B/s]",
+          (unsigned long) limits->egressRate, (unsigned long) limits->ingressRate);
+}
+
+/**
+ * Enables the BPF fast path for the given container, where packets between containers
+ * on the same bridge are moved from the host side of the sender's veth pair straight
+ * into the receiver's namespace instead of crossing the bridge:
+ * 1. Opens the bridge's peer map and redirect program, see openPeerMap() and
+ * openRedirectProgram().
+ * 2. Attaches the program to the ingress of the host side of the container's veth pair.
+ * 3. Adds the container's address to the peer map, so that the other containers'
+ * programs redirect packets to it.
+ * Redirected packets bypass the bridge's netfilter hooks and the qdisc on the host side
+ * of the receiver's veth pair. If BPF is not available, the container keeps using the
+ * bridge, which only costs the speedup. A container with an egress rate keeps using the
+ * bridge as well, since its packets are redirected to be shaped, see applyTrafficLimits().
+ */
+void enableFastPath(Container* container)
+{
+    if (container->resourceLimits->egressRate > 0)
+    {
+        LOG_F(WARNING, "Enable BPF fast path: SKIPPED, the egress of the container is redirected to be shaped");
+        return;
+    }
+    int mapFd = -1;
+    int programFd = -1;
+    int fd = -1;
+    try
+    {
+        mapFd = openPeerMap(container->network.bridge);
+        programFd = openRedirectProgram(container->network.bridge, mapFd);
+        fd = openNetlinkSocket(NETLINK_ROUTE);
+        int linkIndex = getLinkIndex(fd, container->vEthPair.second);
+        NetlinkRequest request;
+        addQdisc(request, linkIndex, "clsact", TC_H_MAKE(TC_H_CLSACT, 0), TC_H_CLSACT);
+        addIngressBpfFilter(request, linkIndex, programFd, "kapsel_redirect");
+        sendNetlinkRequest(fd, request);
+        addPeer(mapFd, container->ip, linkIndex);
+        LOG_F(INFO, "Enable BPF fast path: SUCCESS");
+    }
+    catch (std::exception& ex)
+    {
+        LOG_F(WARNING, "Enable BPF fast path: FAILED, falling back to the bridge");
+        LOG_F(WARNING, "%s", ex.what());
+    }
+    for (int openFd : { mapFd, programFd, fd })
+    {
+        if (openFd >= 0)
+            close(openFd);
+    }
+}
+
+/**
+ * Removes a container from the peer map of its bridge, so that the address can be
+ * reused by a container which does not take part in the fast path.
+ */
+void disableFastPath(const std::string& bridge, const std::string& ip)
+{
+    try
+    {
+        int mapFd = openPeerMap(bridge);
+        try
+        {
+            deletePeer(mapFd, ip);
+        }
+        catch (std::exception& ex)
+        {
+            close(mapFd);
+            throw;
+        }
+        close(mapFd);
+    }
+    catch (std::exception& ex)
+    {
+        LOG_F(WARNING, "Disable BPF fast path: FAILED");
+        LOG_F(WARNING, "%s", ex.what());
+    }
+}
+
+/**
+ * Parses a rate in the units of the tc command, e.g. 100kbit, 10mbit or 1gbit,
+ * where 0 stands for no limit.
+ *
+ * @throw invalid_argument if the rate is malformed.
+ * @return the rate in bytes per second.
+ */
+uint64_t parseRate(const std::string& rate)
+{
+    static const std::map<std::string, uint64_t> units = {
+            { "bit", 1 }, { "kbit", 1000 }, { "mbit", 1000000 }, { "gbit", 1000000000 }
+    };
+
+    size_t unitStart = rate.find_first_not_of("0123456789");
+    std::string number = rate.substr(0, unitStart);
+    std::string unit = unitStart == std::string::npos ? "" : rate.substr(unitStart);
+    if (number == "0" && unit.empty())
+        return 0;
+    if (number.empty() || number.size() > 12 || !units.count(unit) || std::stoull(number) == 0)
+        throw std::invalid_argument("[ERROR] Invalid rate " + rate + "! Expected e.g. 100kbit, 10mbit or 1gbit");
+    return std::stoull(number) * units.at(unit) / 8;
+}
+
+/**
+ * Allocates an IPv4 address for the given container in the first shard of its sharded
+ * network which has a free address, and narrows the container's network down to that
+ * shard. The shards are thus filled in order, and the bridge of a shard is only created
+ * once the shards before it are full, which bounds the number of ports, and with them
+ * the flooding and the forwarding database, of every bridge.
+ *
+ * @throw runtime_error if all the shards are full or the allocation state of a shard cannot be accessed.
+ */
+void allocateShardedIp(Container* container)
+{
+    const Network& network = container->network;
+    for (uint32_t i = 0; i < getShardCount(network); i++)
+    {
+        Network shard = getNetworkShard(network, i);
+        container->ip = tryAllocateIp(container->rootDir, shard);
+        if (container->ip.empty())
+            continue;
+        LOG_F(INFO, "Select shard %s of network %s: SUCCESS", shard.bridge.c_str(), network.name.c_str());
+        container->network = shard;
+        return;
+    }
+    throw std::runtime_error("Allocate IPv4 address in network " + network.name + ": FAILED [all shards are full]");
+}
+
+/**
+ * Reserves the network resources of the given container before it is cloned.
+ * If requested, first exempts the traffic within its subnet from connection tracking.
+ * For a sharded network, allocates an IPv4 address in the first shard with room, see
+ * allocateShardedIp(). If the network pool is enabled, takes a configured namespace
+ * from the pool, which the container joins instead of creating its own. Otherwise,
+ * allocates an IPv4 address for the container from the IPAM of its network. Once the
+ * address is known,
+ * installs the container's netfilter rules, and for a namespace from the pool, its
+ * traffic limits and the BPF fast path.
+ */
+void reserveContainerNetwork(Container* container)
+{
+    if (container->network.notrack)
+        installNotrackRules(container->network);
+    if (container->network.shardPrefixLength > 0)
+        allocateShardedIp(container);
+    else if (container->networkPoolSize <= 0 || !claimNetworkPoolSlot(container))
+        container->ip = allocateIp(container->rootDir, container->network);
+    LOG_F(INFO, "Container IP: %s", container->ip.c_str());
+    installContainerRules(container);
+    if (container->networkNamespaceFd >= 0)
+    {
+        applyTrafficLimits(container);
+        if (container->network.fastPath)
+            enableFastPath(container);
+    }
+}
+
+/**
+ * Signals the result of configuring a container's network (NETWORK_READY or
+ * NETWORK_FAILED) by writing it to the container's 'networkReadyFd'. For a container
+ * started with --network-async, which does not wait on the eventfd, the result is
+ * also published as the file network-ready (holding the container's IP) or
+ * network-failed in <container-dir>/run, which is mounted on /run/kapsel in the
+ * container. The file is renamed into place, so it is never seen partially written.
+ */
+void signalNetworkStatus(Container* container, uint64_t status)
+{
+    if (write(container->networkReadyFd, &status, sizeof(status)) != sizeof(status))
+        LOG_F(ERROR, "Signal container network status: FAILED [Errno %d]", errno);
+    if (!container->networkAsync)
+        return;
+
+    std::string statusDir = container->dir + "/run";
+    std::string path = statusDir + (status == NETWORK_READY ? "/network-ready" : "/network-failed");
+    std::string temporaryPath = statusDir + "/.network-status";
+    std::ofstream file(temporaryPath, std::ios::trunc);
+    file << (status == NETWORK_READY ? container->ip : "") << std::endl;
+    file.close();
+    if (!file || rename(temporaryPath.c_str(), path.c_str()) != 0)
+        LOG_F(ERROR, "Write %s: FAILED [Errno %d]", path.c_str(), errno);
+    else
+        LOG_F(INFO, "Write %s: SUCCESS", path.c_str());
+}
+
+/**
+ * Initializes the networking environment for the given container, see
+ * connectNetworkNamespace(). The parent opens the container's network namespace
+ * from /proc/<pid>/ns/net right after cloning it and passes it to this function,
+ * which is run by a worker thread while the container sets up its file system.
+ * Once done, the result is signaled with signalNetworkStatus().
+ *
+ * @param namespaceFd the container's network namespace, closed by this function.
+ */
+void initializeContainerNetwork(Container* container, int namespaceFd)
+{
+    LOG_F(INFO, "Initializing container network environment");
+    auto startTime = std::chrono::steady_clock::now();
+    uint64_t status = NETWORK_FAILED;
+    try
+    {
+        // Takes the first 9 characters of the container's ID as the suffix
+        // for the names of the interfaces
+        container->vEthPair = getInterfaceNames(container->network, container->id.substr(0, 9));
+        connectNetworkNamespace(namespaceFd, container->network, container->ip, container->vEthPair);
+        applyTrafficLimits(container);
+        if (container->network.fastPath)
+            enableFastPath(container);
+
+        status = NETWORK_READY;
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - startTime).count();
+        LOG_F(INFO, "Initialize container network environment: SUCCESS [%ld us]", (long) elapsed);
+    }
+    catch (std::exception& ex)
+    {
+        LOG_F(ERROR, "Initialize container network environment: FAILED");
+        LOG_F(ERROR, "%s", ex.what());
+    }
+    close(namespaceFd);
+    // Unblocks the container, which aborts if the network could not be configured
+    signalNetworkStatus(container, status);
+}
+
+/**
+ * Starts a worker which runs the DNS forwarder for the given container on the gateway
+ * address of its bridge, see runDnsForwarder(). Every kapsel process with a container
+ * on the bridge runs its own forwarder, so the address is served as long as any of
+ * them runs. A forwarder which cannot be started only leaves the container without
+ * name resolution, hence it is not treated as an error.
+ */
+void startDnsForwarder(Container* container)
+{
+    try
+    {
+        int socketFd = openDnsSocket(container->network.gateway);
+        container->dnsStopFd = eventfd(0, EFD_CLOEXEC);
+        if (container->dnsStopFd < 0)
+        {
+            close(socketFd);
+            throw std::runtime_error("Create DNS eventfd: FAILED [Errno " + std::to_string(errno) + "]");
+        }
+        container->dnsWorker = std::thread(runDnsForwarder, container->rootDir, container->network.name,
+                                           container->network.dnsUpstream, socketFd, container->dnsStopFd);
+        LOG_F(INFO, "Start DNS forwarder on %s: SUCCESS", container->network.gateway.c_str());
+    }
+    catch (std::exception& ex)
+    {
+        LOG_F(WARNING, "Start DNS forwarder on %s: FAILED", container->network.gateway.c_str());
+        LOG_F(WARNING, "%s", ex.what());
+    }
+}
+
+/**
+ * Stops the DNS forwarder of the given container, if it is running, and waits for
+ * its worker to exit.
+ */
+void stopDnsForwarder(Container* container)
+{
+    if (!container->dnsWorker.joinable())
+        return;
+    uint64_t value = 1;
+    if (write(container->dnsStopFd, &value, sizeof(value)) != sizeof(value))
+    {
+        // The worker still polls the eventfd, so it is left open
+        LOG_F(ERROR, "Stop DNS forwarder: FAILED [Errno %d]", errno);
+        container->dnsWorker.detach();
+        return;
+    }
+    container->dnsWorker.join();
+    close(container->dnsStopFd);
+    container->dnsStopFd = -1;
+}
+
+/**
+ * Sets the loopback interface of the calling process's network namespace to 'up',
+ * which is all the configuration a container in loopback mode needs.
+ */
+void setUpLoopback()
+{
+    int fd = openNetlinkSocket(NETLINK_ROUTE);
+    NetlinkRequest request;
+    setLinkUp(request, "lo");
+    try
+    {
+        sendNetlinkRequest(fd, request);
+    }
+    catch (std::exception& ex)
+    {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    LOG_F(INFO, "Set up loopback interface: SUCCESS");
+}
+
+std::string getSharedNetworkPath(const std::string& rootDir, const std::string& ownerId)
+{
+    return rootDir + "/network/shared/" + ownerId;
+}
+
+/**
+ * Opens the record of the network namespace owned by the given container and takes an
+ * exclusive lock on it, which is released when the returned file descriptor is closed.
+ * The record holds the number of running containers in the namespace ('members'), and
+ * once the owner has exited, the network resources it left behind.
+ */
+int lockSharedNetwork(const std::string& path)
+{
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path());
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        throw std::runtime_error("Open " + path + ": FAILED [Errno " + std::to_string(errno) + "]");
+    if (flock(fd, LOCK_EX) != 0)
+    {
+        close(fd);
+        throw std::runtime_error("Lock " + path + ": FAILED [Errno " + std::to_string(errno) + "]");
+    }
+    return fd;
+}
+
+/**
+ * Releases the network resources which a container in bridge mode holds on the host:
+ * 1. Removes the netfilter rules in 'ruleTable', unless it is empty.
+ * 2. Removes the container from the BPF fast path of its bridge, if enabled.
+ * 3. Releases the container's IPv4 address. The bridge of a shard other than the first
+ * is deleted once its last address has been released, see deleteNetworkDevice().
+ * 4. Deletes the host side of the veth pair and the ifb device shaping its traffic, if
+ * any, unless 'hostInterface' is empty.
+ */
+void releaseNetworkResources(const std::string& rootDir,
+                             const Network& network,
+                             const std::string& ip,
+                             const std::string& hostInterface,
+                             const std::string& ruleTable)
+{
+    if (!ip.empty())
+    {
+        if (!ruleTable.empty())
+            removeContainerRules(ruleTable);
+        if (network.fastPath)
+            disableFastPath(network.bridge, ip);
+        std::function<void()> onUnused;
+        if (network.shardPrefixLength > 0 && network.bridge != getNetworkShard(network, 0).bridge)
+            onUnused = [&network]() { deleteNetworkDevice(network); };
+        releaseIp(rootDir, network, ip, onUnused);
+    }
+    if (hostInterface.empty())
+        return;
+    // The veth pair is usually gone together with the network namespace already
+    int fd = openNetlinkSocket(NETLINK_ROUTE);
+    NetlinkRequest request;
+    deleteLink(request, hostInterface);
+    deleteLink(request, getIfbName(hostInterface));
+    try
+    {
+        sendNetlinkRequest(fd, request, { ENODEV });
+    }
+    catch (std::exception& ex)
+    {
+        close(fd);
+        throw;
+    }
+    close(fd);
+}
+
+/**
+ * Prepares the given container to join the network namespace of the running container
+ * given to --network container:<id>. The namespace is opened in 'networkNamespaceFd',
+ * which the container joins instead of creating its own, so none of its network is set
+ * up. The namespace's record is looked up under the container which created the
+ * namespace (its owner), even if the given container has joined it itself.
+ *
+ * @throw invalid_argument if the given container is not running.
+ */
+void joinContainerNetwork(Container* container)
+{
+    try
+    {
+        std::string targetId = container->networkOwner;
+        pid_t pid = getContainerPid(container->rootDir, targetId);
+        if (pid < 0)
+            throw std::invalid_argument("[ERROR] Container " + targetId + " is not running");
+        auto state = readProperties(container->rootDir + "/containers/" + targetId + "/state");
+        if (state.count("network-owner"))
+            container->networkOwner = state["network-owner"];
+
+        std::string namespacePath = "/proc/" + std::to_string(pid) + "/ns/net";
+        container->networkNamespaceFd = open(namespacePath.c_str(), O_RDONLY | O_CLOEXEC);
+        if (container->networkNamespaceFd < 0)
+            throw std::runtime_error("Open " + namespacePath + ": FAILED [Errno " + std::to_string(errno) + "]");
+
+        std::string path = getSharedNetworkPath(container->rootDir, container->networkOwner);
+        int fd = lockSharedNetwork(path);
+        auto record = readProperties(path);
+        // Without a record, the owner releases its network once it exits, see handOffSharedNetwork(),
+        // so it has to be checked again under the lock before a record is created for it
+        if (!record.count("members") && getContainerPid(container->rootDir, container->networkOwner) < 0)
+        {
+            unlink(path.c_str());
+            close(fd);
+            throw std::invalid_argument("[ERROR] Container " + container->networkOwner + " is not running");
+        }
+        // A new record counts the owner as well
+        int members = record.count("members") ? std::stoi(record["members"]) : 1;
+        record["members"] = std::to_string(members + 1);
+        bool success = writeProperties(path, record);
+        close(fd);
+        if (!success)
+            throw std::runtime_error("Write " + path + ": FAILED");
+        LOG_F(INFO, "Join network of container %s: SUCCESS [%d members]", container->networkOwner.c_str(), members + 1);
+    }
+    catch (std::exception& ex)
+    {
+        // The container has not been counted as a member, so it must not leave the namespace
+        container->networkOwner.clear();
+        throw;
+    }
+}
+
+/**
+ * Removes the given container from the record of the network namespace it has joined.
+ * The last container to leave a namespace whose owner has exited releases the network
+ * resources the owner left behind.
+ */
+void leaveContainerNetwork(Container* container)
+{
+    std::string path = getSharedNetworkPath(container->rootDir, container->networkOwner);
+    if (container->networkOwner.empty() || !std::filesystem::exists(path))
+        return;
+    int fd = lockSharedNetwork(path);
+    try
+    {
+        auto record = readProperties(path);
+        int members = record.count("members") ? std::stoi(record["members"]) - 1 : 0;
+        if (members > 0)
+        {
+            record["members"] = std::to_string(members);
+            if (!writeProperties(path, record))
+                throw std::runtime_error("Write " + path + ": FAILED");
+        }
+        else
+        {
+            if (record.count("ip"))
+            {
+                Network network = parseNetwork(record["bridge"], record["subnet"]);
+                network.fastPath = record["fast-path"] == "1";
+                if (record.count("network"))
+                {
+                    network.name = record["network"];
+                    network.shardPrefixLength = std::stoi(record["shard-prefix"]);
+                }
+                releaseNetworkResources(container->rootDir, network, record["ip"], record["host-interface"],
+                                        record["rule-table"]);
+            }
+            unlink(path.c_str());
+        }
+    }
+    catch (std::exception& ex)
+    {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    LOG_F(INFO, "Leave network of container %s: SUCCESS", container->networkOwner.c_str());
+}
+
+/**
+ * Called when the owner of a network namespace exits. If other containers are still
+ * in its namespace, hands its network resources over to the namespace's record, so
+ * that the last of them releases them, see leaveContainerNetwork().
+ *
+ * @return true if the resources have been handed over, false if they can be released.
+ */
+bool handOffSharedNetwork(Container* container)
+{
+    std::string path = getSharedNetworkPath(container->rootDir, container->id);
+    if (!std::filesystem::exists(path))
+        return false;
+    int fd = lockSharedNetwork(path);
+    auto record = readProperties(path);
+    int members = record.count("members") ? std::stoi(record["members"]) - 1 : 0;
+    if (members <= 0)
+    {
+        unlink(path.c_str());
+        close(fd);
+        return false;
+    }
+
+    record["members"] = std::to_string(members);
+    if (container->networkMode == NetworkBridge && !container->ip.empty())
+    {
+        record["bridge"] = container->network.bridge;
+        record["subnet"] = getSubnetString(container->network);
+        record["ip"] = container->ip;
+        record["host-interface"] = container->vEthPair.second;
+        record["rule-table"] = hasContainerRules(container) ? getContainerTableName(container) : "";
+        record["fast-path"] = container->network.fastPath ? "1" : "0";
+        record["network"] = container->network.name;
+        record["shard-prefix"] = std::to_string(container->network.shardPrefixLength);
+    }
+    bool success = writeProperties(path, record);
+    close(fd);
+    if (!success)
+        throw std::runtime_error("Write " + path + ": FAILED");
+    LOG_F(INFO, "Hand off network to %d remaining members: SUCCESS", members);
+    return true;
+}
+
+/**
+ * Cleans up the networking environment of the given container:
+ * - A container which has joined another container's network namespace leaves it,
+ * see leaveContainerNetwork().
+ * - A container whose namespace has been joined by running containers hands its
+ * network resources over to them, see handOffSharedNetwork().
+ * - Otherwise, a container in bridge mode releases its network resources, see
+ * releaseNetworkResources().
+ */
+void cleanUpContainerNetwork(Container* container)
+{
+    LOG_F(INFO, "Cleaning up container network environment");
+
+    if (container->networkMode == NetworkContainer)
+    {
+        leaveContainerNetwork(container);
+        return;
+    }
+    if (handOffSharedNetwork(container) || container->networkMode != NetworkBridge)
+        return;
+    releaseNetworkResources(container->rootDir, container->network, container->ip, container->vEthPair.second,
+                            hasContainerRules(container) ? getContainerTableName(container) : "");
+    container->ip.clear();
+
+    LOG_F(INFO, "Clean up container network environment: SUCCESS");
+}
+
+/**
+ * Binds the sockets given to --listen on the host, where TCP sockets start listening
+ * right away. Connections which arrive while the container is being set up are queued
+ * in the backlog and accepted by the container once it has started.
+ *
+ * @throw runtime_error if a socket cannot be bound, e.g. if its port is in use.
+ */
+void openListenSockets(std::vector<ListenSocket>& sockets)
+{
+    for (auto& listenSocket : sockets)
+    {
+        std::string endpoint = listenSocket.address + ":" + std::to_string(listenSocket.port) +
+                               (listenSocket.protocol == IPPROTO_UDP ? "/udp" : "/tcp");
+        bool isTcp = listenSocket.protocol == IPPROTO_TCP;
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(listenSocket.port);
+        inet_pton(AF_INET, listenSocket.address.c_str(), &address.sin_addr);
+        int enable = 1;
+        listenSocket.fd = socket(AF_INET, (isTcp ? SOCK_STREAM : SOCK_DGRAM) | SOCK_CLOEXEC, 0);
+        if (listenSocket.fd < 0 ||
+            setsockopt(listenSocket.fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) != 0 ||
+            bind(listenSocket.fd, (sockaddr*) &address, sizeof(address)) != 0 ||
+            (isTcp && listen(listenSocket.fd, SOMAXCONN) != 0))
+        {
+            int error = errno;
+            for (auto& openedSocket : sockets)
+            {
+                if (openedSocket.fd >= 0)
+                    close(openedSocket.fd);
+                openedSocket.fd = -1;
+            }
+            throw std::runtime_error("Bind socket " + endpoint + ": FAILED [Errno " + std::to_string(error) + "]");
+        }
+        LOG_F(INFO, "Bind socket %s: SUCCESS", endpoint.c_str());
+    }
+}
+
+/**
+ * Blocks until one of the given sockets becomes readable, i.e. a connection is
+ * pending on a TCP socket or a datagram has arrived on a UDP socket. Nothing is
+ * accepted or read, so that the container receives the first request itself.
+ */
+void waitForConnection(const std::vector<ListenSocket>& sockets)
+{
+    std::vector<pollfd> pollFds;
+    for (const auto& listenSocket : sockets)
+        pollFds.push_back(pollfd { listenSocket.fd, POLLIN, 0 });
+    while (poll(pollFds.data(), pollFds.size(), -1) < 0)
+    {
+        if (errno != EINTR)
+            throw std::runtime_error("Wait for connection: FAILED [Errno " + std::to_string(errno) + "]");
+    }
+    LOG_F(INFO, "Wait for connection: SUCCESS");
+}
+
+/**
+ * Returns the networks which hold the addresses of the given network: its shards if
+ * it is sharded, or the network itself otherwise.
+ */
+std::vector<Network> getNetworkShards(const Network& network)
+{
+    if (network.shardPrefixLength == 0)
+        return { network };
+    std::vector<Network> shards;
+    for (uint32_t i = 0; i < getShardCount(network); i++)
+        shards.push_back(getNetworkShard(network, i));
+    return shards;
+}
+
+/**
+ * Creates the network 'name' with the given subnet in CIDR notation and stores it in
+ * <root-dir>/network/networks/<name>, from where --bridge <name> attaches containers
+ * to it. Its bridges are created by the first container attached to them.
+ * - 'gateway': the address of the bridge, by default the first host address.
+ * - 'shardPrefixLength': if not 0, the network is split into subnets of this prefix
+ * length, each on a bridge <name>-<n> of its own with its first host address as gateway.
+ *
+ * @throw invalid_argument if the network exists, a parameter is invalid, the subnet
+ * overlaps with the subnet of another network or of a bridge in use, or one of its
+ * bridges is in use already.
+ */
+void createNetwork(const std::string& rootDir, const std::string& name, const std::string& subnet,
+                   const std::string& gateway, int shardPrefixLength)
+{
+    if (networkExists(rootDir, name))
+        throw std::invalid_argument("[ERROR] Network " + name + " already exists");
+    Network network = parseNetwork(name, subnet);
+    uint64_t addressCount = 1ull << (32 - network.prefixLength);
+    if (!gateway.empty())
+    {
+        if (shardPrefixLength > 0)
+            throw std::invalid_argument("[ERROR] The gateway of each shard is the first host address of the shard");
+        uint32_t address = ipToInteger(gateway);
+        if (address <= network.subnet || address >= network.subnet + addressCount - 1)
+            throw std::invalid_argument("[ERROR] Gateway " + gateway + " is not a host address in subnet " +
+                                        getSubnetString(network));
+        network.gateway = integerToIp(address);
+    }
+    if (shardPrefixLength > 0)
+    {
+        // Limits the number of shards a launch may have to try
+        int maxPrefixLength = std::min(network.prefixLength + 12, 30);
+        if (shardPrefixLength <= network.prefixLength || shardPrefixLength > maxPrefixLength)
+            throw std::invalid_argument("[ERROR] The shard prefix length has to be between " +
+                                        std::to_string(network.prefixLength + 1) + " and " +
+                                        std::to_string(maxPrefixLength));
+        network.shardPrefixLength = shardPrefixLength;
+        std::string lastBridge = getNetworkShard(network, getShardCount(network) - 1).bridge;
+        if (lastBridge.size() >= IFNAMSIZ)
+            throw std::invalid_argument("[ERROR] Network name " + name + " is too long for bridge " + lastBridge);
+    }
+    for (const auto& other : listNetworks(rootDir))
+    {
+        uint32_t mask = ~0u << (32 - std::min(network.prefixLength, other.prefixLength));
+        if ((network.subnet & mask) == (other.subnet & mask))
+            throw std::invalid_argument("[ERROR] Subnet " + subnet + " overlaps with network " + other.name + " (" +
+                                        getSubnetString(other) + ")");
+    }
+    // Bridges used without 'network create', including the default bridge, keep their subnets as well
+    std::set<std::string> bridges;
+    for (const auto& shard : getNetworkShards(network))
+        bridges.insert(shard.bridge);
+    auto usedBridges = listIpamNetworks(rootDir);
+    usedBridges.push_back(parseNetwork(BRIDGE_NAME, DEFAULT_SUBNET));
+    for (const auto& other : usedBridges)
+    {
+        if (bridges.count(other.bridge))
+            throw std::invalid_argument("[ERROR] Bridge " + other.bridge + " already uses subnet " +
+                                        getSubnetString(other));
+        uint32_t mask = ~0u << (32 - std::min(network.prefixLength, other.prefixLength));
+        if ((network.subnet & mask) == (other.subnet & mask))
+            throw std::invalid_argument("[ERROR] Subnet " + subnet + " overlaps with bridge " + other.bridge + " (" +
+                                        getSubnetString(other) + ")");
+    }
+
+    saveNetwork(rootDir, network);
+    LOG_F(INFO, "Create network %s: SUCCESS", name.c_str());
+    std::cout << "Created network " << name << std::endl;
+}
+
+/**
+ * Removes the network 'name' created with createNetwork(), which performs the following actions:
+ * 1. Removes the namespaces kept in its network pool, see drainNetworkPool(), and checks
+ * that none of its addresses is in use by a container.
+ * 2. Deletes its definition, so that no container is attached to it anymore.
+ * 3. Deletes the bridges of the network, see deleteNetworkDevice(), together with
+ * their allocation state.
+ * 4. Deletes its connection tracking exemption, if any.
+ *
+ * @throw invalid_argument if the network does not exist or is in use.
+ */
+void removeNetwork(const std::string& rootDir, const std::string& name)
+{
+    Network network = loadNetwork(rootDir, name);
+    auto shards = getNetworkShards(network);
+    uint64_t usedCount = 0;
+    for (const auto& shard : shards)
+    {
+        // The addresses held by the network pool are not in use by any container
+        drainNetworkPool(rootDir, shard);
+        usedCount += countAllocatedIps(rootDir, shard);
+    }
+    if (usedCount > 0)
+        throw std::invalid_argument("[ERROR] Network " + name + " has " + std::to_string(usedCount) +
+                                    " addresses in use by containers");
+
+    deleteNetworkDefinition(rootDir, name);
+    for (const auto& shard : shards)
+    {
+        // A container launched before the definition was deleted keeps its bridge
+        if (!deleteIpamFile(rootDir, shard, [&shard]() { deleteNetworkDevice(shard); }))
+            LOG_F(WARNING, "Delete network device %s: FAILED [in use]", shard.bridge.c_str());
+    }
+    deleteNetfilterTable("kapsel-notrack-" + name);
+    for (const auto& shard : shards)
+        std::filesystem::remove_all(rootDir + "/network/pool/" + shard.bridge);
+    LOG_F(INFO, "Remove network %s: SUCCESS", name.c_str());
+    std::cout << "Removed network " << name << std::endl;
+}
+
+/**
+ * Displays the networks created with createNetwork(), with the number of their bridges
+ * which currently exist and of their addresses in use.
+ */
+void printNetworks(const std::string& rootDir)
+{
+    printf("%-15s  %-18s  %-15s  %-10s  %7s  %9s\n", "Name", "Subnet", "Gateway", "Shards", "Bridges", "Addresses");
+    for (const auto& network : listNetworks(rootDir))
+    {
+        int bridgeCount = 0;
+        uint64_t usedCount = 0;
+        for (const auto& shard : getNetworkShards(network))
+        {
+            if (std::filesystem::exists("/sys/class/net/" + shard.bridge))
+                bridgeCount++;
+            usedCount += countAllocatedIps(rootDir, shard);
+        }
+        bool sharded = network.shardPrefixLength > 0;
+        std::string shards = sharded ? std::to_string(getShardCount(network)) + " x /" +
+                                       std::to_string(network.shardPrefixLength) : "-";
+        printf("%-15s  %-18s  %-15s  %-10s  %7d  %9lu\n", network.name.c_str(), getSubnetString(network).c_str(),
+               sharded ? "-" : network.gateway.c_str(), shards.c_str(), bridgeCount, (unsigned long) usedCount);
+    }
+}
@@ -0,0 +1,23 @@
+#ifndef CONTAINER_CPP_NETWORK_H
+#define CONTAINER_CPP_NETWORK_H
+
+#include "container.h"
+
+void reserveContainerNetwork(Container* container);
+void joinContainerNetwork(Container* container);
+void replenishNetworkPool(const std::string& rootDir, const Network& network, int size);
+void initializeContainerNetwork(Container* container, int namespaceFd);
+void signalNetworkStatus(Container* container, uint64_t status);
+void startDnsForwarder(Container* container);
+void stopDnsForwarder(Container* container);
+void setUpLoopback();
+void cleanUpContainerNetwork(Container* container);
+uint64_t parseRate(const std::string& rate);
+void openListenSockets(std::vector<ListenSocket>& sockets);
+void waitForConnection(const std::vector<ListenSocket>& sockets);
+void createNetwork(const std::string& rootDir, const std::string& name, const std::string& subnet,
+                   const std::string& gateway, int shardPrefixLength);
+void removeNetwork(const std::string& rootDir, const std::string& name);
+void printNetworks(const std::string& rootDir);
+
+#endif //CONTAINER_CPP_NETWORK_H
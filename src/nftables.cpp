@@ -0,0 +1,257 @@
+#include <string>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nf_tables.h>
+
+#include "nftables.h"
+
+/**
+ * Adds an attribute holding a 32-bit integer in network byte order, which is how
+ * nftables expects all of its integer attributes.
+ */
+void addBigEndianU32Attribute(NetlinkRequest& request, uint16_t type, uint32_t value)
+{
+    addU32Attribute(request, type, htonl(value));
+}
+
+/**
+ * Starts a new nftables message on a table of the ip family.
+ */
+void beginNftablesMessage(NetlinkRequest& request, uint16_t type, uint16_t flags)
+{
+    nfgenmsg header{};
+    header.nfgen_family = NFPROTO_IPV4;
+    header.version = NFNETLINK_V0;
+    beginNetlinkMessage(request, (NFNL_SUBSYS_NFTABLES << 8) | type, flags, &header, sizeof(header));
+}
+
+/**
+ * Adds one of the messages enclosing a batch. Unlike the messages in the batch,
+ * these are not acknowledged by kernels before Linux 6.10, so no ACK is requested.
+ */
+void addBatchMessage(NetlinkRequest& request, uint16_t type)
+{
+    nfgenmsg header{};
+    header.nfgen_family = AF_UNSPEC;
+    header.version = NFNETLINK_V0;
+    header.res_id = htons(NFNL_SUBSYS_NFTABLES);
+    beginNetlinkMessage(request, type, 0, &header, sizeof(header));
+    ((nlmsghdr*) (request.buffer.data() + request.messageOffset))->nlmsg_flags = NLM_F_REQUEST;
+}
+
+/**
+ * Starts a batch of nftables messages. nftables only accepts changes in a batch,
+ * which is either applied as a whole or not at all. Every batch has to be closed
+ * with endNftablesBatch().
+ */
+void beginNftablesBatch(NetlinkRequest& request)
+{
+    addBatchMessage(request, NFNL_MSG_BATCH_BEGIN);
+}
+
+void endNftablesBatch(NetlinkRequest& request)
+{
+    addBatchMessage(request, NFNL_MSG_BATCH_END);
+}
+
+void addNftablesTable(NetlinkRequest& request, const std::string& table)
+{
+    beginNftablesMessage(request, NFT_MSG_NEWTABLE, NLM_F_CREATE);
+    addStringAttribute(request, NFTA_TABLE_NAME, table);
+}
+
+/**
+ * Adds a message which deletes a table together with all of its chains and rules.
+ */
+void deleteNftablesTable(NetlinkRequest& request, const std::string& table)
+{
+    beginNftablesMessage(request, NFT_MSG_DELTABLE, 0);
+    addStringAttribute(request, NFTA_TABLE_NAME, table);
+}
+
+/**
+ * Adds a message which creates a base chain attached to a netfilter hook.
+ *
+ * @param type the chain type, e.g. "nat" or "filter".
+ * @param hook the netfilter hook, e.g. NF_INET_PRE_ROUTING.
+ * @param priority the priority of the chain in the hook, e.g. NF_IP_PRI_NAT_DST.
+ */
+void addNftablesChain(NetlinkRequest& request, const std::string& table, const std::string& chain,
+                      const std::string& type, uint32_t hook, int32_t priority)
+{
+    beginNftablesMessage(request, NFT_MSG_NEWCHAIN, NLM_F_CREATE);
+    addStringAttribute(request, NFTA_CHAIN_TABLE, table);
+    addStringAttribute(request, NFTA_CHAIN_NAME, chain);
+    beginNestedAttribute(request, NLA_F_NESTED | NFTA_CHAIN_HOOK);
+    addBigEndianU32Attribute(request, NFTA_HOOK_HOOKNUM, hook);
+    addBigEndianU32Attribute(request, NFTA_HOOK_PRIORITY, (uint32_t) priority);
+    endNestedAttribute(request);
+    addStringAttribute(request, NFTA_CHAIN_TYPE, type);
+}
+
+/**
+ * Starts a message which appends a rule to a chain. The expressions added until
+ * the matching call to endNftablesRule() are evaluated in order, where a comparison
+ * which does not match ends the evaluation of the rule.
+ */
+void beginNftablesRule(NetlinkRequest& request, const std::string& table, const std::string& chain)
+{
+    beginNftablesMessage(request, NFT_MSG_NEWRULE, NLM_F_CREATE | NLM_F_APPEND);
+    addStringAttribute(request, NFTA_RULE_TABLE, table);
+    addStringAttribute(request, NFTA_RULE_CHAIN, chain);
+    beginNestedAttribute(request, NLA_F_NESTED | NFTA_RULE_EXPRESSIONS);
+}
+
+void endNftablesRule(NetlinkRequest& request)
+{
+    endNestedAttribute(request);
+}
+
+void beginExpression(NetlinkRequest& request, const std::string& name)
+{
+    beginNestedAttribute(request, NLA_F_NESTED | NFTA_LIST_ELEM);
+    addStringAttribute(request, NFTA_EXPR_NAME, name);
+    beginNestedAttribute(request, NLA_F_NESTED | NFTA_EXPR_DATA);
+}
+
+void endExpression(NetlinkRequest& request)
+{
+    endNestedAttribute(request);
+    endNestedAttribute(request);
+}
+
+/**
+ * Adds an expression which loads packet metadata (e.g. NFT_META_L4PROTO) into a register.
+ */
+void addMetaExpression(NetlinkRequest& request, uint32_t key, uint32_t registerIndex)
+{
+    beginExpression(request, "meta");
+    addBigEndianU32Attribute(request, NFTA_META_KEY, key);
+    addBigEndianU32Attribute(request, NFTA_META_DREG, registerIndex);
+    endExpression(request);
+}
+
+/**
+ * Adds an expression which sets packet metadata (e.g. NFT_META_PRIORITY) to the
+ * value of a register.
+ */
+void addMetaSetExpression(NetlinkRequest& request, uint32_t key, uint32_t registerIndex)
+{
+    beginExpression(request, "meta");
+    addBigEndianU32Attribute(request, NFTA_META_KEY, key);
+    addBigEndianU32Attribute(request, NFTA_META_SREG, registerIndex);
+    endExpression(request);
+}
+
+/**
+ * Adds an expression which loads 'length' bytes at 'offset' from the given header
+ * (e.g. NFT_PAYLOAD_TRANSPORT_HEADER) into a register.
+ */
+void addPayloadExpression(NetlinkRequest& request, uint32_t base, uint32_t offset, uint32_t length,
+                          uint32_t registerIndex)
+{
+    beginExpression(request, "payload");
+    addBigEndianU32Attribute(request, NFTA_PAYLOAD_DREG, registerIndex);
+    addBigEndianU32Attribute(request, NFTA_PAYLOAD_BASE, base);
+    addBigEndianU32Attribute(request, NFTA_PAYLOAD_OFFSET, offset);
+    addBigEndianU32Attribute(request, NFTA_PAYLOAD_LEN, length);
+    endExpression(request);
+}
+
+/**
+ * Adds an expression which loads the route type of the packet's destination address
+ * (e.g. RTN_LOCAL) into a register as a 32-bit integer in host byte order.
+ */
+void addAddressTypeExpression(NetlinkRequest& request, uint32_t registerIndex)
+{
+    beginExpression(request, "fib");
+    addBigEndianU32Attribute(request, NFTA_FIB_DREG, registerIndex);
+    addBigEndianU32Attribute(request, NFTA_FIB_RESULT, NFT_FIB_RESULT_ADDRTYPE);
+    addBigEndianU32Attribute(request, NFTA_FIB_FLAGS, NFTA_FIB_F_DADDR);
+    endExpression(request);
+}
+
+/**
+ * Adds an expression which computes (register & mask) ^ xor over 'size' bytes of a
+ * register, e.g. to reduce an address to its network address.
+ */
+void addBitwiseExpression(NetlinkRequest& request, uint32_t registerIndex, const void* mask, const void* xorData,
+                          size_t size)
+{
+    beginExpression(request, "bitwise");
+    addBigEndianU32Attribute(request, NFTA_BITWISE_SREG, registerIndex);
+    addBigEndianU32Attribute(request, NFTA_BITWISE_DREG, registerIndex);
+    addBigEndianU32Attribute(request, NFTA_BITWISE_LEN, (uint32_t) size);
+    beginNestedAttribute(request, NLA_F_NESTED | NFTA_BITWISE_MASK);
+    addAttribute(request, NFTA_DATA_VALUE, mask, size);
+    endNestedAttribute(request);
+    beginNestedAttribute(request, NLA_F_NESTED | NFTA_BITWISE_XOR);
+    addAttribute(request, NFTA_DATA_VALUE, xorData, size);
+    endNestedAttribute(request);
+    endExpression(request);
+}
+
+/**
+ * Adds an expression which ends the evaluation of the rule unless the register
+ * holds the given data, or with NFT_CMP_NEQ as 'op', unless it holds other data.
+ */
+void addCmpExpression(NetlinkRequest& request, uint32_t registerIndex, const void* data, size_t size, uint32_t op)
+{
+    beginExpression(request, "cmp");
+    addBigEndianU32Attribute(request, NFTA_CMP_SREG, registerIndex);
+    addBigEndianU32Attribute(request, NFTA_CMP_OP, op);
+    beginNestedAttribute(request, NLA_F_NESTED | NFTA_CMP_DATA);
+    addAttribute(request, NFTA_DATA_VALUE, data, size);
+    endNestedAttribute(request);
+    endExpression(request);
+}
+
+/**
+ * Adds an expression which loads the given data into a register.
+ */
+void addImmediateExpression(NetlinkRequest& request, uint32_t registerIndex, const void* data, size_t size)
+{
+    beginExpression(request, "immediate");
+    addBigEndianU32Attribute(request, NFTA_IMMEDIATE_DREG, registerIndex);
+    beginNestedAttribute(request, NLA_F_NESTED | NFTA_IMMEDIATE_DATA);
+    addAttribute(request, NFTA_DATA_VALUE, data, size);
+    endNestedAttribute(request);
+    endExpression(request);
+}
+
+/**
+ * Adds an expression which rewrites the packet's destination to the IPv4 address
+ * and the port held by the given registers.
+ */
+void addDnatExpression(NetlinkRequest& request, uint32_t addressRegister, uint32_t portRegister)
+{
+    beginExpression(request, "nat");
+    addBigEndianU32Attribute(request, NFTA_NAT_TYPE, NFT_NAT_DNAT);
+    addBigEndianU32Attribute(request, NFTA_NAT_FAMILY, NFPROTO_IPV4);
+    addBigEndianU32Attribute(request, NFTA_NAT_REG_ADDR_MIN, addressRegister);
+    addBigEndianU32Attribute(request, NFTA_NAT_REG_PROTO_MIN, portRegister);
+    endExpression(request);
+}
+
+/**
+ * Adds an expression which rewrites the packet's source to the address of the
+ * interface it leaves through.
+ */
+void addMasqueradeExpression(NetlinkRequest& request)
+{
+    beginNestedAttribute(request, NLA_F_NESTED | NFTA_LIST_ELEM);
+    addStringAttribute(request, NFTA_EXPR_NAME, "masq");
+    endNestedAttribute(request);
+}
+
+/**
+ * Adds an expression which exempts the packet from connection tracking.
+ */
+void addNotrackExpression(NetlinkRequest& request)
+{
+    beginNestedAttribute(request, NLA_F_NESTED | NFTA_LIST_ELEM);
+    addStringAttribute(request, NFTA_EXPR_NAME, "notrack");
+    endNestedAttribute(request);
+}
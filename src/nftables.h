@@ -0,0 +1,37 @@
+#ifndef CONTAINER_CPP_NFTABLES_H
+#define CONTAINER_CPP_NFTABLES_H
+
+#include <string>
+#include <cstdint>
+#include <linux/netfilter/nf_tables.h>
+
+#include "netlink.h"
+
+// Batches, which the kernel applies atomically
+void beginNftablesBatch(NetlinkRequest& request);
+void endNftablesBatch(NetlinkRequest& request);
+
+// Tables, chains and rules of the ip family
+void addNftablesTable(NetlinkRequest& request, const std::string& table);
+void deleteNftablesTable(NetlinkRequest& request, const std::string& table);
+void addNftablesChain(NetlinkRequest& request, const std::string& table, const std::string& chain,
+                      const std::string& type, uint32_t hook, int32_t priority);
+void beginNftablesRule(NetlinkRequest& request, const std::string& table, const std::string& chain);
+void endNftablesRule(NetlinkRequest& request);
+
+// Expressions of the rule which is being built
+void addMetaExpression(NetlinkRequest& request, uint32_t key, uint32_t registerIndex);
+void addMetaSetExpression(NetlinkRequest& request, uint32_t key, uint32_t registerIndex);
+void addPayloadExpression(NetlinkRequest& request, uint32_t base, uint32_t offset, uint32_t length,
+                          uint32_t registerIndex);
+void addAddressTypeExpression(NetlinkRequest& request, uint32_t registerIndex);
+void addBitwiseExpression(NetlinkRequest& request, uint32_t registerIndex, const void* mask, const void* xorData,
+                          size_t size);
+void addCmpExpression(NetlinkRequest& request, uint32_t registerIndex, const void* data, size_t size,
+                      uint32_t op = NFT_CMP_EQ);
+void addImmediateExpression(NetlinkRequest& request, uint32_t registerIndex, const void* data, size_t size);
+void addDnatExpression(NetlinkRequest& request, uint32_t addressRegister, uint32_t portRegister);
+void addMasqueradeExpression(NetlinkRequest& request);
+void addNotrackExpression(NetlinkRequest& request);
+
+#endif //CONTAINER_CPP_NFTABLES_H
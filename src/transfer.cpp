@@ -0,0 +1,343 @@
+#include <string>
+#include <iostream>
+#include <filesystem>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <linux/openat2.h>
+#include <loguru/loguru.hpp>
+
+#include "container.h"
+#include "image.h"
+#include "transfer.h"
+#include "utils.h"
+
+/**
+ * A struct representing a path given to the 'cp' command, which is either
+ * a path on the host or a path inside a running container.
+ */
+struct CopyLocation
+{
+    // PID of the container, -1 if the path is on the host
+    pid_t pid;
+    std::string path;
+};
+
+/**
+ * Parses a path given to the 'cp' command. A path of the form <container-id>:<path>
+ * refers to a path inside the running container with the given ID.
+ */
+CopyLocation parseCopyLocation(const std::string& rootDir, const std::string& location)
+{
+    size_t pos = location.find(':');
+    if (pos == std::string::npos)
+        return CopyLocation { -1, location };
+
+    std::string containerId = location.substr(0, pos);
+    pid_t pid = getContainerPid(rootDir, containerId);
+    if (pid < 0)
+        throw std::runtime_error("[ERROR] Container " + containerId + " is not running");
+    return CopyLocation { pid, location.substr(pos + 1) };
+}
+
+/**
+ * Opens the directory which contains the given location. Paths inside a container are
+ * resolved with openat2() and RESOLVE_IN_ROOT relative to /proc/<pid>/root, so that
+ * symlinks created in the container cannot point to files on the host.
+ *
+ * @return a file descriptor of the parent directory.
+ */
+int openParentDir(const CopyLocation& location)
+{
+    std::string parent = std::filesystem::path(location.path).parent_path();
+    if (parent.empty())
+        parent = ".";
+
+    if (location.pid < 0)
+        return open(parent.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+
+    std::string containerRoot = "/proc/" + std::to_string(location.pid) + "/root";
+    int rootFd = open(containerRoot.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (rootFd < 0)
+        return -1;
+
+    struct open_how how{};
+    how.flags = O_PATH | O_DIRECTORY | O_CLOEXEC;
+    how.resolve = RESOLVE_IN_ROOT;
+    int fd = (int) syscall(SYS_openat2, rootFd, parent.c_str(), &how, sizeof(how));
+    close(rootFd);
+    return fd;
+}
+
+/**
+ * Recursively copies the entry 'sourceName' in the directory 'sourceDirFd' to
+ * 'destName' in the directory 'destDirFd'. Symlinks are never followed, and the
+ * mode and ownership of each entry are preserved. The content of regular files
+ * is copied with copyFileContents(), i.e. with reflinks or copy_file_range().
+ */
+void copyEntry(int sourceDirFd, const std::string& sourceName, int destDirFd, const std::string& destName)
+{
+    struct stat attr{};
+    if (fstatat(sourceDirFd, sourceName.c_str(), &attr, AT_SYMLINK_NOFOLLOW) != 0)
+        throw std::runtime_error("Stat " + sourceName + ": FAILED [Errno " + std::to_string(errno) + "]");
+
+    if (S_ISDIR(attr.st_mode))
+    {
+        if (mkdirat(destDirFd, destName.c_str(), attr.st_mode & 07777) != 0 && errno != EEXIST)
+            throw std::runtime_error("Create directory " + destName + ": FAILED [Errno " + std::to_string(errno) + "]");
+
+        int sourceFd = openat(sourceDirFd, sourceName.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        int destFd = openat(destDirFd, destName.c_str(), O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        DIR* dir = sourceFd < 0 ? nullptr : fdopendir(sourceFd);
+        if (dir == nullptr || destFd < 0)
+        {
+            if (dir == nullptr && sourceFd >= 0)
+                close(sourceFd);
+            if (destFd >= 0)
+                close(destFd);
+            throw std::runtime_error("Open directory " + sourceName + ": FAILED [Errno " + std::to_string(errno) + "]");
+        }
+
+        try
+        {
+            while (struct dirent* entry = readdir(dir))
+            {
+                std::string name = entry->d_name;
+                if (name != "." && name != "..")
+                    copyEntry(dirfd(dir), name, destFd, name);
+            }
+        }
+        catch (std::exception& ex)
+        {
+            closedir(dir);
+            close(destFd);
+            throw;
+        }
+        closedir(dir);
+        close(destFd);
+    }
+    else if (S_ISREG(attr.st_mode))
+    {
+        int sourceFd = openat(sourceDirFd, sourceName.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (sourceFd < 0)
+            throw std::runtime_error("Open " + sourceName + ": FAILED [Errno " + std::to_string(errno) + "]");
+        int destFd = openat(destDirFd, destName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+                            attr.st_mode & 07777);
+        if (destFd < 0)
+        {
+            close(sourceFd);
+            throw std::runtime_error("Open " + destName + ": FAILED [Errno " + std::to_string(errno) + "]");
+        }
+
+        try
+        {
+            copyFileContents(sourceFd, destFd);
+        }
+        catch (std::exception& ex)
+        {
+            close(sourceFd);
+            close(destFd);
+            throw;
+        }
+        close(sourceFd);
+        close(destFd);
+    }
+    else if (S_ISLNK(attr.st_mode))
+    {
+        std::string target(attr.st_size + 1, '\0');
+        ssize_t length = readlinkat(sourceDirFd, sourceName.c_str(), target.data(), target.size());
+        if (length < 0)
+            throw std::runtime_error("Read link " + sourceName + ": FAILED [Errno " + std::to_string(errno) + "]");
+        target.resize(length);
+        unlinkat(destDirFd, destName.c_str(), 0);
+        if (symlinkat(target.c_str(), destDirFd, destName.c_str()) != 0)
+            throw std::runtime_error("Create symlink " + destName + ": FAILED [Errno " + std::to_string(errno) + "]");
+    }
+    else
+    {
+        if (mknodat(destDirFd, destName.c_str(), attr.st_mode, attr.st_rdev) != 0 && errno != EEXIST)
+            throw std::runtime_error("Create node " + destName + ": FAILED [Errno " + std::to_string(errno) + "]");
+    }
+
+    fchownat(destDirFd, destName.c_str(), attr.st_uid, attr.st_gid, AT_SYMLINK_NOFOLLOW);
+}
+
+/**
+ * Copies files or directories between the host and a running container, or between
+ * two running containers. Either path may have the form <container-id>:<path>.
+ * As with 'cp -r', if the destination is an existing directory, the source is copied
+ * into it. The data is copied directly between the file systems with reflinks or
+ * copy_file_range(), so neither an image build nor a temporary archive is needed.
+ */
+void copyFiles(const std::string& rootDir, const std::string& source, const std::string& dest)
+{
+    auto sourceLocation = parseCopyLocation(rootDir, source);
+    auto destLocation = parseCopyLocation(rootDir, dest);
+
+    std::string sourceName = std::filesystem::path(sourceLocation.path).filename();
+    if (sourceName.empty() || sourceName == ".")
+        sourceName = std::filesystem::path(sourceLocation.path).parent_path().filename();
+    std::string destName = std::filesystem::path(destLocation.path).filename();
+
+    int sourceDirFd = openParentDir(sourceLocation);
+    if (sourceDirFd < 0)
+        throw std::runtime_error("[ERROR] Open " + source + ": FAILED [Errno " + std::to_string(errno) + "]");
+    int destDirFd = openParentDir(destLocation);
+    if (destDirFd < 0)
+    {
+        close(sourceDirFd);
+        throw std::runtime_error("[ERROR] Open " + dest + ": FAILED [Errno " + std::to_string(errno) + "]");
+    }
+
+    // Copies into the destination if it is an existing directory. A symlink is not followed,
+    // since an absolute one would be resolved against the host's root instead of the container's
+    struct stat attr{};
+    if (destName.empty() || destName == "." ||
+        (fstatat(destDirFd, destName.c_str(), &attr, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(attr.st_mode)))
+    {
+        int dirFd = destName.empty() ? dup(destDirFd) :
+                openat(destDirFd, destName.c_str(), O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        int error = errno;
+        close(destDirFd);
+        if (dirFd < 0)
+        {
+            close(sourceDirFd);
+            throw std::runtime_error("[ERROR] Open " + dest + ": FAILED [Errno " + std::to_string(error) + "]");
+        }
+        destDirFd = dirFd;
+        destName = sourceName;
+    }
+
+    LOG_F(INFO, "Copying %s to %s", source.c_str(), dest.c_str());
+    try
+    {
+        copyEntry(sourceDirFd, sourceName, destDirFd, destName);
+    }
+    catch (std::exception& ex)
+    {
+        close(sourceDirFd);
+        close(destDirFd);
+        throw;
+    }
+    close(sourceDirFd);
+    close(destDirFd);
+    LOG_F(INFO, "Copy %s to %s: SUCCESS", source.c_str(), dest.c_str());
+}
+
+/**
+ * Writes an uncompressed tarball of a container's rootfs or of an image to stdout.
+ * - For a running container, archives /proc/<pid>/root. '--one-file-system' skips
+ * /proc, /sys, /dev and the volumes mounted in the container.
+ * - For a layered image, mounts its layers as a read-only overlay fs in a private
+ * mount namespace so that the merged rootfs is streamed without being flattened
+ * on disk first.
+ * - For a tarball image, decompresses the archive.
+ * tar writes to the stdout of kapsel directly, hence the data is never copied
+ * through kapsel itself nor staged in a temporary file.
+ */
+void exportRootfs(const std::string& rootDir, const std::string& id)
+{
+    pid_t pid = getContainerPid(rootDir, id);
+    std::string archive = rootDir + "/images/" + id + ".tar.gz";
+    std::string manifestPath = getImageManifestPath(rootDir, id);
+    std::string command;
+
+    if (pid > 0)
+    {
+        command = "tar --one-file-system -cf - -C /proc/" + std::to_string(pid) + "/root .";
+    }
+    else if (std::filesystem::exists(archive))
+    {
+        command = "gzip -dc " + archive;
+    }
+    else if (std::filesystem::exists(manifestPath))
+    {
+        auto lowerDirs = getLowerDirs(rootDir, readManifest(manifestPath));
+        std::string exportDir = lowerDirs.front();
+        // A read-only overlay fs requires at least two lower-dirs
+        if (lowerDirs.size() > 1)
+        {
+            if (unshare(CLONE_NEWNS) != 0 || mount("/", "/", nullptr, MS_PRIVATE | MS_REC, nullptr) != 0)
+                throw std::runtime_error("Create mount namespace: FAILED [Errno " + std::to_string(errno) + "]");
+
+            exportDir = rootDir + "/containers/.export-" + id;
+            std::filesystem::create_directories(exportDir);
+            std::string mountData = "lowerdir=";
+            for (size_t i = 0; i < lowerDirs.size(); i++)
+                mountData += (i == 0 ? "" : ":") + lowerDirs[i];
+            if (mount("overlay", exportDir.c_str(), "overlay", MS_RDONLY, mountData.c_str()) != 0)
+            {
+                std::filesystem::remove(exportDir);
+                throw std::runtime_error("Mount overlay fs: FAILED [Errno " + std::to_string(errno) + "]");
+            }
+        }
+        command = "tar -cf - -C " + exportDir + " .";
+    }
+    else
+    {
+        throw std::runtime_error("[ERROR] No running container or image with ID " + id);
+    }
+
+    LOG_F(INFO, "Exporting %s", id.c_str());
+    int status = system(command.c_str());
+    std::string exportDir = rootDir + "/containers/.export-" + id;
+    if (std::filesystem::exists(exportDir))
+    {
+        umount2(exportDir.c_str(), MNT_DETACH);
+        std::filesystem::remove(exportDir);
+    }
+    if (status != 0)
+        throw std::runtime_error("Export " + id + ": FAILED");
+    LOG_F(INFO, "Export %s: SUCCESS", id.c_str());
+}
+
+/**
+ * Creates a layered image with the given ID from a tarball of a rootfs (e.g. one
+ * produced by 'export'). The archive is read from the given file, or from stdin if
+ * it is '-', and extracted straight into a new layer in <root-dir>/layers, hence
+ * no temporary copy of the archive is written. The layer is extracted into
+ * <layer>.partial and only renamed once the manifest of the image is written. Tarballs produced with 'docker save'
+ * or in the OCI image layout are imported with importLayeredArchive().
+ */
+void importImage(const std::string& rootDir, const std::string& imageId, const std::string& archive)
+{
+    std::string manifestPath = getImageManifestPath(rootDir, imageId);
+    if (std::filesystem::exists(manifestPath) || std::filesystem::exists(rootDir + "/images/" + imageId + ".tar.gz"))
+        throw std::runtime_error("[ERROR] Image with ID " + imageId + " already exists");
+    if (archive != "-" && !std::filesystem::exists(archive))
+        throw std::runtime_error("[ERROR] Archive " + archive + " does not exist");
+
+    if (archive != "-" && isLayeredArchive(archive))
+    {
+        LOG_F(INFO, "Importing layered image %s from %s", imageId.c_str(), archive.c_str());
+        importLayeredArchive(rootDir, imageId, archive);
+        std::cout << "Imported image " << imageId << std::endl;
+        LOG_F(INFO, "Import image %s: SUCCESS", imageId.c_str());
+        return;
+    }
+
+    Layer layer { DiffLayer, generateContainerId() };
+    std::string layerDir = getLayerDir(rootDir, layer);
+    // The layer is only renamed into place once the manifest refers to it, see removeUnusedLayers()
+    std::string partialDir = layerDir + ".partial";
+    if (!std::filesystem::create_directories(partialDir))
+        throw std::runtime_error("Create directory " + partialDir + ": FAILED");
+    std::filesystem::create_directories(rootDir + "/images");
+
+    LOG_F(INFO, "Importing image %s from %s", imageId.c_str(), archive.c_str());
+    if (system(("tar -xpf " + archive + " -C " + partialDir).c_str()) != 0)
+    {
+        std::filesystem::remove_all(partialDir);
+        throw std::runtime_error("Import image " + imageId + ": FAILED");
+    }
+
+    writeManifest(manifestPath, { layer });
+    std::filesystem::rename(partialDir, layerDir);
+    std::cout << "Imported image " << imageId << std::endl;
+    LOG_F(INFO, "Import image %s: SUCCESS", imageId.c_str());
+}
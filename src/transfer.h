@@ -0,0 +1,10 @@
+#ifndef CONTAINER_CPP_TRANSFER_H
+#define CONTAINER_CPP_TRANSFER_H
+
+#include <string>
+
+void copyFiles(const std::string& rootDir, const std::string& source, const std::string& dest);
+void exportRootfs(const std::string& rootDir, const std::string& id);
+void importImage(const std::string& rootDir, const std::string& imageId, const std::string& archive);
+
+#endif //CONTAINER_CPP_TRANSFER_H
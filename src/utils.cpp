@@ -8,11 +8,13 @@
 #include <fstream>
 #include <iostream>
 #include <sstream>
-#include <arpa/inet.h>
 #include <array>
 #include <regex>
 #include <utility>
 #include <iomanip>
+#include <map>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 
 /**
  * Checks if a string ends with the given suffix. Returns true if it does, false otherwise.
@@ -76,37 +78,6 @@ bool appendToFile(const std::string filePath, const std::string text)
 }
 
 
-/**
- * Increments the given IPv4 address represented as a C++ string by
- * a number that equals to the value of 'iter'.
- *
- * Implementation from:
- * https://stackoverflow.com/questions/1505676/how-do-i-increment-an-ip-address-represented-as-a-string
- * @return the incremented IPv4 address.
- */
-std::string getNextIp(std::string baseIp, const int iter = 1)
-{
-    std::string nextIp = std::move(baseIp);
-    for (int i = 0; i < iter; i++)
-    {
-        // convert the input IP address to an integer
-        in_addr_t address = inet_addr(nextIp.c_str());
-
-        // add one to the value (making sure to get the correct byte orders)
-        address = ntohl(address);
-        address += 1;
-        address = htonl(address);
-
-        // pack the address into the struct inet_ntoa expects
-        struct in_addr address_struct;
-        address_struct.s_addr = address;
-
-        // convert back to a string
-        nextIp = std::string(inet_ntoa(address_struct));
-    }
-    return nextIp;
-}
-
 /**
  * A wrapper around the 'system()' function so that the stdout is captured
  * and returned.
@@ -184,4 +155,160 @@ std::string trimEnd(std::string text)
                             std::not1(std::ptr_fun<int, int>(std::isspace))).base(), text.end());
     return text;
 
-}
\ No newline at end of file
+}
+
+/**
+ * Reads a file which contains one 'key=value' pair per line into a map.
+ * Returns an empty map if the file cannot be opened.
+ */
+std::map<std::string, std::string> readProperties(const std::string& filePath)
+{
+    std::map<std::string, std::string> properties;
+    std::ifstream file(filePath);
+    std::string line;
+    while (std::getline(file, line))
+    {
+        size_t pos = line.find('=');
+        if (pos != std::string::npos)
+            properties[line.substr(0, pos)] = line.substr(pos + 1);
+    }
+    return properties;
+}
+
+/**
+ * Writes the given map to a file as one 'key=value' pair per line, replacing
+ * the previous content of the file.
+ * @return if action has been successful, returns true. Otherwise, returns false.
+ */
+bool writeProperties(const std::string& filePath, const std::map<std::string, std::string>& properties)
+{
+    std::ofstream file(filePath, std::ios::out | std::ios::trunc);
+    if (file.fail())
+        return false;
+
+    for (const auto& property : properties)
+        file << property.first << "=" << property.second << std::endl;
+    return true;
+}
+
+/**
+ * Copies the content of one file to another without passing the data through
+ * user space. Tries the following methods in order:
+ * 1. Cloning the file with the FICLONE ioctl, which shares the extents of the
+ * file on file systems which support reflinks (e.g. btrfs, xfs).
+ * 2. copy_file_range(), which copies the data inside the kernel.
+ * 3. read() and write(), if neither of the above is supported.
+ *
+ * @throw runtime_error if the copy fails.
+ */
+void copyFileContents(int sourceFd, int destFd)
+{
+    if (ioctl(destFd, FICLONE, sourceFd) == 0)
+        return;
+
+    ssize_t copied;
+    while ((copied = copy_file_range(sourceFd, nullptr, destFd, nullptr, 1 << 30, 0)) > 0) { }
+    if (copied == 0)
+        return;
+    if (errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP && errno != ENOSYS)
+        throw std::runtime_error("copy_file_range: FAILED [Errno " + std::to_string(errno) + "]");
+
+    std::array<char, 65536> buffer{};
+    ssize_t bytesRead;
+    while ((bytesRead = read(sourceFd, buffer.data(), buffer.size())) > 0)
+    {
+        for (ssize_t offset = 0; offset < bytesRead; )
+        {
+            ssize_t written = write(destFd, buffer.data() + offset, bytesRead - offset);
+            if (written < 0)
+                throw std::runtime_error("Write file: FAILED [Errno " + std::to_string(errno) + "]");
+            offset += written;
+        }
+    }
+    if (bytesRead < 0)
+        throw std::runtime_error("Read file: FAILED [Errno " + std::to_string(errno) + "]");
+}
+
+
+/**
+ * Reads a JSON string starting at the opening quote at 'pos' and advances 'pos'
+ * past the closing quote. Only the escape sequences which may appear in paths and
+ * digests are decoded.
+ */
+std::string readJsonString(const std::string& json, size_t& pos)
+{
+    std::string value;
+    for (pos++; pos < json.size() && json[pos] != '"'; pos++)
+    {
+        if (json[pos] == '\\' && pos + 1 < json.size())
+            pos++;
+        value += json[pos];
+    }
+    pos++;
+    return value;
+}
+
+/**
+ * A minimal JSON scanner which finds the first array with the given key and returns
+ * its elements. If 'field' is empty, the elements are expected to be strings. Otherwise,
+ * the elements are expected to be objects and the string values of 'field' in them
+ * are returned, e.g. the digests of the layers in an OCI image manifest.
+ * Returns an empty vector if the key cannot be found.
+ */
+std::vector<std::string> findJsonArray(const std::string& json, const std::string& key, const std::string& field)
+{
+    std::vector<std::string> values;
+    size_t pos = json.find("\"" + key + "\"");
+    if (pos == std::string::npos)
+        return values;
+    pos = json.find('[', pos + key.size() + 2);
+    if (pos == std::string::npos)
+        return values;
+
+    // Depth of nested arrays and objects relative to the elements of the array
+    int depth = 0;
+    std::string lastKey;
+    for (pos++; pos < json.size(); )
+    {
+        char c = json[pos];
+        if (c == '"')
+        {
+            std::string text = readJsonString(json, pos);
+            size_t next = json.find_first_not_of(" \t\r\n", pos);
+            bool isKey = next != std::string::npos && json[next] == ':';
+            if (field.empty() && depth == 0)
+                values.push_back(text);
+            else if (!field.empty() && depth == 1 && !isKey && lastKey == field)
+                values.push_back(text);
+            lastKey = isKey ? text : "";
+            continue;
+        }
+        if (c == '[' || c == '{')
+            depth++;
+        else if (c == ']' || c == '}')
+        {
+            if (depth-- == 0)
+                break;
+        }
+        pos++;
+    }
+    return values;
+}
+
+
+/**
+ * Computes the 64-bit FNV-1a hash of the given text.
+ * @return the hash as a hexadecimal string of 16 characters.
+ */
+std::string hashString(const std::string& text)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : text)
+    {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    std::stringstream hex;
+    hex << std::hex << std::setw(16) << std::setfill('0') << hash;
+    return hex.str();
+}
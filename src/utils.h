@@ -5,6 +5,7 @@
 #ifndef CONTAINER_CPP_UTILS_H
 #define CONTAINER_CPP_UTILS_H
 #include <cmath>
+#include <map>
 
 /**
  * Converts file size to human readable form
@@ -28,9 +29,13 @@ private: friend
 bool endsWith(const std::string& fullString, const std::string& suffix);
 std::string generateContainerId(size_t length = 12);
 bool appendToFile(std::string filePath, std::string text);
-std::string getNextIp(std::string baseIp, int iter);
 std::string systemWithOutput(const std::string& command);
 std::vector<std::string> split(std::string text, std::string delimiter);
 std::string getHumanReadableFileSize(std::uintmax_t size);
 std::string trimEnd(std::string text);
+std::map<std::string, std::string> readProperties(const std::string& filePath);
+bool writeProperties(const std::string& filePath, const std::map<std::string, std::string>& properties);
+void copyFileContents(int sourceFd, int destFd);
+std::string hashString(const std::string& text);
+std::vector<std::string> findJsonArray(const std::string& json, const std::string& key, const std::string& field = "");
 #endif //CONTAINER_CPP_UTILS_H
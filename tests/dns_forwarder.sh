@@ -0,0 +1,144 @@
+#!/usr/bin/env bash
+#
+# Runs a container with --dns against a stub upstream server on a local port and checks
+# the forwarder which kapsel serves on the gateway address of the network:
+# 1. The container's /etc/resolv.conf points to the gateway.
+# 2. A repeated query is answered from the cache without reaching the upstream server.
+# 3. The container's ID resolves to its address without reaching the upstream server.
+# 4. An NXDOMAIN response of the upstream server is passed through.
+#
+# Usage: sudo tests/dns_forwarder.sh [kapsel] [root-dir]
+# The rootfs (ROOTFS, by default ubuntu) needs sh, cat and sleep, and the host python3.
+# The container runs on a network of its own (SUBNET, by default 10.237.0.0/24), so no
+# other forwarder shares the gateway address and its cache.
+
+set -u
+
+KAPSEL=${1:-./build/kapsel}
+ROOT_DIR=${2:-../res}
+ROOTFS=${ROOTFS:-ubuntu}
+SUBNET=${SUBNET:-10.237.0.0/24}
+
+fail() {
+    echo "FAIL: $*"
+    exit 1
+}
+
+[ "$(id -u)" -eq 0 ] || fail "must be run as root"
+[ -x "$KAPSEL" ] || fail "$KAPSEL is not executable"
+command -v python3 > /dev/null || fail "python3 is not installed"
+
+workDir=$(mktemp -d)
+# Container IDs are 9 characters long, so that the names of their interfaces are unique
+prefix=$(printf "q%03d" $(( $$ % 1000 )))
+id=${prefix}00001
+cleanup() {
+    touch "$workDir/done"
+    [ -n "${upstreamPid:-}" ] && kill "$upstreamPid" 2> /dev/null
+    wait
+    "$KAPSEL" -r "$ROOT_DIR" network rm "$prefix" > /dev/null 2>&1
+    rm -rf "$workDir"
+}
+trap cleanup EXIT
+
+# Answers names starting with 'missing' with NXDOMAIN and all others with 192.0.2.1, and
+# logs the name of every query it receives
+python3 - "$workDir" << 'EOF' &
+import os, socket, struct, sys
+workDir = sys.argv[1]
+server = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+server.bind(("127.0.0.1", 0))
+with open(workDir + "/port.tmp", "w") as file:
+    file.write(str(server.getsockname()[1]))
+os.rename(workDir + "/port.tmp", workDir + "/port")
+while True:
+    query, client = server.recvfrom(4096)
+    offset, labels = 12, []
+    while query[offset]:
+        labels.append(query[offset + 1:offset + 1 + query[offset]].decode())
+        offset += query[offset] + 1
+    question = query[12:offset + 5]
+    name = ".".join(labels)
+    with open(workDir + "/upstream.log", "a") as log:
+        log.write(name + "\n")
+    if name.startswith("missing"):
+        response = query[:2] + b"\x81\x83" + struct.pack(">HHHH", 1, 0, 0, 0) + question
+    else:
+        response = query[:2] + b"\x81\x80" + struct.pack(">HHHH", 1, 1, 0, 0) + question
+        response += b"\xc0\x0c" + struct.pack(">HHIH", 1, 1, 300, 4) + bytes([192, 0, 2, 1])
+    server.sendto(response, client)
+EOF
+upstreamPid=$!
+for _ in $(seq 1 50); do
+    [ -s "$workDir/port" ] && break
+    sleep 0.1
+done
+[ -s "$workDir/port" ] || fail "the stub upstream server did not start"
+: > "$workDir/upstream.log"
+
+# Prints the response code and the A records of the answer to a query sent to the
+# forwarder at the given address
+query() {
+    python3 - "$1" "$2" << 'EOF'
+import random, socket, struct, sys
+server, name = sys.argv[1], sys.argv[2]
+query = struct.pack(">HHHHHH", random.randrange(65536), 0x0100, 1, 0, 0, 0)
+query += b"".join(bytes([len(label)]) + label.encode() for label in name.split(".")) + b"\0"
+query += struct.pack(">HH", 1, 1)
+client = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+client.settimeout(3)
+client.sendto(query, (server, 53))
+try:
+    response = client.recv(4096)
+except socket.timeout:
+    print("timeout")
+    sys.exit()
+answers, offset, addresses = struct.unpack(">H", response[6:8])[0], len(query), []
+for _ in range(answers):
+    offset += 2 if response[offset] & 0xc0 == 0xc0 else response.index(0, offset) + 1 - offset
+    recordType, _, _, length = struct.unpack(">HHIH", response[offset:offset + 10])
+    if recordType == 1:
+        addresses.append(socket.inet_ntoa(response[offset + 10:offset + 14]))
+    offset += 10 + length
+print(response[3] & 0xf, *addresses)
+EOF
+}
+
+upstream_queries() {
+    grep -cx "$1" "$workDir/upstream.log"
+}
+
+"$KAPSEL" -r "$ROOT_DIR" network create "$prefix" --subnet "$SUBNET" > /dev/null || fail "could not create network $prefix"
+command="/bin/sh -c 'cat /etc/resolv.conf > /bench/resolv.conf; cat /etc/hosts > /bench/hosts; "
+command+="while [ ! -e /bench/done ]; do sleep 0.1; done'"
+"$KAPSEL" -r "$ROOT_DIR" -t "$ROOTFS" -i "$id" --bridge "$prefix" -v "$workDir:/bench" \
+    --dns --dns-upstream "127.0.0.1:$(cat "$workDir/port")" run "$command" > "$workDir/$id.log" 2>&1 &
+for _ in $(seq 1 100); do
+    [ -s "$workDir/hosts" ] && break
+    [ "$(jobs -r | wc -l)" -ge 2 ] || fail "container exited: $(tail -3 "$workDir/$id.log")"
+    sleep 0.1
+done
+[ -s "$workDir/hosts" ] || fail "container did not start"
+
+containerIp=$(awk -v id="$id" '$2 == id { print $1 }' "$workDir/hosts")
+gateway=$(awk '$1 == "nameserver" { print $2; exit }' "$workDir/resolv.conf")
+[ -n "$containerIp" ] || fail "no address for $id in /etc/hosts"
+bridgeIp=$(ip -4 -o addr show dev "$prefix" | awk '{ split($4, address, "/"); print address[1]; exit }')
+[ "$gateway" = "$bridgeIp" ] || fail "/etc/resolv.conf names $gateway instead of the gateway $bridgeIp"
+
+answer=$(query "$gateway" example.com)
+[ "$answer" = "0 192.0.2.1" ] || fail "example.com was answered with '$answer'"
+answer=$(query "$gateway" example.com)
+[ "$answer" = "0 192.0.2.1" ] || fail "example.com was answered with '$answer' from the cache"
+[ "$(upstream_queries example.com)" -eq 1 ] ||
+    fail "example.com reached the upstream server $(upstream_queries example.com) times"
+
+answer=$(query "$gateway" "$id")
+[ "$answer" = "0 $containerIp" ] || fail "$id was answered with '$answer' instead of $containerIp"
+[ "$(upstream_queries "$id")" -eq 0 ] || fail "$id was forwarded to the upstream server"
+
+answer=$(query "$gateway" missing.example.com)
+[ "$answer" = "3" ] || fail "missing.example.com was answered with '$answer' instead of NXDOMAIN"
+[ "$(upstream_queries missing.example.com)" -eq 1 ] || fail "missing.example.com did not reach the upstream server"
+
+echo "PASS: cached, container and NXDOMAIN answers of the forwarder on $gateway"
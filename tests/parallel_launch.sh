@@ -0,0 +1,93 @@
+#!/usr/bin/env bash
+#
+# Starts COUNT containers on the default bridge in parallel and checks that concurrent
+# launches do not collide:
+# 1. Every container exits with status 0.
+# 2. Every container got an IPv4 address of its own.
+# 3. No veth pair is left on the host and the IPAM bitmap of the bridge holds as many
+#    allocated addresses as before.
+#
+# Usage: sudo tests/parallel_launch.sh [kapsel] [root-dir] [count]
+# The rootfs (ROOTFS, by default ubuntu) needs sh, cat and sleep.
+# Run it on an otherwise idle host, since containers started in the meantime change
+# the number of allocated addresses.
+
+set -u
+
+KAPSEL=${1:-./build/kapsel}
+ROOT_DIR=${2:-../res}
+COUNT=${3:-100}
+ROOTFS=${ROOTFS:-ubuntu}
+IPAM_FILE=$ROOT_DIR/network/kapsel.ipam
+
+# Counts the set bits of the bitmap which follows the 16-byte header of an IPAM file
+count_allocated_bits() {
+    [ -f "$IPAM_FILE" ] || { echo 0; return; }
+    od -An -v -tu1 -j16 "$IPAM_FILE" | awk '{
+        for (i = 1; i <= NF; i++)
+            for (byte = $i; byte > 0; byte = int(byte / 2))
+                bits += byte % 2
+    } END { print bits + 0 }'
+}
+
+fail() {
+    echo "FAIL: $*"
+    exit 1
+}
+
+[ "$(id -u)" -eq 0 ] || fail "must be run as root"
+[ -x "$KAPSEL" ] || fail "$KAPSEL is not executable"
+
+outputDir=$(mktemp -d)
+trap 'rm -rf "$outputDir"' EXIT
+# Container IDs are 9 characters long, so that the names of their interfaces are unique
+prefix=$(printf "p%03d" $(( $$ % 1000 )))
+bitsBefore=$(count_allocated_bits)
+
+# Addresses are reused once released, so the containers wait for each other before exiting
+mkdir "$outputDir/barrier"
+command="/bin/sh -c 'cat /etc/hosts; : > /barrier/\$(cat /etc/hostname); while [ ! -e /barrier/go ]; do sleep 0.1; done'"
+
+echo "Starting $COUNT containers"
+start=$(date +%s%N)
+for i in $(seq 1 "$COUNT"); do
+    id=$(printf "%s%05d" "$prefix" "$i")
+    ( "$KAPSEL" -r "$ROOT_DIR" -t "$ROOTFS" -i "$id" --network bridge -v "$outputDir/barrier:/barrier" \
+        run "$command" > "$outputDir/$id.log" 2>&1; echo $? > "$outputDir/$id.status" ) &
+done
+for _ in $(seq 1 600); do
+    [ "$(ls "$outputDir/barrier" | wc -l)" -ge "$COUNT" ] && break
+    [ "$(ls "$outputDir" | grep -c '\.status$')" -gt 0 ] && break
+    sleep 0.1
+done
+echo "$(ls "$outputDir/barrier" | wc -l) containers running at once after $(( ($(date +%s%N) - start) / 1000000 )) ms"
+touch "$outputDir/barrier/go"
+wait
+end=$(date +%s%N)
+echo "All containers exited after $(( (end - start) / 1000000 )) ms"
+
+failed=0
+for status in "$outputDir"/*.status; do
+    if [ "$(cat "$status")" -ne 0 ]; then
+        echo "Container $(basename "$status" .status) exited with status $(cat "$status"):"
+        tail -5 "${status%.status}.log"
+        failed=$((failed + 1))
+    fi
+done
+[ "$failed" -eq 0 ] || fail "$failed of $COUNT containers failed"
+
+# The hosts file of each container maps its ID to its address
+for log in "$outputDir"/*.log; do
+    id=$(basename "$log" .log)
+    awk -v id="$id" '$2 == id && $1 ~ /^[0-9]+\.[0-9]+\.[0-9]+\.[0-9]+$/ { print $1 }' "$log"
+done | sort > "$outputDir/ips"
+[ "$(wc -l < "$outputDir/ips")" -eq "$COUNT" ] || fail "only $(wc -l < "$outputDir/ips") containers reported an address"
+duplicates=$(uniq -d "$outputDir/ips")
+[ -z "$duplicates" ] || fail "addresses assigned more than once: $duplicates"
+
+leftover=$(ip -br link | grep -c "@$prefix" || true)
+[ "$leftover" -eq 0 ] || fail "$leftover interfaces of the containers are left on the host"
+bitsAfter=$(count_allocated_bits)
+[ "$bitsAfter" -eq "$bitsBefore" ] || fail "$((bitsAfter - bitsBefore)) addresses are still allocated"
+
+echo "PASS: $COUNT containers with distinct addresses, nothing left behind"